@@ -0,0 +1,519 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "cgp.h"
+
+#define BATCH_LINE_MAX      0x1000
+#define BATCH_ENTRIES_MAX   0x400
+#define BATCH_JOBS_MIN      0x40
+#define BATCH_WRITE_CHUNK   0x100000
+
+enum batch_stages {
+    STAGE_READ,
+    STAGE_PARSE,
+    STAGE_DEOBFUSCATE,
+    STAGE_BUILD,
+    STAGE_WRITE,
+    STAGES
+};
+
+static const char *stage_names[] = {
+    "read", "parse", "deobfuscate", "build", "write"
+};
+
+typedef uint32_t (*builder_t)(cgp_ctx *ctx, uint8_t **out_buff);
+
+static uint32_t batch_build_layout(cgp_ctx *ctx, uint8_t **out_buff)
+{
+    return cgp_ctx_build_layout(ctx, NULL, out_buff);
+}
+
+static const struct {
+    const char *name;
+    builder_t build;
+} builders[] = {
+    {"build",       cgp_ctx_build},
+    {"spaghetti",   cgp_ctx_build_spaghetti},
+    {"nop",         cgp_ctx_build_reduntant_nop},
+    {"layout",      batch_build_layout},
+};
+
+/* one blob of code */
+typedef struct batch_job {
+    char *path;
+    uint32_t *entries;
+    uint32_t entries_count;
+
+    uint32_t in_size, out_size;
+    const char *error;
+    double latency[STAGES];
+} BatchJob;
+
+typedef struct batch {
+    BatchJob *jobs;
+    uint32_t jobs_count, jobs_size;
+    uint32_t next;              /* next job to take by a thread */
+
+    const char *out_dir;
+    uint32_t builder;
+    uint32_t deobfuscate;
+    uint32_t seed;              /* 0 keeps random seed */
+} Batch;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [-j threads] [-b build|spaghetti|nop|layout] [-d] "
+           "[-s seed] [-o out dir] <manifest | directory>\n\n"
+           "manifest line: <path> [entry offset ...], '#' starts comment\n"
+           "files of a directory are parsed from offset 0\n", name);
+}
+
+static BatchJob *batch_add(Batch *batch, const char *path)
+{
+    BatchJob *job;
+
+    if (batch->jobs_count == batch->jobs_size) {
+        batch->jobs_size = batch->jobs_size ? batch->jobs_size * 2
+                                            : BATCH_JOBS_MIN;
+        batch->jobs = (BatchJob*) realloc(batch->jobs,
+                                          sizeof(BatchJob) * batch->jobs_size);
+        if (!batch->jobs) {
+            printf("can't allocate jobs\n");
+            exit(1);
+        }
+    }
+
+    job = &batch->jobs[batch->jobs_count++];
+    memset(job, 0, sizeof(BatchJob));
+    job->path = strdup(path);
+
+    return job;
+}
+
+/* every regular file of a directory, entry point 0 */
+static int batch_read_dir(Batch *batch, const char *dir_name)
+{
+    char path[BATCH_LINE_MAX];
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+
+    dir = opendir(dir_name);
+    if (!dir)
+        return -1;
+
+    while ((entry = readdir(dir))) {
+        snprintf(path, sizeof(path), "%s/%s", dir_name, entry->d_name);
+
+        if (stat(path, &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        batch_add(batch, path);
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+static int batch_read_manifest(Batch *batch, const char *file_name)
+{
+    char line[BATCH_LINE_MAX], *token, *end, *save;
+    uint32_t entries[BATCH_ENTRIES_MAX], count, number = 0;
+    BatchJob *job;
+    FILE *fh;
+
+    fh = fopen(file_name, "r");
+    if (!fh)
+        return -1;
+
+    while (fgets(line, sizeof(line), fh)) {
+        number++;
+
+        if ((token = strchr(line, '#')))
+            *token = 0;
+
+        token = strtok_r(line, " \t\r\n", &save);
+        if (!token)
+            continue;
+
+        job = batch_add(batch, token);
+
+        for (count = 0 ; (token = strtok_r(NULL, " \t\r\n", &save)) ; ) {
+            if (count == BATCH_ENTRIES_MAX) {
+                printf("%s:%u: too many entry points\n", file_name, number);
+                break;
+            }
+
+            entries[count] = (uint32_t) strtoul(token, &end, 0);
+
+            if (*end) {
+                printf("%s:%u: bad entry point '%s'\n", file_name, number,
+                       token);
+                continue;
+            }
+
+            count++;
+        }
+
+        if (count) {
+            job->entries = (uint32_t*) malloc(sizeof(uint32_t) * count);
+            memcpy(job->entries, entries, sizeof(uint32_t) * count);
+            job->entries_count = count;
+        }
+    }
+
+    fclose(fh);
+    return 0;
+}
+
+static uint8_t *batch_read_file(const char *file_name, uint32_t *size)
+{
+    struct stat st;
+    uint8_t *buff;
+    uint32_t done = 0;
+    ssize_t length;
+    int fd;
+
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) || !st.st_size || st.st_size > 0x7FFFFFFF) {
+        close(fd);
+        return NULL;
+    }
+
+    buff = (uint8_t*) malloc(st.st_size);
+
+    while (buff && done < (uint32_t) st.st_size) {
+        length = read(fd, &buff[done], st.st_size - done);
+
+        if (length <= 0) {
+            if (length < 0 && errno == EINTR)
+                continue;
+
+            free(buff);
+            buff = NULL;
+            break;
+        }
+
+        done += (uint32_t) length;
+    }
+
+    close(fd);
+
+    *size = done;
+    return buff;
+}
+
+/* large chunks, so an output costs few system calls */
+static int batch_write_file(const char *file_name, const uint8_t *buff,
+                            uint32_t size)
+{
+    uint32_t done = 0, chunk;
+    ssize_t length;
+    int fd, result = 0;
+
+    fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    while (done < size) {
+        chunk = size - done < BATCH_WRITE_CHUNK ? size - done
+                                                : BATCH_WRITE_CHUNK;
+        length = write(fd, &buff[done], chunk);
+
+        if (length < 0) {
+            if (errno == EINTR)
+                continue;
+
+            result = -1;
+            break;
+        }
+
+        done += (uint32_t) length;
+    }
+
+    if (close(fd))
+        result = -1;
+
+    return result;
+}
+
+/* parse, deobfuscate, build and write one blob, stages are timed */
+static void batch_run(Batch *batch, cgp_ctx *ctx, BatchJob *job)
+{
+    char out_name[BATCH_LINE_MAX];
+    const char *base_name;
+    uint8_t *input_code, *output_code;
+    double start;
+    int result;
+
+    start = now();
+    input_code = batch_read_file(job->path, &job->in_size);
+    job->latency[STAGE_READ] = now() - start;
+
+    if (!input_code) {
+        job->error = "can't read";
+        return;
+    }
+
+    for (uint32_t i = 0 ; i < job->entries_count ; i++) {
+        if (job->entries[i] >= job->in_size) {
+            job->error = "entry point out of code";
+            free(input_code);
+            return;
+        }
+    }
+
+    start = now();
+
+    /* the pool is parallel already, so one thread per blob */
+    if (job->entries_count > 1) {
+        result = cgp_ctx_init_entries(ctx, input_code, job->in_size,
+                                      job->entries, job->entries_count, 1);
+    } else {
+        result = cgp_ctx_init(ctx, input_code, job->in_size,
+                              job->entries_count ? job->entries[0] : 0);
+    }
+
+    job->latency[STAGE_PARSE] = now() - start;
+
+    if (result) {
+        job->error = "can't parse";
+        free(input_code);
+        return;
+    }
+
+    if (batch->seed)
+        cgp_ctx_set_seed(ctx, batch->seed);
+
+    if (batch->deobfuscate) {
+        start = now();
+        cgp_ctx_remove_simple_obfuscation(ctx);
+        job->latency[STAGE_DEOBFUSCATE] = now() - start;
+    }
+
+    start = now();
+    job->out_size = builders[batch->builder].build(ctx, &output_code);
+    job->latency[STAGE_BUILD] = now() - start;
+
+    cgp_ctx_free(ctx);
+    free(input_code);
+
+    if (!output_code) {
+        job->error = "can't build";
+        return;
+    }
+
+    base_name = strrchr(job->path, '/');
+    base_name = base_name ? base_name + 1 : job->path;
+    snprintf(out_name, sizeof(out_name), "%s/%s.out", batch->out_dir,
+             base_name);
+
+    start = now();
+    if (batch_write_file(out_name, output_code, job->out_size))
+        job->error = "can't write";
+    job->latency[STAGE_WRITE] = now() - start;
+
+    free(output_code);
+}
+
+static void *batch_worker(void *arg)
+{
+    Batch *batch = (Batch*) arg;
+    cgp_ctx *ctx;
+    uint32_t i;
+
+    ctx = cgp_ctx_create();
+    if (!ctx) {
+        printf("can't create context\n");
+        exit(1);
+    }
+
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+           batch->jobs_count)
+        batch_run(batch, ctx, &batch->jobs[i]);
+
+    cgp_ctx_destroy(ctx);
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, uint32_t count, double q)
+{
+    return sorted[(uint32_t) (q * (count - 1) + 0.5)];
+}
+
+/* returns count of failed jobs */
+static uint32_t batch_report(Batch *batch, uint32_t threads, double elapsed)
+{
+    uint64_t in_bytes = 0, out_bytes = 0;
+    uint32_t done = 0, failed = 0;
+    double *values;
+
+    for (uint32_t i = 0 ; i < batch->jobs_count ; i++) {
+        if (batch->jobs[i].error) {
+            printf("%s: %s\n", batch->jobs[i].path, batch->jobs[i].error);
+            failed++;
+            continue;
+        }
+
+        in_bytes += batch->jobs[i].in_size;
+        out_bytes += batch->jobs[i].out_size;
+        done++;
+    }
+
+    printf("\n%u jobs, %u failed, %u threads, builder %s%s\n",
+           batch->jobs_count, failed, threads, builders[batch->builder].name,
+           batch->deobfuscate ? " after deobfuscation" : "");
+    printf("input %.2f MB, output %.2f MB in %.3f s: %.2f MB/s, "
+           "%.0f jobs/s\n", in_bytes / 1e6, out_bytes / 1e6, elapsed,
+           in_bytes / 1e6 / elapsed, done / elapsed);
+
+    if (!done)
+        return failed;
+
+    values = (double*) malloc(sizeof(double) * done);
+
+    printf("\n%-12s %10s %10s %10s %10s\n", "stage", "p50 us", "p90 us",
+           "p99 us", "max us");
+
+    for (uint32_t stage = 0 ; stage < STAGES ; stage++) {
+        if (stage == STAGE_DEOBFUSCATE && !batch->deobfuscate)
+            continue;
+
+        done = 0;
+        for (uint32_t i = 0 ; i < batch->jobs_count ; i++) {
+            if (!batch->jobs[i].error)
+                values[done++] = batch->jobs[i].latency[stage] * 1e6;
+        }
+
+        qsort(values, done, sizeof(double), compare_double);
+
+        printf("%-12s %10.0f %10.0f %10.0f %10.0f\n", stage_names[stage],
+               percentile(values, done, 0.5), percentile(values, done, 0.9),
+               percentile(values, done, 0.99), values[done - 1]);
+    }
+
+    free(values);
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    Batch batch;
+    pthread_t *threads;
+    struct stat st;
+    uint32_t threads_count = 0, failed;
+    double start;
+    int opt;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.out_dir = "out";
+
+    while ((opt = getopt(argc, argv, "j:b:ds:o:h")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads_count = (uint32_t) atoi(optarg);
+                break;
+
+            case 'b':
+                for (batch.builder = 0 ; batch.builder <
+                     sizeof(builders) / sizeof(builders[0]) ; batch.builder++) {
+                    if (!strcmp(optarg, builders[batch.builder].name))
+                        break;
+                }
+
+                if (batch.builder == sizeof(builders) / sizeof(builders[0])) {
+                    printf("unknown builder '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'd':
+                batch.deobfuscate = 1;
+                break;
+
+            case 's':
+                batch.seed = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+
+            case 'o':
+                batch.out_dir = optarg;
+                break;
+
+            default:
+                usage(argv[0]);
+                return opt != 'h';
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (stat(argv[optind], &st) ||
+        (S_ISDIR(st.st_mode) ? batch_read_dir(&batch, argv[optind])
+                             : batch_read_manifest(&batch, argv[optind]))) {
+        printf("can't read '%s'\n", argv[optind]);
+        return 1;
+    }
+
+    if (mkdir(batch.out_dir, 0755) && errno != EEXIST) {
+        printf("can't create '%s'\n", batch.out_dir);
+        return 1;
+    }
+
+    if (!threads_count)
+        threads_count = (uint32_t) sysconf(_SC_NPROCESSORS_ONLN);
+    if (!threads_count)
+        threads_count = 1;
+    if (threads_count > batch.jobs_count && batch.jobs_count)
+        threads_count = batch.jobs_count;
+
+    threads = (pthread_t*) malloc(sizeof(pthread_t) * threads_count);
+
+    start = now();
+
+    for (uint32_t i = 0 ; i < threads_count ; i++)
+        pthread_create(&threads[i], NULL, batch_worker, &batch);
+
+    for (uint32_t i = 0 ; i < threads_count ; i++)
+        pthread_join(threads[i], NULL);
+
+    failed = batch_report(&batch, threads_count, now() - start);
+
+    for (uint32_t i = 0 ; i < batch.jobs_count ; i++) {
+        free(batch.jobs[i].path);
+        free(batch.jobs[i].entries);
+    }
+
+    free(batch.jobs);
+    free(threads);
+
+    return failed != 0;
+}
@@ -0,0 +1,465 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "cgp.h"
+#include "lde.h"
+#include "synth.h"
+
+#define DEFAULT_INSNS       30000
+#define DEFAULT_BRANCH_PCT  15
+#define DEFAULT_ROUTINE     64
+#define BENCH_ROUNDS        5
+#define BENCH_IR_FILE       "bench.ir"
+#define BENCH_EDITS         2000
+
+typedef uint32_t (*builder_t)(cgp_ctx *ctx, uint8_t **out_buff);
+
+static const struct {
+    const char *name;
+    builder_t build;
+} builders[] = {
+    {"cgp_build",               cgp_ctx_build},
+    {"cgp_build_spaghetti",     cgp_ctx_build_spaghetti},
+    {"cgp_build_reduntant_nop", cgp_ctx_build_reduntant_nop},
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [insns] [branch percent] [routine size] [backward] "
+           "[threads]\n", name);
+}
+
+/* every routine of synthetic code starts right after RET */
+static uint32_t *find_routines(uint8_t *code, uint32_t size,
+                               uint32_t *count)
+{
+    uint32_t *entries = (uint32_t*) malloc(sizeof(uint32_t) * (size + 1));
+    uint32_t length;
+
+    *count = 0;
+    entries[(*count)++] = 0;
+
+    for (uint32_t offset = 0 ; offset < size ; offset += length) {
+        length = lde_get_length(&code[offset], NULL);
+        if (!length)
+            break;
+
+        if (code[offset] == 0xC3 && offset + length < size)
+            entries[(*count)++] = offset + length;
+    }
+
+    return entries;
+}
+
+/* parse of all routines as entry points from 1 to max_threads threads */
+static void bench_scaling(synth_params *params, uint8_t *code,
+                          uint32_t code_size, uint32_t max_threads)
+{
+    cgp_ctx *ctx;
+    uint32_t *entries, entries_count;
+    double start, best, single = 0;
+
+    entries = find_routines(code, code_size, &entries_count);
+
+    printf("\nparallel parse of %u entry points\n", entries_count);
+    printf("%-24s %12s %12s\n", "threads", "parse insn/s", "speedup");
+
+    for (uint32_t threads = 1 ; threads <= max_threads ; ) {
+        best = 1e9;
+
+        for (int i = 0 ; i < BENCH_ROUNDS ; i++) {
+            ctx = cgp_ctx_create();
+            if (!ctx) {
+                printf("can't create context\n");
+                exit(1);
+            }
+
+            start = now();
+            cgp_ctx_init_entries(ctx, code, code_size, entries,
+                                 entries_count, threads);
+            if (now() - start < best)
+                best = now() - start;
+
+            cgp_ctx_destroy(ctx);
+        }
+
+        if (threads == 1)
+            single = best;
+
+        printf("%-24u %12.0f %12.2f\n", threads, params->insns / best,
+               single / best);
+
+        if (threads == max_threads)
+            break;
+
+        /* last step is count of CPUs even if it isn't a power of two */
+        threads = threads * 2 < max_threads ? threads * 2 : max_threads;
+    }
+
+    free(entries);
+}
+
+/* export of parsed graph in every format to /dev/null */
+static void bench_export(uint8_t *code, uint32_t code_size)
+{
+    static const char *formats[] = {"GDL", "DOT", "JSONL"};
+    cgp_build_info info;
+    cgp_ctx *ctx;
+    double start, best;
+    int fd;
+
+    ctx = cgp_ctx_create();
+    fd = open("/dev/null", O_WRONLY);
+    if (!ctx || fd < 0) {
+        printf("can't prepare export\n");
+        exit(1);
+    }
+
+    cgp_ctx_init(ctx, code, code_size, 0);
+    cgp_ctx_build(ctx, &code);
+    cgp_ctx_get_build_info(ctx, &info);
+    free(code);
+
+    printf("\nexport of %u nodes:", info.nodes);
+
+    for (uint32_t format = 0 ; format < 3 ; format++) {
+        best = 1e9;
+
+        for (int i = 0 ; i < BENCH_ROUNDS ; i++) {
+            start = now();
+            if (cgp_ctx_export(ctx, fd, format)) {
+                printf("can't export\n");
+                exit(1);
+            }
+            if (now() - start < best)
+                best = now() - start;
+        }
+
+        printf(" %s %.0f node/s", formats[format], info.nodes / best);
+    }
+
+    printf("\n");
+
+    close(fd);
+    cgp_ctx_destroy(ctx);
+}
+
+/* counters of one parse and build per builder, only with CGP_STATS */
+static void bench_stats(uint8_t *code, uint32_t code_size)
+{
+    cgp_stats stats;
+    cgp_ctx *ctx;
+    uint8_t *output_code;
+
+    for (uint32_t b = 0 ; b < sizeof(builders) / sizeof(builders[0]) ; b++) {
+        ctx = cgp_ctx_create();
+        if (!ctx) {
+            printf("can't create context\n");
+            exit(1);
+        }
+
+        if (cgp_ctx_get_stats(ctx, &stats)) {
+            cgp_ctx_destroy(ctx);
+            return;
+        }
+
+        if (b == 0)
+            printf("\nstats (JSON per builder):\n");
+
+        cgp_ctx_init(ctx, code, code_size, 0);
+        cgp_ctx_set_seed(ctx, 1);
+        builders[b].build(ctx, &output_code);
+
+        printf("%-24s ", builders[b].name);
+        fflush(stdout);
+        cgp_ctx_dump_stats(ctx, STDOUT_FILENO);
+
+        free(output_code);
+        cgp_ctx_destroy(ctx);
+    }
+}
+
+/* parse and build with every order of pending branches */
+static void bench_traversal(synth_params *params, uint8_t *code,
+                            uint32_t code_size)
+{
+    static const char *traversals[] = {"DFS", "BFS", "address"};
+    cgp_build_info info;
+    cgp_ctx *ctx;
+    uint8_t *output_code;
+    double start, best_init, best_build;
+
+    printf("\n%-24s %12s %12s %12s\n", "traversal", "parse insn/s",
+           "build node/s", "out bytes");
+
+    for (uint32_t t = 0 ; t < 3 ; t++) {
+        best_init = best_build = 1e9;
+
+        for (int i = 0 ; i < BENCH_ROUNDS ; i++) {
+            ctx = cgp_ctx_create();
+            if (!ctx) {
+                printf("can't create context\n");
+                exit(1);
+            }
+
+            cgp_ctx_set_traversal(ctx, t);
+
+            start = now();
+            cgp_ctx_init(ctx, code, code_size, 0);
+            if (now() - start < best_init)
+                best_init = now() - start;
+
+            start = now();
+            cgp_ctx_build(ctx, &output_code);
+            if (now() - start < best_build)
+                best_build = now() - start;
+
+            cgp_ctx_get_build_info(ctx, &info);
+
+            free(output_code);
+            cgp_ctx_destroy(ctx);
+        }
+
+        printf("%-24s %12.0f %12.0f %12u\n", traversals[t],
+               params->insns / best_init, info.nodes / best_build, info.size);
+    }
+}
+
+/* one NOP inserted and emitted again, against a full build */
+static void bench_incremental(uint8_t *code, uint32_t code_size)
+{
+    static const uint8_t nop = 0x90;
+    cgp_build_info info;
+    cgp_ctx *ctx;
+    const uint8_t *image;
+    uint8_t *output_code;
+    uint32_t nodes, edits = 0, patched = 0;
+    double start, full, incremental;
+
+    ctx = cgp_ctx_create();
+    if (!ctx) {
+        printf("can't create context\n");
+        exit(1);
+    }
+
+    cgp_ctx_init(ctx, code, code_size, 0);
+
+    start = now();
+    cgp_ctx_build(ctx, &output_code);
+    full = now() - start;
+
+    free(output_code);
+    cgp_ctx_get_build_info(ctx, &info);
+    nodes = info.nodes;
+
+    cgp_ctx_build_incremental(ctx, &image);
+    srand(1);
+
+    start = now();
+    for (uint32_t i = 0 ; i < BENCH_EDITS ; i++) {
+        /* nodes which can't be followed by code are refused */
+        if (cgp_ctx_insert_code(ctx, (uint32_t) rand() % nodes, &nop, 1) ==
+            0xFFFFFFFF)
+            continue;
+
+        cgp_ctx_build_incremental(ctx, &image);
+        cgp_ctx_get_build_info(ctx, &info);
+
+        patched += info.patched;
+        edits++;
+    }
+    incremental = now() - start;
+
+    printf("\nincremental build of %u nodes: %.0f edit/s, full build %.0f/s, "
+           "%.1f branches patched per edit\n", nodes, edits / incremental,
+           1 / full, edits ? (double) patched / edits : 0);
+
+    cgp_ctx_destroy(ctx);
+}
+
+/* dominators and loops of all routines */
+static void bench_analysis(uint8_t *code, uint32_t code_size)
+{
+    cgp_analysis_info info;
+    cgp_ctx *ctx;
+    uint32_t *entries, entries_count;
+    double start, best = 1e9;
+
+    ctx = cgp_ctx_create();
+    if (!ctx) {
+        printf("can't create context\n");
+        exit(1);
+    }
+
+    entries = find_routines(code, code_size, &entries_count);
+    cgp_ctx_init_entries(ctx, code, code_size, entries, entries_count, 1);
+
+    for (int i = 0 ; i < BENCH_ROUNDS ; i++) {
+        start = now();
+        cgp_ctx_analyze(ctx, &info);
+        if (now() - start < best)
+            best = now() - start;
+    }
+
+    printf("\nanalysis of %u nodes: %.0f node/s, %u loops, depth %u, "
+           "%u irreducible edges, %u passes\n", info.reachable,
+           info.reachable / best, info.loops, info.max_depth,
+           info.irreducible, info.passes);
+
+    free(entries);
+    cgp_ctx_destroy(ctx);
+}
+
+/* parse against load of saved IR */
+static void bench_ir_cache(uint8_t *code, uint32_t code_size)
+{
+    cgp_ctx *ctx;
+    double start, best_init = 1e9, best_save = 1e9, best_load = 1e9;
+    struct stat st;
+    uint32_t hash = cgp_hash_input(code, code_size);
+
+    ctx = cgp_ctx_create();
+    if (!ctx) {
+        printf("can't create context\n");
+        exit(1);
+    }
+
+    for (int i = 0 ; i < BENCH_ROUNDS ; i++) {
+        start = now();
+        cgp_ctx_init(ctx, code, code_size, 0);
+        if (now() - start < best_init)
+            best_init = now() - start;
+
+        start = now();
+        if (cgp_ctx_save_ir(ctx, code, code_size, BENCH_IR_FILE)) {
+            printf("can't save IR\n");
+            exit(1);
+        }
+        if (now() - start < best_save)
+            best_save = now() - start;
+
+        start = now();
+        if (cgp_ctx_load_ir(ctx, code_size, hash, BENCH_IR_FILE)) {
+            printf("can't load IR\n");
+            exit(1);
+        }
+        if (now() - start < best_load)
+            best_load = now() - start;
+    }
+
+    stat(BENCH_IR_FILE, &st);
+
+    printf("\nIR cache of %ld bytes: parse %.0f us, save %.0f us, "
+           "load %.0f us\n", (long) st.st_size, best_init * 1e6,
+           best_save * 1e6, best_load * 1e6);
+
+    cgp_ctx_destroy(ctx);
+    unlink(BENCH_IR_FILE);
+}
+
+int main(int argc, char *argv[])
+{
+    synth_params params;
+    cgp_build_info info;
+    cgp_ctx *ctx;
+    uint8_t *code, *output_code;
+    uint32_t code_size, output_size = 0, max_threads;
+    double start, best_init, best_build;
+
+    if (argc > 1 && !strcmp(argv[1], "-h")) {
+        usage(argv[0]);
+        return 0;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.insns = argc > 1 ? (uint32_t) atoi(argv[1]) : DEFAULT_INSNS;
+    params.branch_pct = argc > 2 ? (uint32_t) atoi(argv[2])
+                                 : DEFAULT_BRANCH_PCT;
+    params.routine = argc > 3 ? (uint32_t) atoi(argv[3]) : DEFAULT_ROUTINE;
+    params.backward = argc > 4 ? (uint32_t) atoi(argv[4]) : 1;
+    params.seed = 1;
+
+    max_threads = argc > 5 ? (uint32_t) atoi(argv[5])
+                           : (uint32_t) sysconf(_SC_NPROCESSORS_ONLN);
+    if (!max_threads)
+        max_threads = 1;
+
+    code = synth_generate(&params, &code_size);
+    if (!code) {
+        printf("can't generate code\n");
+        return 1;
+    }
+
+    printf("input: %u instructions, %u bytes, %u%% branches, "
+           "routine %u\n", params.insns, code_size, params.branch_pct,
+           params.routine);
+    printf("%-24s %12s %12s %12s %10s %10s\n", "builder", "parse insn/s",
+           "build node/s", "out bytes", "relaxed", "peak KB");
+
+    /* a fresh context for every builder, best of few rounds */
+    for (uint32_t b = 0 ; b < sizeof(builders) / sizeof(builders[0]) ; b++) {
+        best_init = best_build = 1e9;
+
+        for (int i = 0 ; i < BENCH_ROUNDS ; i++) {
+            ctx = cgp_ctx_create();
+            if (!ctx) {
+                printf("can't create context\n");
+                return 1;
+            }
+
+            start = now();
+            cgp_ctx_init(ctx, code, code_size, 0);
+            if (now() - start < best_init)
+                best_init = now() - start;
+
+            cgp_ctx_set_seed(ctx, 1);
+
+            start = now();
+            output_size = builders[b].build(ctx, &output_code);
+            if (now() - start < best_build)
+                best_build = now() - start;
+
+            cgp_ctx_get_build_info(ctx, &info);
+
+            free(output_code);
+            cgp_ctx_destroy(ctx);
+        }
+
+        printf("%-24s %12.0f %12.0f %12u %10u %10ld\n", builders[b].name,
+               params.insns / best_init, info.nodes / best_build,
+               output_size, info.relaxed_branches, peak_rss_kb());
+    }
+
+    bench_stats(code, code_size);
+    bench_traversal(&params, code, code_size);
+    bench_export(code, code_size);
+    bench_analysis(code, code_size);
+    bench_incremental(code, code_size);
+    bench_ir_cache(code, code_size);
+    bench_scaling(&params, code, code_size, max_threads);
+
+    free(code);
+    return 0;
+}
@@ -3,291 +3,305 @@
 #include <time.h>
 #include <string.h>
 #include <stdint.h>
-#include <assert.h>
 #include "cgp.h"
+#include "cgp_internal.h"
+#include "lde.h"
 
-int GetInstructionSize(uint8_t *pOpCode, uint32_t *pdwinstruction_size);
-
-#define OPCODE_X86_JMP_REL8     0xEB
-#define OPCODE_X86_JMP_REL32    0xE9
-#define OPCODE_X86_CALL         0xE8
-#define OPCODE_X86_RET          0xC3
-#define OPCODE_X86_NOP          0x90
-
-#define INVALID_OFFSET          0xFFFFFFFF
-#define INVALID_VALUE           0xFFFFFFFF
-
-#define BRANCH_STACK_LIMIT      0x1000
-#define CODE_BUFFER_LIMIT       0x10000
+#define FLAGS_SCAN_LIMIT        0x10        /* nodes to look for flags use */
 
 enum insert_types {
     INSERT_BEFORE,
     INSERT_AFTER
 };
 
-enum node_types {
-    NODE_LINE,
-    NODE_JMP,
-    NODE_JCC,
-    NODE_CALL,
-    NODE_RET,
-    NODE_LABEL              /* abstract node */
-};
-
-typedef struct node {
-    uint32_t type;
-    uint8_t *data;
-    uint32_t weight;
-    uint32_t offset;        /* absolute offset of data */
-    struct node *BLink;     /* backward */
-    struct node *FLink;     /* forward */
-    struct node *CLink;     /* condition */
-} Node, *pNode;
+/* context behind the context-free API */
+static cgp_ctx default_ctx;
 
-static uint32_t nodes_count;
-static pNode *nodes = NULL, first_node;
+static uint32_t cgp_random(cgp_ctx *ctx, uint32_t seed)
+{
+    ctx->rand_seed = 134775812 * ctx->rand_seed + 1;
+    return (uint32_t) ctx->rand_seed * (long long) seed >> 32;
+}
 
-static uint32_t rand_seed;
+void cgp_randomize(cgp_ctx *ctx)
+{
+    /* contexts created in the same second must not share a sequence */
+    ctx->rand_seed = (uint32_t) time(NULL) ^ (uint32_t) (uintptr_t) ctx;
+}
 
-static uint32_t jcc_count = 0;
-static pNode jcc_stack[BRANCH_STACK_LIMIT];
+static void shuffle_array(cgp_ctx *ctx, void *obj, size_t nmemb, size_t size)
+{
+    void *temp = malloc(size);
+    size_t n = nmemb;
 
-static uint32_t call_count = 0;
-static pNode call_stack[BRANCH_STACK_LIMIT];
+    while (n > 1) {
+        size_t k = cgp_random(ctx, n--);
+        memcpy(temp, (uint8_t*) (obj) + n * size, size);
+        memcpy((uint8_t*)(obj) + n * size, (uint8_t*)(obj) + k * size, size);
+        memcpy((uint8_t*)(obj) + k * size, temp, size);
+    }
 
+    free(temp);
+}
 
-static uint32_t cgp_random(uint32_t seed)
+void cgp_reset_index(cgp_ctx *ctx, uint32_t size)
 {
-    rand_seed = 134775812 * rand_seed + 1;
-    return (uint32_t) rand_seed * (long long) seed >> 32;
+    free(ctx->offset_index);
+
+    ctx->offset_index = (pNode*) calloc(size ? size : 1, sizeof(pNode));
+    ctx->offset_index_size = size;
 }
 
-static void cgp_randomize(void)
+static void cgp_index_node(cgp_ctx *ctx, pNode in_node)
 {
-    rand_seed = (uint32_t) time(NULL);
+    if (!ctx->offset_index || in_node->offset >= ctx->offset_index_size)
+        return;
+
+    /* keep the first node placed at offset, as linear search did */
+    if (!ctx->offset_index[in_node->offset])
+        ctx->offset_index[in_node->offset] = in_node;
 }
 
-void export_to_gdl(const char *file_name)
+static void cgp_unindex_node(cgp_ctx *ctx, pNode in_node)
 {
-    char out_path[1024];
-    FILE *fh;
-    uint32_t i;
+    if (!ctx->offset_index || in_node->offset >= ctx->offset_index_size)
+        return;
 
-    strcpy(&out_path[0], &file_name[0]);
-    remove(out_path);
+    if (ctx->offset_index[in_node->offset] == in_node)
+        ctx->offset_index[in_node->offset] = NULL;
+}
 
-    fh = fopen(out_path, "w+");
-    if (!fh) {
-        printf("[CGP] error: can`t open %s\n", out_path);
-        return;
+void cgp_rebuild_index(cgp_ctx *ctx, uint32_t size)
+{
+    cgp_reset_index(ctx, size);
+
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        if (ctx->nodes[i])
+            cgp_index_node(ctx, ctx->nodes[i]);
     }
+}
+
+/* arenas are lists, so parser threads can fill their own ones */
+uint8_t *cgp_arena_data(pDataChunk *chunks, uint32_t size)
+{
+    pDataChunk chunk = *chunks;
+    uint8_t *data;
 
-    printf("[CGP] export graph to file: %s\n", out_path);
+    if (!chunk || chunk->size - chunk->used < size) {
+        uint32_t chunk_size = size > DATA_CHUNK_SIZE ? size : DATA_CHUNK_SIZE;
 
-    /* graph header begin */
-    fprintf(fh,
-            "graph: {\n"
-            "manhattan_edges: yes\n"
-            "layoutalgorithm: mindepth\n"
-            "finetuning: no\n"
-            "layout_downfactor: 100\n"
-            "layout_upfactor: 0\n"
-            "layout_nearfactor: 0\n\n");
+        chunk = (pDataChunk) malloc(sizeof(DataChunk) + chunk_size);
+        chunk->next = *chunks;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        *chunks = chunk;
+    }
 
-    for (i = 0 ; i < nodes_count ; i++) {
-        if (!nodes[i])
-            continue;
+    data = &chunk->data[chunk->used];
+    chunk->used += size;
+    return data;
+}
 
-        fprintf(fh,
-                "node: {title: \"%p\" "
-                       "label: \"Offset: 0x%04X "
-                       "(size: %X) ",
-                nodes[i],
-                nodes[i]->offset,
-                nodes[i]->weight);
+pNode cgp_arena_node(pNodeSlab *slabs)
+{
+    pNode new_node;
 
-        switch (nodes[i]->type) {
-            case NODE_LINE:
-                fprintf(fh, "LINEAR CODE\"}\n");
-                break;
+    if (!*slabs || (*slabs)->used == NODE_SLAB_SIZE) {
+        pNodeSlab slab = (pNodeSlab) malloc(sizeof(NodeSlab));
 
-            case NODE_JMP:
-                fprintf(fh, "JMP\"}\n");
-                break;
+        slab->next = *slabs;
+        slab->used = 0;
+        *slabs = slab;
+    }
 
-            case NODE_RET:
-                fprintf(fh, "RET\"}\n");
-                break;
+    new_node = &(*slabs)->nodes[(*slabs)->used++];
+    memset(new_node, 0, sizeof(Node));
+    new_node->offset = INVALID_OFFSET; /* not indexed until placed */
+    new_node->origin = INVALID_OFFSET;
 
-            case NODE_CALL:
-                fprintf(fh, "CALL\"}\n");
-                break;
+    return new_node;
+}
 
-            case NODE_JCC:
-                fprintf(fh, "JCC\"}\n");
-                break;
-        }
+/* append node to nodes table */
+pNode cgp_register_node(cgp_ctx *ctx, pNode in_node)
+{
+    if (ctx->nodes_count == ctx->nodes_size) {
+        ctx->nodes_size = ctx->nodes_size ? ctx->nodes_size * 2
+                                          : NODE_TABLE_MIN;
+        ctx->nodes = (pNode*) realloc(ctx->nodes,
+                                      sizeof(pNode) * ctx->nodes_size);
     }
 
-    fprintf(fh, "\n");
+    in_node->index = ctx->nodes_count;
 
-    for (i = 0 ; i < nodes_count ; i++) {
-        if (!nodes[i])
-            continue;
+    ctx->nodes[ctx->nodes_count] = in_node;
+    ctx->nodes_count++;
+    ctx->graph_version++;
+    CGP_STAT_ADD(ctx->stats.nodes_allocated, 1);
 
-        switch (nodes[i]->type) {
-            case NODE_LINE:
-            case NODE_JMP:
-            case NODE_RET:
-                if (nodes[i]->FLink) {
-                    fprintf(fh,
-                            "edge: {sourcename: \"%p\" "
-                                   "targetname: \"%p\"}\n",
-                            nodes[i],
-                            nodes[i]->FLink);
-                }
-                break;
+    if (ctx->first_node == NULL)
+        ctx->first_node = in_node;
 
-            case NODE_JCC:
-                if (nodes[i]->FLink)
-                fprintf(fh,
-                        "edge: {sourcename: \"%p\" "
-                               "targetname: \"%p\" "
-                               "label: \"false\" "
-                               "color: red}\n",
-                        nodes[i],
-                        nodes[i]->FLink);
-
-                if (nodes[i]->CLink) {
-                    fprintf(fh,
-                            "edge: {sourcename: \"%p\" "
-                                   "targetname: \"%p\" "
-                                   "label: \"true\" "
-                                   "color: darkgreen}\n",
-                            nodes[i],
-                            nodes[i]->CLink);
-                } else {
-                    printf("[CGP] error: graph export haven't CLink (JCC)\n");
-                    exit(1);
-                }
-                break;
+    return in_node;
+}
 
-            case NODE_CALL:
-                if (nodes[i]->FLink)
-                fprintf(fh,
-                        "edge: {sourcename: \"%p\" targetname: \"%p\"}\n",
-                        nodes[i],
-                        nodes[i]->FLink);
-
-                if (nodes[i]->CLink != NULL) {
-                    fprintf(fh,
-                            "edge: {sourcename: \"%p\" "
-                                   "targetname: \"%p\" "
-                                   "label: \"call\" "
-                                   "color: blue}\n",
-                            nodes[i],
-                            nodes[i]->CLink);
-                } else {
-                    printf("[CGP] error: graph export haven't CLink (CALL)\n");
-                    getchar();
-                }
-                break;
-        }
+/* bytes of a parsed instruction, only branches are ever rewritten */
+uint8_t *cgp_node_data(cgp_ctx *ctx, pDataChunk *chunks, uint8_t *buff,
+                       uint32_t offset, uint32_t type, uint32_t size)
+{
+    uint8_t *data;
+
+    if ((ctx->flags & CGP_ZERO_COPY) &&
+        (type == NODE_LINE || type == NODE_RET))
+        return &buff[offset];
+
+    /* reserve memory for long jcc */
+    if (type == NODE_JMP || type == NODE_JCC) {
+        data = cgp_arena_data(chunks, 10);
+    } else {
+        data = cgp_arena_data(chunks, size);
     }
 
-    /* graph header end */
-    fprintf(fh, "}\n");
-    fclose(fh);
+    memcpy(data, &buff[offset], size);
+    return data;
 }
 
-static void shuffle_array(void *obj, size_t nmemb, size_t size)
+static uint8_t *cgp_allocate_data(cgp_ctx *ctx, uint32_t size)
 {
-    void *temp = malloc(size);
-    size_t n = nmemb;
+    return cgp_arena_data(&ctx->data_chunks, size);
+}
 
-    while (n > 1) {
-        size_t k = cgp_random(n--);
-        memcpy(temp, (uint8_t*) (obj) + n * size, size);
-        memcpy((uint8_t*)(obj) + n * size, (uint8_t*)(obj) + k * size, size);
-        memcpy((uint8_t*)(obj) + k * size, temp, size);
+static pNode cgp_allocate_node(cgp_ctx *ctx)
+{
+    return cgp_register_node(ctx, cgp_arena_node(&ctx->node_slabs));
+}
+
+/* every FLink/CLink change goes through these to keep predecessor lists */
+void cgp_set_flink(pNode in_node, pNode target)
+{
+    pNode *link;
+
+    if (in_node->FLink == target)
+        return;
+
+    if (in_node->FLink) {
+        link = &in_node->FLink->FPreds;
+        while (*link != in_node)
+            link = &(*link)->FNext;
+
+        *link = in_node->FNext;
     }
 
-    free(temp);
+    in_node->FLink = target;
+    in_node->FNext = NULL;
+
+    if (target) {
+        in_node->FNext = target->FPreds;
+        target->FPreds = in_node;
+    }
 }
 
-static pNode cgp_allocate_node(void)
+void cgp_set_clink(pNode in_node, pNode target)
 {
-    nodes = (pNode*) realloc(nodes, sizeof(pNode) * (nodes_count + 1));
+    pNode *link;
+
+    if (in_node->CLink == target)
+        return;
 
-    nodes[nodes_count] = (pNode) calloc(1, sizeof(Node));
-    nodes_count++;
+    if (in_node->CLink) {
+        link = &in_node->CLink->CPreds;
+        while (*link != in_node)
+            link = &(*link)->CNext;
 
-    if (first_node == NULL)
-        first_node = nodes[nodes_count - 1];
+        *link = in_node->CNext;
+    }
+
+    in_node->CLink = target;
+    in_node->CNext = NULL;
 
-    return nodes[nodes_count - 1];
+    if (target) {
+        in_node->CNext = target->CPreds;
+        target->CPreds = in_node;
+    }
 }
 
-static void cgp_remove_node(pNode in_node)
+static void cgp_remove_node(cgp_ctx *ctx, pNode in_node)
 {
-    for (uint32_t i = 0 ; i < nodes_count ; i++) {
-        if (nodes[i] != in_node)
-            continue;
+    if (ctx->nodes[in_node->index] != in_node)
+        return;
 
-        free(nodes[i]->data);
-        free(nodes[i]);
-        nodes[i] = NULL;
-    }
+    /* storage stays in the arena until cgp_ctx_free() */
+    cgp_unindex_node(ctx, in_node);
+    cgp_set_flink(in_node, NULL);
+    cgp_set_clink(in_node, NULL);
+    ctx->nodes[in_node->index] = NULL;
+    ctx->graph_version++;
+    CGP_STAT_ADD(ctx->stats.nodes_freed, 1);
 }
 
 static pNode cgp_merge_nodes(pNode first, pNode second)
 {
-    first->FLink = second->FLink;
+    cgp_set_flink(first, second->FLink);
     first->weight += second->weight;
     return first;
 }
 
-static void cgp_except_node(pNode in_node)
+/* unlink node from graph, every edge to it goes to its FLink */
+static void cgp_except_node(cgp_ctx *ctx, pNode in_node)
 {
-    if (!in_node->BLink) {
-        cgp_remove_node(in_node);
+    pNode next_node = in_node->FLink;
+
+    /* a jump to itself can't be bypassed */
+    if (next_node == in_node)
         return;
-    }
 
-    in_node->BLink->FLink = in_node->FLink;
+    if (in_node == ctx->first_node)
+        ctx->first_node = next_node;
 
-    for (uint32_t i = 0 ; i < nodes_count ; i++) {
-        if (!nodes[i])
-            continue;
+    ctx->graph_version++;
 
-        if (nodes[i]->BLink == in_node)
-            nodes[i]->BLink = in_node->BLink;
-    }
+    /* BLink of a JMP laid out by a builder is not a predecessor */
+    if (in_node->BLink && (in_node->BLink->FLink == in_node ||
+                           in_node->BLink->CLink == in_node))
+        cgp_set_flink(in_node->BLink, next_node);
 
-    cgp_remove_node(in_node);
+    while (in_node->FPreds)
+        cgp_set_flink(in_node->FPreds, next_node);
+
+    while (in_node->CPreds)
+        cgp_set_clink(in_node->CPreds, next_node);
+
+    /* BLink always refers to a predecessor, so only successors have it */
+    if (in_node->FLink && in_node->FLink->BLink == in_node)
+        in_node->FLink->BLink = in_node->BLink;
+
+    if (in_node->CLink && in_node->CLink->BLink == in_node)
+        in_node->CLink->BLink = in_node->BLink;
+
+    cgp_remove_node(ctx, in_node);
 }
 
-static pNode cgp_insert_node(pNode in_node, uint32_t type)
+static pNode cgp_insert_node(cgp_ctx *ctx, pNode in_node, uint32_t type)
 {
-    pNode temp, new_node = cgp_allocate_node();
+    pNode temp, new_node = cgp_allocate_node(ctx);
 
     if (type == INSERT_AFTER) {
         temp = in_node->FLink;
-        in_node->FLink = new_node;
+        cgp_set_flink(in_node, new_node);
         new_node->BLink = in_node;
 
         if (temp) temp->BLink = new_node;
 
-        new_node->FLink = temp;
+        cgp_set_flink(new_node, temp);
     } else {
-        if (in_node == first_node)
-            first_node = new_node;
+        if (in_node == ctx->first_node)
+            ctx->first_node = new_node;
 
         temp = in_node->BLink;
         in_node->BLink = new_node;
-        new_node->FLink = in_node;
+        cgp_set_flink(new_node, in_node);
 
-        if (temp) temp->FLink = new_node;
+        if (temp) cgp_set_flink(temp, new_node);
 
         new_node->BLink = temp;
     }
@@ -295,383 +309,414 @@ static pNode cgp_insert_node(pNode in_node, uint32_t type)
     return new_node;
 }
 
-static pNode cgp_find_by_offset(uint32_t absolute_offset)
+static pNode cgp_find_by_offset(cgp_ctx *ctx, uint32_t absolute_offset)
 {
-    for (uint32_t i = 0 ; i < nodes_count ; i++) {
-        if (nodes[i] && nodes[i]->offset == absolute_offset)
-            return nodes[i];
-    }
+    CGP_STAT_ADD(ctx->stats.find_probes, 1);
 
-    return NULL;
+    if (!ctx->offset_index || absolute_offset >= ctx->offset_index_size)
+        return NULL;
+
+    return ctx->offset_index[absolute_offset];
 }
 
-static int cgp_get_node_type(uint8_t *buff)
+int cgp_get_node_type(const lde_insn *insn)
 {
-    /* long JCC */
-    if (*buff == 0x0F && *(buff + 1) >= 0x80 && *(buff + 1) <= 0x8F)
-        return NODE_JCC;
+    /* rel16 and hinted branches are kept as they are */
+    if ((insn->flags & LDE_F_PREFIXES) && insn->kind != LDE_KIND_RET)
+        return NODE_LINE;
 
-    /* short JCC */
-    if (*buff >= 0x70 && *buff <= 0x7F)
-        return NODE_JCC;
+    switch (insn->kind) {
+        case LDE_KIND_JCC:
+            if (insn->opcode >= 0xE0 && insn->opcode <= 0xE3)
+                printf("[CGP] warning: LOOPD opcodes aren't supported now\n");
+            return NODE_JCC; // LOOP, etc (all short jmp)
 
-    if (*buff >= 0xE0 && *buff <= 0xE3) {
-        printf("[CGP] warning: LOOPD opcodes aren't supported now\n");
-        return NODE_JCC; // LOOP, etc (all short jmp)
-    }
-
-    if (*buff == OPCODE_X86_JMP_REL8 || *buff == OPCODE_X86_JMP_REL32)
-        return NODE_JMP;
+        case LDE_KIND_JMP:
+            return NODE_JMP;
 
-    if (*buff == OPCODE_X86_RET)
-        return NODE_RET;
+        case LDE_KIND_CALL:
+            return NODE_CALL;
 
-    if (*buff == OPCODE_X86_CALL)
-        return NODE_CALL;
+        case LDE_KIND_RET:
+            return NODE_RET;
+    }
 
     return NODE_LINE;
 }
 
-static uint32_t cgp_get_branch_offset(uint8_t *buff, uint32_t code_offset)
+uint32_t cgp_get_branch_offset(const uint8_t *buff, uint32_t code_offset,
+                               const lde_insn *insn)
 {
-    uint32_t r_offset, abs_offset;
+    const uint8_t *rel = &buff[code_offset + insn->imm_offset];
+    int32_t displacement;
 
-    /* long jcc */
-    if (buff[code_offset] == 0x0F &&
-        buff[code_offset + 1] >= 0x80 &&
-        buff[code_offset + 1] <= 0x8F)
-    {
-        r_offset = *(uint32_t*) &buff[code_offset + 2];
-        if ((int) r_offset >= 0) {
-            abs_offset = code_offset + (r_offset + 6);
-        } else {
-            abs_offset = code_offset - (~r_offset - 5);
-        }
+    /* target is unknown, so it's out of code */
+    if (insn->branch != LDE_BRANCH_RELATIVE)
+        return INVALID_OFFSET;
 
-        return abs_offset;
+    if (insn->imm_size == 1) {
+        displacement = (int8_t) rel[0];
+    } else if (insn->imm_size == 2) {
+        displacement = *(int16_t*) rel;
+    } else {
+        displacement = *(int32_t*) rel;
     }
 
-    /* short jcc */
-    if (buff[code_offset] >= 0x70 && buff[code_offset] <= 0x7F) {
-        r_offset = buff[code_offset + 1];
-        if ((char) r_offset >= 0) {
-            abs_offset = code_offset + (r_offset + 2);
-        } else {
-            abs_offset = code_offset - (~r_offset ^ 0xFFFFFF00) + 1;
-        }
+    return code_offset + insn->length + (uint32_t) displacement;
+}
 
-        return abs_offset;
-    }
+static void cgp_work_swap(WorkItem *a, WorkItem *b)
+{
+    WorkItem item = *a;
+
+    *a = *b;
+    *b = item;
+}
 
-    if (buff[code_offset] == OPCODE_X86_JMP_REL8) {
-        r_offset = buff[code_offset + 1];
-        if ((char) r_offset >= 0) {
-            abs_offset = code_offset + (r_offset + 2);
+/* returns 0, or -1 if the list can't grow, it's kept as it was then */
+static int cgp_work_push(cgp_ctx *ctx, Worklist *work, pNode owner,
+                         uint32_t key)
+{
+    WorkItem *items;
+    uint32_t i, parent, size;
+
+    if (work->head + work->count == work->size) {
+        /* a queue is moved to front while it is at most half full */
+        if (work->head && work->count <= work->size / 2) {
+            memmove(work->items, &work->items[work->head],
+                    sizeof(WorkItem) * work->count);
+            work->head = 0;
         } else {
-            abs_offset = code_offset - (~r_offset ^ 0xFFFFFF00) + 1;
-        }
+            size = work->size ? work->size * 2 : WORKLIST_MIN;
+            items = (WorkItem*) realloc(work->items, sizeof(WorkItem) * size);
+            if (!items) {
+                printf("[CGP] error: can`t grow worklist\n");
+                return -1;
+            }
 
-        return abs_offset;
+            work->items = items;
+            work->size = size;
+        }
     }
 
-    if (buff[code_offset] == OPCODE_X86_JMP_REL32) {
-        r_offset = *(uint32_t*) &buff[code_offset + 1];
-        if ((int) r_offset >= 0) {
-            abs_offset = code_offset + (r_offset + 5);
-        } else {
-            abs_offset = code_offset - (~r_offset - 4);
-        }
+    i = work->head + work->count++;
+    work->items[i].owner = owner;
+    work->items[i].key = key;
+
+    if (ctx->traversal != CGP_TRAVERSAL_ADDRESS)
+        return 0;
+
+    /* sift up, heap starts at 0 */
+    while (i) {
+        parent = (i - 1) / 2;
+        if (work->items[parent].key <= work->items[i].key)
+            break;
 
-        return abs_offset;
+        cgp_work_swap(&work->items[parent], &work->items[i]);
+        i = parent;
     }
 
-    if (buff[code_offset] == OPCODE_X86_CALL) {
-        r_offset = *(uint32_t*) &buff[code_offset + 1];
+    return 0;
+}
+
+static WorkItem cgp_work_pop(cgp_ctx *ctx, Worklist *work)
+{
+    WorkItem *items = work->items, item;
+    uint32_t i = 0, child;
+
+    switch (ctx->traversal) {
+        case CGP_TRAVERSAL_BFS:
+            item = items[work->head];
+            work->count--;
+            work->head = work->count ? work->head + 1 : 0;
+            return item;
+
+        case CGP_TRAVERSAL_ADDRESS:
+            item = items[0];
+            items[0] = items[--work->count];
+
+            /* sift down */
+            while ((child = i * 2 + 1) < work->count) {
+                if (child + 1 < work->count &&
+                    items[child + 1].key < items[child].key)
+                    child++;
+
+                if (items[i].key <= items[child].key)
+                    break;
+
+                cgp_work_swap(&items[i], &items[child]);
+                i = child;
+            }
 
-        if ((int) r_offset >= 0) {
-            abs_offset = code_offset + (r_offset + 5);
-        } else {
-            abs_offset = code_offset - (~r_offset - 4);
-        }
+            return item;
 
-        return abs_offset;
+        default:
+            return items[--work->count];
     }
+}
 
-    printf("[CGP] error: cgp_get_branch_offset -> invalid node type\n");
-    exit(0);
+void cgp_reset_work(cgp_ctx *ctx)
+{
+    ctx->jcc_work.head = ctx->jcc_work.count = 0;
+    ctx->call_work.head = ctx->call_work.count = 0;
+}
 
-    return 0;
+/* key of a branch is its target in input, so parse goes forward */
+static int cgp_push_call(cgp_ctx *ctx, pNode owner, uint32_t target)
+{
+    return cgp_work_push(ctx, &ctx->call_work, owner, target);
+}
+
+static WorkItem cgp_pop_call(cgp_ctx *ctx)
+{
+    return cgp_work_pop(ctx, &ctx->call_work);
 }
 
-uint32_t cgp_push_call(pNode owner)
+static int cgp_push_jcc(cgp_ctx *ctx, pNode owner, uint32_t target)
 {
-    assert(call_count < BRANCH_STACK_LIMIT);
+    return cgp_work_push(ctx, &ctx->jcc_work, owner, target);
+}
 
-    call_stack[call_count] = owner;
-    return ++call_count;
+static WorkItem cgp_pop_jcc(cgp_ctx *ctx)
+{
+    return cgp_work_pop(ctx, &ctx->jcc_work);
 }
 
-pNode cgp_pop_call(void)
+/* next branch to follow: JCC before CALL, CALL after RET, or by address,
+   owner is NULL when nothing is pending and key is the target */
+static WorkItem cgp_pop_pending(cgp_ctx *ctx, int after_ret)
 {
-    return call_stack[--call_count];
+    Worklist *jcc = &ctx->jcc_work, *call = &ctx->call_work;
+    WorkItem none = {NULL, INVALID_OFFSET};
+
+    if (!jcc->count && !call->count)
+        return none;
+
+    if (ctx->traversal == CGP_TRAVERSAL_ADDRESS) {
+        if (!call->count ||
+            (jcc->count && jcc->items[0].key <= call->items[0].key))
+            return cgp_pop_jcc(ctx);
+
+        return cgp_pop_call(ctx);
+    }
+
+    if (call->count && (after_ret || !jcc->count))
+        return cgp_pop_call(ctx);
+
+    return cgp_pop_jcc(ctx);
 }
 
-uint32_t cgp_push_jcc(pNode owner)
+/* record of a rel8/rel32 branch written by CGP, it isn't decoded again */
+static void cgp_branch_insn(pNode in_node)
 {
-    assert(jcc_count < BRANCH_STACK_LIMIT);
+    lde_insn *insn = &in_node->insn;
+    uint32_t size = in_node->weight == 2 ? 1 : 4;
+
+    memset(insn, 0, sizeof(lde_insn));
+    insn->length = (uint8_t) in_node->weight;
+    insn->kind = (uint8_t) in_node->type;   /* same order as LDE_KIND_* */
+    insn->branch = LDE_BRANCH_RELATIVE;
+    insn->opcode = in_node->data[0];
+
+    if (insn->opcode == 0x0F) {
+        insn->flags = LDE_F_OPCODE2;
+        insn->opcode2 = in_node->data[1];
+    }
 
-    jcc_stack[jcc_count] = owner;
-    return ++jcc_count;
+    insn->imm_offset = (uint8_t) (in_node->weight - size);
+    insn->imm_size = (uint8_t) size;
 }
 
-pNode cgp_pop_jcc(void)
+static pNode cgp_allocate_jmp(cgp_ctx *ctx, pNode target)
 {
-    assert(jcc_count >= 0);
+    pNode new_node = cgp_allocate_node(ctx);
+
+    new_node->type = NODE_JMP;
+    new_node->weight = 5;
+    new_node->data = cgp_allocate_data(ctx, new_node->weight);
+    new_node->data[0] = OPCODE_X86_JMP_REL32;
+    new_node->data[1] = 0xCC;
+    new_node->data[2] = 0xCC;
+    new_node->data[3] = 0xCC;
+    new_node->data[4] = 0xCC;
+    cgp_branch_insn(new_node);
+    cgp_set_flink(new_node, target);
 
-    return jcc_stack[--jcc_count];
+    return new_node;
 }
 
-pNode cgp_link_nodes(pNode first, pNode second)
+static pNode cgp_link_nodes(cgp_ctx *ctx, pNode first, pNode second)
 {
     pNode current_node;
 
-    current_node = cgp_allocate_node();
-    current_node->type = NODE_JMP;
-    current_node->weight = 5;
-    current_node->data = (uint8_t*) malloc(current_node->weight);
-    current_node->data[0] = OPCODE_X86_JMP_REL32;
-    current_node->data[1] = 0xCC;
-    current_node->data[2] = 0xCC;
-    current_node->data[3] = 0xCC;
-    current_node->data[4] = 0xCC;
+    current_node = cgp_allocate_jmp(ctx, second);
     current_node->BLink = first;
-    current_node->FLink = second;
-    first->FLink = current_node;
+    cgp_set_flink(first, current_node);
 
     return current_node;
 }
 
 void cgp_long2short(pNode in_node)
 {
-    if (in_node->data[0] == OPCODE_X86_JMP_REL32) {
+    if (in_node->insn.opcode == OPCODE_X86_JMP_REL32) {
         in_node->data[0] = OPCODE_X86_JMP_REL8;
         in_node->data[1] = 0xCC;
         in_node->weight = 2;
+        cgp_branch_insn(in_node);
         return;
     }
 
-    if (in_node->data[0] == 0x0F && in_node->data[1] >= 0x70 &&
-        in_node->data[1] <= 0x7F)
-    {
-        in_node->data[0] = in_node->data[1] - 0x10;
+    if (in_node->insn.opcode == 0x0F && in_node->insn.kind == LDE_KIND_JCC) {
+        in_node->data[0] = in_node->insn.opcode2 - 0x10;
         in_node->data[1] = 0xCC;
         in_node->weight = 2;
+        cgp_branch_insn(in_node);
         return;
     }
 }
 
 void cgp_short2long(pNode in_node)
 {
-    if (in_node->data[0] == OPCODE_X86_JMP_REL8) {
+    if (in_node->insn.opcode == OPCODE_X86_JMP_REL8) {
         in_node->data[0] = OPCODE_X86_JMP_REL32;
         *(uint32_t*) &in_node->data[1] = 0xCCCCCCCC;
         in_node->weight = 5;
+        cgp_branch_insn(in_node);
         return;
     }
 
-    if (in_node->data[0] >= 0x70 && in_node->data[0] <= 0x7F) {
-        in_node->data[1] = in_node->data[0] + 0x10;
+    if (in_node->insn.opcode >= 0x70 && in_node->insn.opcode <= 0x7F) {
+        in_node->data[1] = in_node->insn.opcode + 0x10;
         in_node->data[0] = 0x0F;
         *(uint32_t*) &in_node->data[2] = 0xCCCCCCCC;
         in_node->weight = 6;
+        cgp_branch_insn(in_node);
         return;
     }
 }
 
-int cgp_write_offset(pNode in_node, uint8_t *buff)
+static pNode cgp_branch_target(pNode in_node)
 {
-    pNode temp = NULL;
-
-    if (!in_node || in_node->offset == INVALID_OFFSET)
-        return 0;
-
-    if (buff[in_node->offset] == OPCODE_X86_JMP_REL32) {
-        if (!in_node->FLink || in_node->FLink->offset == INVALID_OFFSET)
-            return 0;
-
-        if (in_node->CLink) {
-            temp = in_node->FLink;
-            in_node->FLink = in_node->CLink;
-        }
-
-        if (in_node->offset > in_node->FLink->offset) {
-            *(uint32_t*) &buff[in_node->offset + 1] =
-                                ~(in_node->offset - in_node->FLink->offset) - 4;
-        } else {
-            *(uint32_t*) &buff[in_node->offset + 1] =
-                                   in_node->FLink->offset - in_node->offset - 5;
-        }
-
-        if (temp != NULL) {
-            in_node->CLink = in_node->FLink;
-            in_node->FLink = temp;
-        }
-
-        return 1;
-    }
-
-    /* short jmp */
-    if (buff[in_node->offset] == OPCODE_X86_JMP_REL8) {
-        if (!in_node->FLink || in_node->FLink->offset == INVALID_OFFSET)
-            return 0;
-
-        if (in_node->CLink) {
-            temp = in_node->FLink;
-            in_node->FLink = in_node->CLink;
-        }
-
-        if (in_node->offset > in_node->FLink->offset) {
-            *(uint8_t*) &buff[in_node->offset + 1] =
-                                ~(in_node->offset - in_node->FLink->offset) - 1;
-        } else {
-            *(uint8_t*) &buff[in_node->offset + 1] =
-                                   in_node->FLink->offset - in_node->offset - 2;
-        }
-
-        if (temp != NULL) {
-            in_node->CLink = in_node->FLink;
-            in_node->FLink = temp;
-        }
-
-        return 1;
-    }
-
-    /* long jcc */
-    if (buff[in_node->offset] == 0x0F &&
-        buff[in_node->offset+1] >= 0x80 &&
-        buff[in_node->offset+1] <= 0x8F)
-    {
-        if (!in_node->CLink || in_node->CLink->offset == INVALID_OFFSET)
-            return 0;
+    if (in_node->type == NODE_JMP)
+        return in_node->CLink ? in_node->CLink : in_node->FLink;
 
-        if (in_node->offset > in_node->CLink->offset) {
-            *(uint32_t*) &buff[in_node->offset + 2] =
-                                ~(in_node->offset - in_node->CLink->offset) - 5;
-        } else {
-            *(uint32_t*) &buff[in_node->offset + 2] =
-                                   in_node->CLink->offset - in_node->offset - 6;
-        }
+    if (in_node->type == NODE_JCC || in_node->type == NODE_CALL)
+        return in_node->CLink;
 
-        return 1;
-    }
+    return NULL;
+}
 
-    /* short jcc */
-    if (buff[in_node->offset] >= 0x70 && buff[in_node->offset] <= 0x7F) {
-        if (!in_node->CLink || in_node->CLink->offset == INVALID_OFFSET)
-            return 0;
+int cgp_write_offset(pNode in_node, uint8_t *buff)
+{
+    uint8_t *rel;
+    uint32_t displacement;
+    pNode target;
 
-        if (in_node->offset > in_node->CLink->offset) {
-            *(uint8_t*) &buff[in_node->offset + 1] =
-                                ~(in_node->offset - in_node->CLink->offset) - 1;
-        } else {
-            *(uint8_t*) &buff[in_node->offset + 1] =
-                                   in_node->CLink->offset - in_node->offset - 2;
-        }
+    if (!in_node || in_node->offset == INVALID_OFFSET)
+        return 0;
 
-        return 1;
-    }
+    if (in_node->type != NODE_JMP &&
+        in_node->type != NODE_JCC &&
+        in_node->type != NODE_CALL)
+        return 0;
 
-    if (buff[in_node->offset] == OPCODE_X86_CALL) {
-        if (!in_node->CLink || in_node->CLink->offset == INVALID_OFFSET)
-            return 0;
+    target = cgp_branch_target(in_node);
+    if (!target || target->offset == INVALID_OFFSET)
+        return 0;
 
-        if (in_node->offset > in_node->CLink->offset) {
-            *(uint32_t*) &buff[in_node->offset + 1] =
-                                ~(in_node->offset - in_node->CLink->offset) - 4;
-        } else {
-            *(uint32_t*) &buff[in_node->offset + 1] =
-                                   in_node->CLink->offset - in_node->offset - 5;
-        }
+    /* relative to the end of instruction, rel8 is truncated */
+    displacement = target->offset - in_node->offset - in_node->insn.length;
+    rel = &buff[in_node->offset + in_node->insn.imm_offset];
 
-        return 1;
+    if (in_node->insn.imm_size == 1) {
+        *rel = (uint8_t) displacement;
+    } else {
+        *(uint32_t*) rel = displacement;
     }
 
-    return 0;
+    return 1;
 }
 
-void cgp_parse(uint8_t *buff, uint32_t buff_size, uint32_t entry_point)
+/* returns 0 on success, -1 on invalid instruction, CALL out of code or
+   worklist which can't grow */
+static int cgp_parse(cgp_ctx *ctx, uint8_t *buff, uint32_t buff_size,
+                     uint32_t entry_point)
 {
     uint32_t i, instruction_size, abs_offset, offset = entry_point;
-    pNode found_node, stack_top, current_node = NULL, last_node = NULL;
+    pNode found_node, current_node = NULL, last_node = NULL;
+    WorkItem pending;
+    lde_insn insn;
 
-    first_node = NULL;
+    ctx->first_node = NULL;
 
     while (1) {
         /* out of range OR node has been analyzed */
-        if (offset >= buff_size || (found_node = cgp_find_by_offset(offset))) {
+        if (offset >= buff_size ||
+            (found_node = cgp_find_by_offset(ctx, offset))) {
 
             /* branch was analysed */
             if (offset < buff_size && last_node && found_node) {
                 if (last_node->type == NODE_LINE) {
                     /* link by Jmp */
-                    last_node = cgp_link_nodes(last_node, found_node);
+                    last_node = cgp_link_nodes(ctx, last_node, found_node);
                 }
 
                 if (last_node->type == NODE_JCC) {
                     if (!last_node->FLink) {
-                        last_node->FLink = found_node;
+                        cgp_set_flink(last_node, found_node);
                     } else {
-                        last_node->CLink = found_node;
+                        cgp_set_clink(last_node, found_node);
                     }
                 }
 
                 if (last_node->type == NODE_CALL) {
                     if (!last_node->FLink) {
-                        last_node->FLink = found_node;
+                        cgp_set_flink(last_node, found_node);
                     } else {
-                        last_node->CLink = found_node;
+                        cgp_set_clink(last_node, found_node);
                     }
                 }
             }
 
             /* branch are out of analyse scope */
-            if (offset > buff_size && last_node) {
+            if (offset >= buff_size && last_node) {
                 if (last_node->type == NODE_LINE) {
-                    current_node = cgp_allocate_node();
+                    current_node = cgp_allocate_node(ctx);
                     current_node->type = NODE_LABEL;
-                    last_node->offset = INVALID_OFFSET;
-                    last_node->FLink = current_node;
+
+                    /* code right at the end only falls out of it */
+                    if (offset > buff_size) {
+                        cgp_unindex_node(ctx, last_node);
+                        last_node->offset = INVALID_OFFSET;
+                    }
+
+                    cgp_set_flink(last_node, current_node);
                 }
 
-                if (last_node->type == NODE_JCC) {
-                    current_node = cgp_allocate_node();
+                if (last_node->type == NODE_JCC ||
+                    (last_node->type == NODE_CALL && offset == buff_size)) {
+                    current_node = cgp_allocate_node(ctx);
                     current_node->type = NODE_LABEL;
 
                     if (!last_node->FLink) {
-                        last_node->FLink = current_node;
+                        cgp_set_flink(last_node, current_node);
                     } else {
-                        last_node->CLink = current_node;
+                        cgp_set_clink(last_node, current_node);
                     }
                 }
 
-                if (last_node->type == NODE_CALL) {
-                    printf("[CGP] error: undefined\n");
-                    exit(1);
+                if (last_node->type == NODE_CALL && offset > buff_size) {
+                    printf("[CGP] error: CALL at %X out of code\n",
+                           last_node->origin);
+                    return -1;
                 }
             }
 
             /* have not processed branch */
-            if (jcc_count != 0) {
-                stack_top = cgp_pop_jcc();
-                offset = cgp_get_branch_offset(buff, stack_top->offset);
-                last_node = stack_top;
-                continue;
-            }
-
-            if (call_count != 0) {
-                stack_top = cgp_pop_call();
-                offset = cgp_get_branch_offset(buff, stack_top->offset);
-                last_node = stack_top;
+            pending = cgp_pop_pending(ctx, 0);
+            if (pending.owner) {
+                offset = pending.key;
+                last_node = pending.owner;
                 continue;
             }
 
@@ -679,69 +724,71 @@ void cgp_parse(uint8_t *buff, uint32_t buff_size, uint32_t entry_point)
             break;
         }
 
-        if (GetInstructionSize(&buff[offset], &instruction_size) != 1) {
-            printf("[CGP] error: lde error!\n");
-            exit(1);
+        instruction_size = lde_decode_insn(&buff[offset], &insn);
+        CGP_STAT_ADD(ctx->stats.lde_calls, 1);
+
+        if (!instruction_size) {
+            printf("[CGP] error: lde error at %X!\n", offset);
+            return -1;
         }
 
         /* do not process jmp */
-        if (cgp_get_node_type(&buff[offset]) == NODE_JMP) {
-            offset = cgp_get_branch_offset(buff, offset);
+        if (cgp_get_node_type(&insn) == NODE_JMP) {
+            offset = cgp_get_branch_offset(buff, offset, &insn);
             continue;
         }
 
         /* allocate new node */
-        current_node = cgp_allocate_node();
-        current_node->type = cgp_get_node_type(&buff[offset]);
+        current_node = cgp_allocate_node(ctx);
+        current_node->type = cgp_get_node_type(&insn);
+        current_node->insn = insn;
 
-        /* reserve memory for long jcc */
-        if (current_node->type == NODE_JMP || current_node->type == NODE_JCC) {
-            current_node->data = (uint8_t*) malloc(10);
-        } else {
-            current_node->data = (uint8_t*) malloc(instruction_size);
-        }
+        current_node->data = cgp_node_data(ctx, &ctx->data_chunks, buff,
+                                           offset, current_node->type,
+                                           instruction_size);
 
         current_node->weight = instruction_size;
         current_node->offset = offset;
+        current_node->origin = offset;
         current_node->BLink  = last_node;
 
+        cgp_index_node(ctx, current_node);
+
         /* configurate previous node */
         if (last_node) {
             switch (last_node->type) {
                 case NODE_LINE:
-                    last_node->FLink = current_node;
+                    cgp_set_flink(last_node, current_node);
                     break;
 
                 case NODE_JMP:
-                    last_node->FLink = current_node;
+                    cgp_set_flink(last_node, current_node);
                     break;
 
                 case NODE_JCC:
                     if (!last_node->FLink) {
-                        last_node->FLink = current_node;
+                        cgp_set_flink(last_node, current_node);
                     } else {
-                        last_node->CLink = current_node;
+                        cgp_set_clink(last_node, current_node);
                     }
                     break;
 
                 case NODE_CALL:
                     if (!last_node->FLink) {
-                        last_node->FLink = current_node;
+                        cgp_set_flink(last_node, current_node);
                     } else {
-                        last_node->CLink = current_node;
+                        cgp_set_clink(last_node, current_node);
                     }
                     break;
 
                 case NODE_RET:
-                    last_node->FLink = current_node;
+                    cgp_set_flink(last_node, current_node);
                     break;
             }
         }
 
         last_node = current_node;
 
-        memcpy(&current_node->data[0], &buff[offset], instruction_size);
-
         /* convert JMP or JCC to LONG type */
         if (current_node->type == NODE_JMP ||
             current_node->type == NODE_JCC ||
@@ -769,15 +816,16 @@ void cgp_parse(uint8_t *buff, uint32_t buff_size, uint32_t entry_point)
         /* condition branch */
         if (current_node->type == NODE_JCC) {
 
-            abs_offset = cgp_get_branch_offset(buff, offset);
-            found_node = cgp_find_by_offset(abs_offset);
+            abs_offset = cgp_get_branch_offset(buff, offset, &insn);
+            found_node = cgp_find_by_offset(ctx, abs_offset);
 
             if (found_node) {
-                current_node->CLink = found_node;
+                cgp_set_clink(current_node, found_node);
                 offset += instruction_size;
             } else {
                 /* push jcc absolute branch address */
-                cgp_push_jcc(current_node);
+                if (cgp_push_jcc(ctx, current_node, abs_offset))
+                    return -1;
 
                 /* and process next instruction */
                 offset += instruction_size;
@@ -789,18 +837,19 @@ void cgp_parse(uint8_t *buff, uint32_t buff_size, uint32_t entry_point)
         /* call */
         if (current_node->type == NODE_CALL) {
 
-            abs_offset = cgp_get_branch_offset(buff, offset);
+            abs_offset = cgp_get_branch_offset(buff, offset, &insn);
 
             /* condition and next address are same */
 
-            found_node = cgp_find_by_offset(abs_offset);
+            found_node = cgp_find_by_offset(ctx, abs_offset);
 
             if (found_node) {
-                current_node->CLink = found_node;
+                cgp_set_clink(current_node, found_node);
                 offset += instruction_size;
             } else {
                 /* push address of next instruction */
-                cgp_push_call(current_node);
+                if (cgp_push_call(ctx, current_node, abs_offset))
+                    return -1;
 
                 /* and process call routine */
                 offset += instruction_size;
@@ -811,292 +860,2171 @@ void cgp_parse(uint8_t *buff, uint32_t buff_size, uint32_t entry_point)
 
         /* return */
         if (current_node->type == NODE_RET) {
-            if (call_count == 0)
+            pending = cgp_pop_pending(ctx, 1);
+            if (!pending.owner)
                 continue;
 
-            stack_top = cgp_pop_call();
-            offset = cgp_get_branch_offset(buff, stack_top->offset);
-            last_node = cgp_find_by_offset(stack_top->offset); // callback addr
+            /* callback addr */
+            offset = pending.key;
+            last_node = pending.owner;
             continue;
         }
     }
 
-    for (i = 0 ; i < nodes_count ; i++) {
-        if (nodes[i]->type != NODE_CALL)
+    for (i = 0 ; i < ctx->nodes_count ; i++) {
+        if (ctx->nodes[i]->type != NODE_CALL)
             continue;
 
-        if (!nodes[i]->FLink)
-            printf("%X CALL have't FLink\n", nodes[i]->offset);
+        if (!ctx->nodes[i]->FLink)
+            printf("%X CALL have't FLink\n", ctx->nodes[i]->offset);
 
-        if (!nodes[i]->CLink)
-            printf("%X CALL have't CLink\n", nodes[i]->offset);
+        if (!ctx->nodes[i]->CLink)
+            printf("%X CALL have't CLink\n", ctx->nodes[i]->offset);
     }
+
+    return 0;
 }
 
-uint32_t cgp_build(uint8_t **out_buff)
+static void cgp_layout_reset(cgp_ctx *ctx)
 {
-    uint32_t offset = 0;
-    uint8_t *buff;
-    pNode new_node, curr_node;
+    ctx->layout_count = 0;
+    ctx->layout_cold = INVALID_VALUE;
+    ctx->inserts_count = 0;
 
-    /* allocate buffer */
-    buff = (uint8_t *) calloc(sizeof(uint8_t), CODE_BUFFER_LIMIT);
+    /* image of cgp_ctx_build_incremental(...) is of other layout */
+    ctx->image_valid = 0;
+}
 
-    call_count = 0;
-    jcc_count = 0;
+/* nodes are removed or merged, results of analysis and layout are stale */
+static void cgp_graph_changed(cgp_ctx *ctx)
+{
+    cgp_free_analysis(ctx);
+    cgp_layout_reset(ctx);
+}
 
-    for (uint32_t i = 0 ; i < nodes_count ; i++) {
-        if (nodes[i])
-            nodes[i]->offset = INVALID_OFFSET;
+/* append node to emission order and place it right after previous one */
+static void cgp_layout_add(cgp_ctx *ctx, pNode in_node, uint32_t *offset)
+{
+    if (ctx->layout_count == ctx->layout_size) {
+        ctx->layout_size = ctx->layout_size ? ctx->layout_size * 2
+                                            : NODE_TABLE_MIN;
+        ctx->layout = (pNode*) realloc(ctx->layout,
+                                       sizeof(pNode) * ctx->layout_size);
+        ctx->layout_align = (uint8_t*) realloc(ctx->layout_align,
+                                               ctx->layout_size);
     }
 
-    curr_node = first_node;
-
-    /* write instructions */
-    while (curr_node) {
-        assert(offset < CODE_BUFFER_LIMIT);
+    ctx->layout_align[ctx->layout_count] = 0;
+    in_node->layout_index = ctx->layout_count;
+    ctx->layout[ctx->layout_count++] = in_node;
 
-        if (curr_node->offset == INVALID_OFFSET) {
+    in_node->offset = *offset;
+    *offset += in_node->weight;
+}
 
-            if (curr_node->type == NODE_LABEL) {
-                curr_node->offset = offset;
-            } else {
-                switch (curr_node->type) {
-                    case NODE_CALL:
-                        if (curr_node->CLink->offset == INVALID_OFFSET)
-                            cgp_push_call(curr_node);
-                        break;
+/* assign offsets and positions in emission order, return size of code */
+static uint32_t cgp_layout_offsets(cgp_ctx *ctx)
+{
+    uint32_t offset = 0, padding, mask = ctx->align_boundary - 1;
 
-                    case NODE_JCC:
-                        if (curr_node->CLink->offset == INVALID_OFFSET)
-                            cgp_push_jcc(curr_node);
-                        break;
-                }
+    ctx->build_info.padding = 0;
+    ctx->build_info.aligned = 0;
 
-                /* remove redundant code */
-                if (curr_node->type == NODE_JMP &&
-                    curr_node->FLink->offset == INVALID_OFFSET) {
-                    cgp_except_node(curr_node);
-                } else {
-                    curr_node->offset = offset;
-                    memcpy(&buff[offset], &curr_node->data[0], curr_node->weight);
-                    offset += curr_node->weight;
-                }
+    for (uint32_t i = 0 ; i < ctx->layout_count ; i++) {
+        if (ctx->layout_align[i]) {
+            padding = (ctx->align_boundary - (offset & mask)) & mask;
+
+            /* too far from boundary, padding would cost more than it saves */
+            if (padding <= ctx->align_max) {
+                offset += padding;
+                ctx->build_info.padding += padding;
+                ctx->build_info.aligned++;
+            }
+        }
+
+        ctx->layout[i]->offset = offset;
+        ctx->layout[i]->layout_index = i;
+        offset += ctx->layout[i]->weight;
+    }
+
+    return offset;
+}
+
+/* layout targets which start at a boundary, provisional offsets are set */
+static void cgp_layout_mark_aligned(cgp_ctx *ctx)
+{
+    pNode curr_node, target;
+    uint32_t *position, cold;
+
+    if (!ctx->align_boundary)
+        return;
+
+    /* layout position by node index, builders may add nodes */
+    position = (uint32_t*) malloc(sizeof(uint32_t) * (ctx->nodes_count + 1));
+
+    for (uint32_t i = 0 ; i < ctx->layout_count ; i++)
+        position[ctx->layout[i]->index] = i;
+
+    cold = ctx->layout_cold != INVALID_VALUE ? ctx->layout_cold
+                                             : ctx->layout_count;
+
+    for (uint32_t i = 0 ; i < ctx->layout_count ; i++) {
+        curr_node = ctx->layout[i];
+
+        if (curr_node->type != NODE_JMP && curr_node->type != NODE_JCC)
+            continue;
+
+        target = cgp_branch_target(curr_node);
+        if (!target || target->offset == INVALID_OFFSET ||
+            target->type == NODE_LABEL)
+            continue;
+
+        /* target of back edge is a loop header */
+        if (target->offset <= curr_node->offset) {
+            if (ctx->align_targets & CGP_ALIGN_LOOPS)
+                ctx->layout_align[position[target->index]] = 1;
+            continue;
+        }
+
+        /* other targets only in hot code and not entered by fallthrough */
+        if ((ctx->align_targets & CGP_ALIGN_BRANCHES) &&
+            position[target->index] < cold &&
+            position[target->index] != i + 1)
+            ctx->layout_align[position[target->index]] = 1;
+    }
+
+    /* start of code is aligned by its owner */
+    if (ctx->layout_count)
+        ctx->layout_align[0] = 0;
+
+    free(position);
+}
+
+/* recommended NOP forms of 1..9 bytes */
+static const uint8_t cgp_nops[9][9] = {
+    {0x90},
+    {0x66, 0x90},
+    {0x0F, 0x1F, 0x00},
+    {0x0F, 0x1F, 0x40, 0x00},
+    {0x0F, 0x1F, 0x44, 0x00, 0x00},
+    {0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},
+    {0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00},
+    {0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+};
+
+static void cgp_fill_nops(uint8_t *buff, uint32_t size)
+{
+    uint32_t length;
+
+    while (size) {
+        length = size > 9 ? 9 : size;
+        memcpy(buff, cgp_nops[length - 1], length);
+
+        buff += length;
+        size -= length;
+    }
+}
+
+/** Drop alignment padding which moved a short branch without rel32 form
+ *  (LOOP, JECXZ) and its target apart.
+ *
+ *  @return 1 if padding was dropped, 0 if every short branch reaches its
+ *          target, INVALID_VALUE if one can't reach it at all
+ */
+static uint32_t cgp_layout_unalign(cgp_ctx *ctx)
+{
+    uint32_t low, high, dropped = 0, found;
+    int32_t displacement;
+    pNode curr_node, target, unreachable = NULL;
+
+    for (uint32_t i = 0 ; i < ctx->layout_count ; i++) {
+        curr_node = ctx->layout[i];
+
+        if ((curr_node->type != NODE_JMP &&
+             curr_node->type != NODE_JCC) || curr_node->weight != 2)
+            continue;
+
+        target = cgp_branch_target(curr_node);
+        if (!target || target->offset == INVALID_OFFSET)
+            continue;
+
+        displacement = (int32_t) (target->offset - curr_node->offset - 2);
+        if (displacement >= -128 && displacement <= 127)
+            continue;
+
+        low = displacement < 0 ? target->offset : curr_node->offset;
+        high = displacement < 0 ? curr_node->offset : target->offset;
+        found = 0;
+
+        /* padding is put right before an aligned node */
+        for (uint32_t j = 1 ; j < ctx->layout_count ; j++) {
+            if (!ctx->layout_align[j] ||
+                ctx->layout[j]->offset <= low || ctx->layout[j]->offset > high)
+                continue;
+
+            if (ctx->layout[j]->offset != ctx->layout[j - 1]->offset +
+                                          ctx->layout[j - 1]->weight) {
+                ctx->layout_align[j] = 0;
+                found = 1;
+            }
+        }
+
+        if (found)
+            dropped = 1;
+        else if (!unreachable)
+            unreachable = curr_node;
+    }
+
+    if (dropped)
+        return 1;
+
+    if (unreachable) {
+        printf("[CGP] error: short branch at %X can't reach its target\n",
+               unreachable->origin);
+        return INVALID_VALUE;
+    }
+
+    return 0;
+}
+
+/** Shrink every JMP/JCC whose displacement fits in rel8.
+ *
+ *  Starts from rel32 forms and re-lays out until nothing changes. Shrinking
+ *  a branch never moves two nodes apart, so it converges. LOOP and JECXZ
+ *  can't grow, padding in their way is dropped after that.
+ *
+ *  @return size of code, INVALID_VALUE if a short branch can't be encoded
+ */
+static uint32_t cgp_relax_layout(cgp_ctx *ctx)
+{
+    uint32_t long_size, size, changed, stuck, dropped = 0;
+    int32_t displacement;
+    uint8_t *pinned;
+    pNode curr_node, target;
+
+    ctx->build_info.relaxed_branches = 0;
+
+    for (uint32_t i = 0 ; i < ctx->layout_count ; i++) {
+        curr_node = ctx->layout[i];
+
+        if (curr_node->type == NODE_JMP || curr_node->type == NODE_JCC)
+            cgp_short2long(curr_node);
+    }
+
+    long_size = size = cgp_layout_offsets(ctx);
+
+    /* branches which have grown back, they are never shrunk again */
+    pinned = (uint8_t*) calloc(ctx->layout_count + 1, 1);
+
+    do {
+        changed = 0;
+        stuck = 0;
+
+        for (uint32_t i = 0 ; i < ctx->layout_count ; i++) {
+            curr_node = ctx->layout[i];
+
+            if ((curr_node->type != NODE_JMP &&
+                 curr_node->type != NODE_JCC) || pinned[i])
+                continue;
+
+            target = cgp_branch_target(curr_node);
+            if (!target || target->offset == INVALID_OFFSET)
+                continue;
+
+            displacement = (int32_t) (target->offset - curr_node->offset - 2);
+
+            /* padding may move short branch and its target apart */
+            if (curr_node->weight == 2) {
+                if (displacement >= -128 && displacement <= 127)
+                    continue;
+
+                /* LOOP and JECXZ have no long form */
+                cgp_short2long(curr_node);
+
+                if (curr_node->weight != 2) {
+                    ctx->build_info.relaxed_branches--;
+                    pinned[i] = 1;
+                    changed = 1;
+                } else {
+                    stuck = 1;
+                }
+                continue;
+            }
+
+            if (displacement < -128 || displacement > 127)
+                continue;
+
+            cgp_long2short(curr_node);
+
+            if (curr_node->weight == 2) {
+                ctx->build_info.relaxed_branches++;
+                changed = 1;
+            }
+        }
+
+        /* settled, a short branch left out of range can't grow */
+        if (!changed && stuck) {
+            dropped = cgp_layout_unalign(ctx);
+            changed = dropped == 1;
+        }
+
+        if (changed)
+            size = cgp_layout_offsets(ctx);
+    } while (changed);
+
+    free(pinned);
+
+    if (dropped == INVALID_VALUE)
+        return INVALID_VALUE;
+
+    ctx->build_info.relaxed_bytes = long_size - size;
+    return size;
+}
+
+/** Relax branches, copy laid out nodes to a buffer of exact size and
+ *  patch branches.
+ *
+ *  @return size of buffer, 0 and NULL buffer if it failed or is empty
+ */
+static uint32_t cgp_emit_layout(cgp_ctx *ctx, uint8_t **out_buff)
+{
+    uint32_t size;
+    uint8_t *buff;
+    pNode curr_node;
+    CGP_STAT_START(layout_start);
+
+    cgp_layout_mark_aligned(ctx);
+
+    size = cgp_relax_layout(ctx);
+    CGP_STAT_STOP(ctx->stats.layout_ns, layout_start);
+
+    /* nothing is laid out when the graph is empty, e.g. after init failed */
+    if (size == INVALID_VALUE || !ctx->layout_count) {
+        ctx->build_info.size = 0;
+        *out_buff = NULL;
+        return 0;
+    }
+
+    CGP_STAT_START(emit_start);
+    ctx->build_info.size = size;
+    ctx->build_info.nodes = ctx->layout_count;
+    ctx->build_info.cold_offset = size;
+    ctx->build_info.counters = 0;
+    ctx->build_info.patched = 0;
+    ctx->build_info.shifted = 0;
+
+    /* every byte is written below, no need to zero it */
+    buff = (uint8_t *) malloc(size ? size : 1);
+
+    for (uint32_t i = 0, end = 0 ; i < ctx->layout_count ; i++) {
+        curr_node = ctx->layout[i];
+
+        /* alignment padding */
+        if (curr_node->offset != end)
+            cgp_fill_nops(&buff[end], curr_node->offset - end);
+
+        if (curr_node->weight)
+            memcpy(&buff[curr_node->offset], curr_node->data,
+                   curr_node->weight);
+
+        end = curr_node->offset + curr_node->weight;
+    }
+
+    CGP_STAT_STOP(ctx->stats.emit_ns, emit_start);
+    CGP_STAT_ADD(ctx->stats.bytes_emitted, size);
+
+    CGP_STAT_START(patch_start);
+
+    /* configure branch's address */
+    for (uint32_t i = 0 ; i < ctx->layout_count ; i++) {
+        curr_node = ctx->layout[i];
+
+        if (curr_node->type != NODE_JMP &&
+            curr_node->type != NODE_JCC &&
+            curr_node->type != NODE_CALL)
+            continue;
+
+        if (cgp_write_offset(curr_node, buff))
+            CGP_STAT_ADD(ctx->stats.branches_patched, 1);
+    }
+
+    CGP_STAT_STOP(ctx->stats.patch_ns, patch_start);
+
+    CGP_STAT_START(index_start);
+
+    /* offsets now refer to the output code */
+    cgp_rebuild_index(ctx, size);
+
+    CGP_STAT_STOP(ctx->stats.emit_ns, index_start);
+
+    *out_buff = buff;
+    return size;
+}
+
+uint32_t cgp_ctx_build(cgp_ctx *ctx, uint8_t **out_buff)
+{
+    uint32_t offset = 0;
+    int failed = 0;
+    pNode new_node, curr_node, next_node;
+    CGP_STAT_START(layout_start);
+
+    cgp_reset_work(ctx);
+    cgp_layout_reset(ctx);
+
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        if (ctx->nodes[i])
+            ctx->nodes[i]->offset = INVALID_OFFSET;
+    }
+
+    curr_node = ctx->first_node;
+
+    /* lay out instructions */
+    while (curr_node) {
+        if (curr_node->offset == INVALID_OFFSET) {
+            /* node may be excepted below */
+            next_node = curr_node->FLink;
+
+            if (curr_node->type == NODE_LABEL) {
+                cgp_layout_add(ctx, curr_node, &offset);
+            } else {
+                switch (curr_node->type) {
+                    case NODE_CALL:
+                        if (curr_node->CLink->offset == INVALID_OFFSET)
+                            failed = cgp_push_call(ctx, curr_node,
+                                                   curr_node->CLink->origin);
+                        break;
+
+                    case NODE_JCC:
+                        if (curr_node->CLink->offset == INVALID_OFFSET)
+                            failed = cgp_push_jcc(ctx, curr_node,
+                                                  curr_node->CLink->origin);
+                        break;
+                }
+
+                /* out of memory, nothing is emitted */
+                if (failed)
+                    break;
+
+                /* remove redundant code */
+                if (curr_node->type == NODE_JMP && next_node != curr_node &&
+                    next_node->offset == INVALID_OFFSET) {
+                    cgp_except_node(ctx, curr_node);
+                } else {
+                    cgp_layout_add(ctx, curr_node, &offset);
+                }
 
                 if (curr_node->type != NODE_JMP && curr_node->FLink &&
                     curr_node->FLink->offset != INVALID_OFFSET)
                 {
-                    new_node = cgp_allocate_node();
-
-                    new_node->offset = offset;
-                    new_node->type = NODE_JMP;
-                    new_node->weight = 5;
-                    new_node->data = (uint8_t *) malloc(new_node->weight);
-                    new_node->data[0] = OPCODE_X86_JMP_REL32;
-                    new_node->data[1] = 0xCC;
-                    new_node->data[2] = 0xCC;
-                    new_node->data[3] = 0xCC;
-                    new_node->data[4] = 0xCC;
+                    new_node = cgp_allocate_jmp(ctx, curr_node->FLink);
                     new_node->BLink = curr_node->BLink;
-                    new_node->FLink = curr_node->FLink;
 
-                    memcpy(&buff[offset], &new_node->data[0], new_node->weight);
-                    offset += new_node->weight;
-                }
+                    cgp_layout_add(ctx, new_node, &offset);
+                }
+            }
+
+            curr_node = next_node;
+        } else {
+            curr_node = NULL;
+        }
+
+        /* process JCC | CALL branch */
+        if (!curr_node) {
+            curr_node = cgp_pop_pending(ctx, 0).owner;
+            if (curr_node)
+                curr_node = curr_node->CLink;
+        }
+    }
+
+    if (failed) {
+        ctx->build_info.size = 0;
+        *out_buff = NULL;
+        return 0;
+    }
+
+    /* check that all nodes has been placed */
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        if (ctx->nodes[i] && ctx->nodes[i]->offset == INVALID_OFFSET)
+            cgp_layout_add(ctx, ctx->nodes[i], &offset);
+    }
+
+    CGP_STAT_STOP(ctx->stats.layout_ns, layout_start);
+    return cgp_emit_layout(ctx, out_buff);
+}
+
+/* code of an edit must be whole instructions without control flow */
+static int cgp_check_code(cgp_ctx *ctx, const uint8_t *code, uint32_t size,
+                          lde_insn *first)
+{
+    uint8_t window[LDE_MAX_READ];
+    uint32_t length, left;
+    lde_insn insn;
+
+    if (!code || !size)
+        return -1;
+
+    for (uint32_t offset = 0 ; offset < size ; offset += length) {
+        /* decoder may look past the last instruction */
+        left = size - offset;
+        memset(window, 0, sizeof(window));
+        memcpy(window, &code[offset],
+               left < LDE_MAX_READ ? left : LDE_MAX_READ);
+
+        length = lde_decode_insn(window, &insn);
+        CGP_STAT_ADD(ctx->stats.lde_calls, 1);
+
+        if (!length || length > size - offset ||
+            cgp_get_node_type(&insn) != NODE_LINE)
+            return -1;
+
+        if (!offset)
+            *first = insn;
+    }
+
+    return 0;
+}
+
+/* node is changed since the image was written */
+static void cgp_image_dirty(cgp_ctx *ctx, pNode in_node)
+{
+    if (in_node->index < ctx->image_offsets_size)
+        ctx->image_offsets[in_node->index] = INVALID_OFFSET;
+}
+
+static uint32_t cgp_image_offset(cgp_ctx *ctx, pNode in_node)
+{
+    if (in_node->index >= ctx->image_offsets_size)
+        return INVALID_OFFSET;
+
+    return ctx->image_offsets[in_node->index];
+}
+
+/* remember where every node of layout is in the image */
+static void cgp_image_sync(cgp_ctx *ctx)
+{
+    if (ctx->image_offsets_size < ctx->nodes_count) {
+        ctx->image_offsets = (uint32_t*) realloc(ctx->image_offsets,
+                                        sizeof(uint32_t) * ctx->nodes_count);
+
+        for (uint32_t i = ctx->image_offsets_size ; i < ctx->nodes_count ; i++)
+            ctx->image_offsets[i] = INVALID_OFFSET;
+
+        ctx->image_offsets_size = ctx->nodes_count;
+    }
+
+    for (uint32_t i = 0 ; i < ctx->layout_count ; i++)
+        ctx->image_offsets[ctx->layout[i]->index] = ctx->layout[i]->offset;
+}
+
+/* node is in layout or waits to be merged into it */
+static int cgp_layout_has(cgp_ctx *ctx, pNode in_node)
+{
+    uint32_t position = in_node->layout_index;
+
+    if (position < ctx->layout_count)
+        return ctx->layout[position] == in_node;
+
+    position -= ctx->layout_count;
+    return position < ctx->inserts_count &&
+           ctx->inserts[position].node == in_node;
+}
+
+/* put node right after other one of layout, merged by next build */
+static void cgp_layout_insert(cgp_ctx *ctx, pNode prev_node, pNode in_node)
+{
+    if (!cgp_layout_has(ctx, prev_node))
+        return;
+
+    if (ctx->inserts_count == ctx->inserts_size) {
+        ctx->inserts_size = ctx->inserts_size ? ctx->inserts_size * 2
+                                              : NODE_TABLE_MIN;
+        ctx->inserts = (LayoutInsert*) realloc(ctx->inserts,
+                                               sizeof(LayoutInsert) *
+                                               ctx->inserts_size);
+    }
+
+    in_node->layout_index = ctx->layout_count + ctx->inserts_count;
+    ctx->inserts[ctx->inserts_count].prev = prev_node;
+    ctx->inserts[ctx->inserts_count++].node = in_node;
+}
+
+/* inserts by layout position of the node before them, the last one first */
+static int cgp_compare_inserts(const void *a, const void *b)
+{
+    const uint32_t *x = (const uint32_t*) a, *y = (const uint32_t*) b;
+
+    if (x[0] != y[0])
+        return x[0] < y[0] ? -1 : 1;
+
+    return x[1] < y[1] ? 1 : x[1] > y[1] ? -1 : 0;
+}
+
+/** Merge inserts into layout in one pass from its end.
+ *
+ *  The last node inserted after a node comes right after it and every
+ *  inserted node is followed by nodes inserted after it, the same order
+ *  as if each insert moved the rest of layout. Only arrays of inserts are
+ *  allocated, positions are set again by cgp_layout_offsets(...).
+ *
+ *  @return void
+ */
+static void cgp_layout_merge(cgp_ctx *ctx)
+{
+    uint32_t *sorted, *first, *next, *stack, k, parent, depth, length;
+    uint32_t count = ctx->inserts_count, end, top, group, last, i;
+    pNode *run;
+
+    if (!count)
+        return;
+
+    /* pairs of position and insert for the nodes of layout, lists for
+       the inserted nodes, their position is layout_count + insert */
+    sorted = (uint32_t*) malloc(sizeof(uint32_t) * 2 * count);
+    first = (uint32_t*) malloc(sizeof(uint32_t) * count);
+    next = (uint32_t*) malloc(sizeof(uint32_t) * count);
+    stack = (uint32_t*) malloc(sizeof(uint32_t) * count);
+    run = (pNode*) malloc(sizeof(pNode) * count);
+
+    for (k = 0 ; k < count ; k++) {
+        first[k] = INVALID_VALUE;
+        next[k] = INVALID_VALUE;
+    }
+
+    group = 0;
+    for (k = 0 ; k < count ; k++) {
+        parent = ctx->inserts[k].prev->layout_index;
+
+        if (parent < ctx->layout_count) {
+            sorted[group * 2] = parent;
+            sorted[group * 2 + 1] = k;
+            group++;
+        } else {
+            parent -= ctx->layout_count;
+            next[k] = first[parent];
+            first[parent] = k;
+        }
+    }
+
+    qsort(sorted, group, sizeof(uint32_t) * 2, cgp_compare_inserts);
+
+    if (ctx->layout_count + count > ctx->layout_size) {
+        while (ctx->layout_count + count > ctx->layout_size)
+            ctx->layout_size *= 2;
+
+        ctx->layout = (pNode*) realloc(ctx->layout,
+                                       sizeof(pNode) * ctx->layout_size);
+        ctx->layout_align = (uint8_t*) realloc(ctx->layout_align,
+                                               ctx->layout_size);
+    }
+
+    /* from the end, nodes between two runs move as one block */
+    end = ctx->layout_count + count;
+    top = ctx->layout_count;
+
+    if (ctx->layout_cold != INVALID_VALUE &&
+        ctx->layout_cold >= ctx->layout_count)
+        ctx->layout_cold = end;
+
+    while (group) {
+        i = sorted[(group - 1) * 2];
+        last = group;
+
+        while (group && sorted[(group - 1) * 2] == i)
+            group--;
+
+        end -= top - i - 1;
+        memmove(&ctx->layout[end], &ctx->layout[i + 1],
+                sizeof(pNode) * (top - i - 1));
+        memmove(&ctx->layout_align[end], &ctx->layout_align[i + 1],
+                top - i - 1);
+
+        if (ctx->layout_cold != INVALID_VALUE &&
+            ctx->layout_cold > i && ctx->layout_cold < top)
+            ctx->layout_cold += end - i - 1;
+
+        /* depth first run of nodes inserted after this one */
+        length = 0;
+        for (uint32_t g = group ; g < last ; g++) {
+            k = sorted[g * 2 + 1];
+            depth = 0;
+
+            while (k != INVALID_VALUE || depth) {
+                if (k == INVALID_VALUE) {
+                    k = stack[--depth];
+                    continue;
+                }
+
+                run[length++] = ctx->inserts[k].node;
+                stack[depth++] = next[k];
+                k = first[k];
+            }
+        }
+
+        end -= length;
+        memcpy(&ctx->layout[end], run, sizeof(pNode) * length);
+        memset(&ctx->layout_align[end], 0, length);
+        top = i + 1;
+    }
+
+    ctx->layout_count += count;
+    ctx->inserts_count = 0;
+
+    free(sorted);
+    free(first);
+    free(next);
+    free(stack);
+    free(run);
+}
+
+uint32_t cgp_ctx_insert_code(cgp_ctx *ctx, uint32_t node, const uint8_t *code,
+                             uint32_t size)
+{
+    pNode prev_node, new_node;
+    lde_insn insn;
+
+    if (node >= ctx->nodes_count || !(prev_node = ctx->nodes[node]))
+        return INVALID_VALUE;
+
+    /* only nodes which fall through to their FLink */
+    if (prev_node->type != NODE_LINE && prev_node->type != NODE_CALL &&
+        prev_node->type != NODE_JCC)
+        return INVALID_VALUE;
+
+    if (cgp_check_code(ctx, code, size, &insn))
+        return INVALID_VALUE;
+
+    new_node = cgp_insert_node(ctx, prev_node, INSERT_AFTER);
+
+    new_node->type = NODE_LINE;
+    new_node->insn = insn;
+    new_node->weight = size;
+    new_node->data = cgp_allocate_data(ctx, size);
+    memcpy(new_node->data, code, size);
+
+    cgp_layout_insert(ctx, prev_node, new_node);
+    return new_node->index;
+}
+
+int cgp_ctx_replace_code(cgp_ctx *ctx, uint32_t node, const uint8_t *code,
+                         uint32_t size)
+{
+    pNode in_node;
+    lde_insn insn;
+
+    if (node >= ctx->nodes_count || !(in_node = ctx->nodes[node]) ||
+        in_node->type != NODE_LINE || cgp_check_code(ctx, code, size, &insn))
+        return -1;
+
+    in_node->insn = insn;
+
+    /* data may point to read-only input, so it is never written over */
+    in_node->data = cgp_allocate_data(ctx, size);
+    in_node->weight = size;
+    memcpy(in_node->data, code, size);
+
+    cgp_image_dirty(ctx, in_node);
+    return 0;
+}
+
+/* new offsets of layout, short branches out of range grow and get dirty */
+static uint32_t cgp_relayout_incremental(cgp_ctx *ctx)
+{
+    uint32_t size, changed, stuck, dropped = 0;
+    int32_t displacement;
+    pNode curr_node, target;
+
+    do {
+        size = cgp_layout_offsets(ctx);
+        changed = 0;
+        stuck = 0;
+
+        for (uint32_t i = 0 ; i < ctx->layout_count ; i++) {
+            curr_node = ctx->layout[i];
+
+            if ((curr_node->type != NODE_JMP &&
+                 curr_node->type != NODE_JCC) || curr_node->weight != 2)
+                continue;
+
+            target = cgp_branch_target(curr_node);
+            if (!target || target->offset == INVALID_OFFSET)
+                continue;
+
+            displacement = (int32_t) (target->offset - curr_node->offset - 2);
+            if (displacement >= -128 && displacement <= 127)
+                continue;
+
+            /* LOOP and JECXZ have no long form */
+            cgp_short2long(curr_node);
+
+            if (curr_node->weight != 2) {
+                ctx->build_info.relaxed_branches--;
+                cgp_image_dirty(ctx, curr_node);
+                changed = 1;
+            } else {
+                stuck = 1;
+            }
+        }
+
+        if (!changed && stuck) {
+            dropped = cgp_layout_unalign(ctx);
+            changed = dropped == 1;
+        }
+    } while (changed);
+
+    return dropped == INVALID_VALUE ? INVALID_VALUE : size;
+}
+
+/* distance a node of the image is moved by, nodes must be unchanged */
+static uint32_t cgp_image_shift(cgp_ctx *ctx, pNode in_node)
+{
+    return in_node->offset - ctx->image_offsets[in_node->index];
+}
+
+/* two unchanged nodes which are moved together */
+static int cgp_image_same_run(cgp_ctx *ctx, pNode first, pNode second)
+{
+    return cgp_image_offset(ctx, first) != INVALID_OFFSET &&
+           cgp_image_offset(ctx, second) != INVALID_OFFSET &&
+           cgp_image_shift(ctx, first) == cgp_image_shift(ctx, second);
+}
+
+typedef struct image_run {
+    uint32_t from, to, size;
+} ImageRun;
+
+/* move runs of unchanged nodes to their new offsets inside of image */
+static void cgp_image_move(cgp_ctx *ctx)
+{
+    ImageRun *runs;
+    uint32_t count = 0, old_offset;
+    pNode curr_node;
+
+    runs = (ImageRun*) malloc(sizeof(ImageRun) * (ctx->layout_count + 1));
+
+    for (uint32_t i = 0 ; i < ctx->layout_count ; i++) {
+        curr_node = ctx->layout[i];
+        old_offset = cgp_image_offset(ctx, curr_node);
+
+        if (old_offset == INVALID_OFFSET || old_offset == curr_node->offset)
+            continue;
+
+        /* run goes on while nodes keep the same shift */
+        if (count && i && cgp_image_same_run(ctx, ctx->layout[i - 1],
+                                             curr_node)) {
+            runs[count - 1].size = old_offset + curr_node->weight -
+                                   runs[count - 1].from;
+            continue;
+        }
+
+        runs[count].from = old_offset;
+        runs[count].to = curr_node->offset;
+        runs[count].size = curr_node->weight;
+        count++;
+    }
+
+    /*
+     *  Runs keep their order, so a run moved down never covers a run which
+     *  isn't moved yet if they go from start, and a run moved up if they go
+     *  from end.
+     */
+    for (uint32_t i = 0 ; i < count ; i++) {
+        if (runs[i].to < runs[i].from)
+            memmove(&ctx->image[runs[i].to], &ctx->image[runs[i].from],
+                    runs[i].size);
+    }
+
+    for (uint32_t i = count ; i-- > 0 ; ) {
+        if (runs[i].to > runs[i].from)
+            memmove(&ctx->image[runs[i].to], &ctx->image[runs[i].from],
+                    runs[i].size);
+    }
+
+    for (uint32_t i = 0 ; i < count ; i++)
+        ctx->build_info.shifted += runs[i].size;
+
+    free(runs);
+}
+
+/* branch of unchanged code which still has the same displacement */
+static int cgp_image_branch_valid(cgp_ctx *ctx, pNode in_node, pNode target)
+{
+    uint32_t old_offset = cgp_image_offset(ctx, in_node);
+    uint32_t old_target = cgp_image_offset(ctx, target);
+
+    if (old_offset == INVALID_OFFSET || old_target == INVALID_OFFSET)
+        return 0;
+
+    return target->offset - in_node->offset == old_target - old_offset;
+}
+
+uint32_t cgp_ctx_build_incremental(cgp_ctx *ctx, const uint8_t **out_buff)
+{
+    uint32_t size, end = 0;
+    uint8_t *buff;
+    pNode curr_node, prev_node = NULL, target;
+
+    ctx->build_info.patched = 0;
+    ctx->build_info.shifted = 0;
+
+    cgp_layout_merge(ctx);
+
+    /* the first time all the code is written */
+    if (!ctx->image_valid) {
+        size = ctx->layout_count ? cgp_emit_layout(ctx, &buff)
+                                 : cgp_ctx_build(ctx, &buff);
+
+        if (!buff) {
+            *out_buff = NULL;
+            return 0;
+        }
+
+        free(ctx->image);
+        ctx->image = buff;
+        ctx->image_size = size;
+        ctx->image_capacity = size ? size : 1;
+        ctx->image_valid = 1;
+
+        cgp_image_sync(ctx);
+
+        *out_buff = ctx->image;
+        return size;
+    }
+
+    CGP_STAT_START(layout_start);
+    size = cgp_relayout_incremental(ctx);
+    CGP_STAT_STOP(ctx->stats.layout_ns, layout_start);
+
+    /* image is written again by the next call */
+    if (size == INVALID_VALUE) {
+        ctx->image_valid = 0;
+        *out_buff = NULL;
+        return 0;
+    }
+
+    CGP_STAT_START(emit_start);
+
+    if (size > ctx->image_capacity) {
+        ctx->image_capacity = size + size / 4;
+        ctx->image = (uint8_t*) realloc(ctx->image, ctx->image_capacity);
+    }
+
+    cgp_image_move(ctx);
+
+    /* changed nodes and padding between runs */
+    for (uint32_t i = 0 ; i < ctx->layout_count ; i++) {
+        curr_node = ctx->layout[i];
+
+        if (curr_node->offset != end &&
+            (!prev_node || !cgp_image_same_run(ctx, prev_node, curr_node))) {
+            cgp_fill_nops(&ctx->image[end], curr_node->offset - end);
+            CGP_STAT_ADD(ctx->stats.bytes_emitted, curr_node->offset - end);
+        }
+
+        if (cgp_image_offset(ctx, curr_node) == INVALID_OFFSET &&
+            curr_node->weight) {
+            memcpy(&ctx->image[curr_node->offset], curr_node->data,
+                   curr_node->weight);
+            CGP_STAT_ADD(ctx->stats.bytes_emitted, curr_node->weight);
+        }
+
+        end = curr_node->offset + curr_node->weight;
+        prev_node = curr_node;
+    }
+
+    CGP_STAT_STOP(ctx->stats.emit_ns, emit_start);
+
+    CGP_STAT_START(patch_start);
+
+    /* only branches which are rewritten or moved against their target */
+    for (uint32_t i = 0 ; i < ctx->layout_count ; i++) {
+        curr_node = ctx->layout[i];
+
+        if (curr_node->type != NODE_JMP &&
+            curr_node->type != NODE_JCC &&
+            curr_node->type != NODE_CALL)
+            continue;
+
+        target = cgp_branch_target(curr_node);
+        if (!target || target->offset == INVALID_OFFSET ||
+            cgp_image_branch_valid(ctx, curr_node, target))
+            continue;
+
+        ctx->build_info.patched += cgp_write_offset(curr_node, ctx->image);
+    }
+
+    CGP_STAT_STOP(ctx->stats.patch_ns, patch_start);
+    CGP_STAT_ADD(ctx->stats.branches_patched, ctx->build_info.patched);
+
+    cgp_image_sync(ctx);
+
+    ctx->image_size = size;
+    ctx->build_info.size = size;
+    ctx->build_info.nodes = ctx->layout_count;
+
+    *out_buff = ctx->image;
+    return size;
+}
+
+static void cgp_add_reduntant_nop(cgp_ctx *ctx)
+{
+    uint32_t original_nodes_count = ctx->nodes_count;
+    pNode insert_node;
+
+    for (uint32_t i = 0 ; i + 1 < original_nodes_count ; i++) {
+        if (!ctx->nodes[i])
+            continue;
+
+        insert_node = cgp_insert_node(ctx, ctx->nodes[i], INSERT_AFTER);
+
+        insert_node->weight = 1;
+        insert_node->data = cgp_allocate_data(ctx, insert_node->weight);
+        insert_node->data[0] = OPCODE_X86_NOP;
+
+        insert_node->CLink = NULL;
+        insert_node->type = NODE_LINE;
+    }
+}
+
+uint32_t cgp_ctx_build_reduntant_nop(cgp_ctx *ctx, uint8_t **out_buff)
+{
+    cgp_add_reduntant_nop(ctx);
+    return cgp_ctx_build(ctx, out_buff);
+}
+
+enum flags_effects {
+    FLAGS_KEEP,             /* neither reads nor sets every status flag */
+    FLAGS_SET,              /* sets every status flag without reading */
+    FLAGS_READ              /* reads flags or unknown */
+};
+
+/* what an instruction does with status flags, anything unknown reads */
+static int cgp_flags_effect(const uint8_t *code)
+{
+    uint8_t op, reg;
+
+    while (*code == 0x66 || *code == 0x67 || *code == 0xF0 ||
+           *code == 0xF2 || *code == 0xF3 || *code == 0x26 ||
+           *code == 0x2E || *code == 0x36 || *code == 0x3E ||
+           *code == 0x64 || *code == 0x65)
+        code++;
+
+    op = code[0];
+    reg = (code[1] >> 3) & 7;
+
+    /* add, or, adc, sbb, and, sub, xor, cmp */
+    if (op < 0x40 && (op & 7) < 6)
+        return (op >> 3) == 2 || (op >> 3) == 3 ? FLAGS_READ : FLAGS_SET;
+
+    if (op >= 0x80 && op <= 0x83)
+        return reg == 2 || reg == 3 ? FLAGS_READ : FLAGS_SET;
+
+    if (op == 0x84 || op == 0x85 || op == 0xA8 || op == 0xA9)
+        return FLAGS_SET;
+
+    if (op == 0xF6 || op == 0xF7) {
+        if (reg == 0 || reg == 1 || reg == 3) return FLAGS_SET;
+        return FLAGS_KEEP;
+    }
+
+    /* shift by zero keeps flags, rcl and rcr read CF */
+    if (op == 0xC0 || op == 0xC1 || (op >= 0xD0 && op <= 0xD3))
+        return reg == 2 || reg == 3 ? FLAGS_READ : FLAGS_KEEP;
+
+    /* inc, dec, push, pop, imul, mov, lea, xchg, cbw, cdq */
+    if ((op >= 0x40 && op <= 0x6B) || (op >= 0x86 && op <= 0x99) ||
+        (op >= 0xB0 && op <= 0xBF) || op == 0xC6 || op == 0xC7)
+        return FLAGS_KEEP;
+
+    /* flags don't live across return */
+    if (op == 0xC2 || op == 0xC3)
+        return FLAGS_SET;
+
+    /* inc, dec, indirect call, push */
+    if ((op == 0xFE || op == 0xFF) && (reg <= 2 || reg == 6))
+        return FLAGS_KEEP;
+
+    /* movzx, movsx, imul, nop */
+    if (op == 0x0F && (code[1] == 0xB6 || code[1] == 0xB7 ||
+                       code[1] == 0xBE || code[1] == 0xBF ||
+                       code[1] == 0xAF || code[1] == 0x1F))
+        return FLAGS_KEEP;
+
+    return FLAGS_READ;
+}
+
+/* flags may be read before they are set again from the start of node */
+static int cgp_flags_live(cgp_ctx *ctx, pNode in_node)
+{
+    uint32_t offset, length, steps = 0;
+
+    while (in_node && steps++ < FLAGS_SCAN_LIMIT) {
+        switch (in_node->type) {
+            case NODE_LINE:
+                for (offset = 0 ; offset < in_node->weight ; offset += length) {
+                    switch (cgp_flags_effect(&in_node->data[offset])) {
+                        case FLAGS_SET:     return 0;
+                        case FLAGS_READ:    return 1;
+                    }
+
+                    length = lde_get_length(&in_node->data[offset], NULL);
+                    CGP_STAT_ADD(ctx->stats.lde_calls, 1);
+
+                    if (!length)
+                        return 1;
+                }
+                break;
+
+            case NODE_JMP:
+                break;
+
+            /* callee doesn't keep them */
+            case NODE_CALL:
+            case NODE_RET:
+                return 0;
+
+            default:
+                return 1;
+        }
+
+        in_node = in_node->FLink;
+    }
+
+    return 1;
+}
+
+/* entered other way than straight from its only predecessor */
+static int cgp_block_head(cgp_ctx *ctx, pNode in_node)
+{
+    pNode pred = in_node->FPreds;
+
+    if (in_node == ctx->first_node || in_node->CPreds || !pred || pred->FNext)
+        return 1;
+
+    return pred->type == NODE_JCC || pred->type == NODE_RET;
+}
+
+/* put counter in front of node, every edge to node goes to the counter */
+static pNode cgp_insert_counter(cgp_ctx *ctx, pNode in_node,
+                                uint32_t address, int save_flags)
+{
+    pNode new_node = cgp_allocate_node(ctx);
+    uint8_t *data;
+
+    new_node->type = NODE_LINE;
+    new_node->weight = save_flags ? 8 : 6;
+    new_node->data = data = cgp_allocate_data(ctx, new_node->weight);
+
+    if (save_flags) *data++ = 0x9C;                 /* pushfd */
+
+    data[0] = 0xFF;                                 /* inc dword [address] */
+    data[1] = 0x05;
+    memcpy(&data[2], &address, 4);
+
+    if (save_flags) data[6] = 0x9D;                 /* popfd */
+
+    while (in_node->FPreds)
+        cgp_set_flink(in_node->FPreds, new_node);
+
+    while (in_node->CPreds)
+        cgp_set_clink(in_node->CPreds, new_node);
+
+    if (in_node == ctx->first_node)
+        ctx->first_node = new_node;
+
+    new_node->BLink = in_node->BLink;
+    in_node->BLink = new_node;
+    cgp_set_flink(new_node, in_node);
+
+    return new_node;
+}
+
+uint32_t cgp_ctx_build_instrumented(cgp_ctx *ctx, uint32_t counters_address,
+                                    const char *map_file, uint8_t **out_buff)
+{
+    uint32_t nodes_count = ctx->nodes_count, counter_count = 0, counter;
+    uint32_t *counters, size;
+    uint8_t *heads;
+    pNode curr_node, head;
+    FILE *fh = NULL;
+
+    counters = (uint32_t*) malloc(sizeof(uint32_t) * (nodes_count + 1));
+    heads = (uint8_t*) calloc(nodes_count + 1, sizeof(uint8_t));
+
+    /* graph changes below, so decide everything first */
+    for (uint32_t i = 0 ; i < nodes_count ; i++) {
+        curr_node = ctx->nodes[i];
+        counters[i] = INVALID_VALUE;
+
+        if (!curr_node || curr_node->type == NODE_LABEL ||
+            !cgp_block_head(ctx, curr_node))
+            continue;
+
+        heads[i] = cgp_flags_live(ctx, curr_node) ? 2 : 1;
+        counters[i] = counter_count++;
+    }
+
+    /* rest of block counts by counter of its head */
+    for (uint32_t i = 0 ; i < nodes_count ; i++) {
+        if (!ctx->nodes[i] || counters[i] != INVALID_VALUE)
+            continue;
+
+        counter = INVALID_VALUE;
+        head = ctx->nodes[i];
+
+        for (uint32_t steps = 0 ; steps < nodes_count && head->FPreds ; steps++) {
+            head = head->FPreds;
+
+            if (counters[head->index] != INVALID_VALUE) {
+                counter = counters[head->index];
+                break;
+            }
+        }
+
+        for (curr_node = ctx->nodes[i] ; curr_node != head ;
+             curr_node = curr_node->FPreds)
+            counters[curr_node->index] = counter;
+    }
+
+    if (map_file) {
+        fh = fopen(map_file, "w");
+        if (!fh)
+            printf("[CGP] error: can`t open %s\n", map_file);
+    }
+
+    if (fh)
+        fprintf(fh, "# counter offset\n");
+
+    for (uint32_t i = 0 ; i < nodes_count ; i++) {
+        curr_node = ctx->nodes[i];
+
+        if (!curr_node || counters[i] == INVALID_VALUE)
+            continue;
+
+        if (fh && curr_node->origin != INVALID_OFFSET)
+            fprintf(fh, "%u 0x%08X\n", counters[i], curr_node->origin);
+
+        if (heads[i])
+            cgp_insert_counter(ctx, curr_node,
+                               counters_address + counters[i] * 4,
+                               heads[i] == 2);
+    }
+
+    if (fh)
+        fclose(fh);
+
+    free(counters);
+    free(heads);
+
+    size = cgp_ctx_build(ctx, out_buff);
+    ctx->build_info.counters = counter_count;
+
+    return size;
+}
+
+uint32_t cgp_ctx_build_spaghetti(cgp_ctx *ctx, uint8_t **out_buff)
+{
+    uint32_t i, order_count = 0, offset = 0;
+    pNode *order, curr_node, new_node;
+    CGP_STAT_START(layout_start);
+
+    /* shuffle a copy, node table order stays stable */
+    order = (pNode*) malloc(sizeof(pNode) * (ctx->nodes_count + 1));
+
+    for (i = 0 ; i < ctx->nodes_count ; i++) {
+        if (ctx->nodes[i])
+            order[order_count++] = ctx->nodes[i];
+    }
+
+    shuffle_array(ctx, order, order_count, sizeof(pNode));
+
+    cgp_layout_reset(ctx);
+
+    if (ctx->first_node) {
+        new_node = cgp_allocate_jmp(ctx, ctx->first_node);
+        cgp_layout_add(ctx, new_node, &offset);
+    }
+
+    for (i = 0 ; i < order_count ; i++) {
+        curr_node = order[i];
+        cgp_layout_add(ctx, curr_node, &offset);
+
+        /* there execution flow after RET */
+        if (curr_node->type == NODE_RET)
+            continue;
+
+        new_node = cgp_allocate_jmp(ctx, curr_node->FLink);
+        new_node->BLink = curr_node->BLink;
+
+        cgp_layout_add(ctx, new_node, &offset);
+    }
+
+    free(order);
+
+    CGP_STAT_STOP(ctx->stats.layout_ns, layout_start);
+    return cgp_emit_layout(ctx, out_buff);
+}
+
+/* JCC <-> inverted JCC with swapped links, LOOP and JECXZ can't */
+static int cgp_invert_jcc(pNode in_node)
+{
+    pNode temp;
+
+    if (in_node->insn.opcode == 0x0F) {
+        in_node->data[1] ^= 1;
+        in_node->insn.opcode2 ^= 1;
+    } else if (in_node->insn.opcode >= 0x70 && in_node->insn.opcode <= 0x7F) {
+        in_node->data[0] ^= 1;
+        in_node->insn.opcode ^= 1;
+    } else {
+        return 0;
+    }
+
+    temp = in_node->FLink;
+    cgp_set_flink(in_node, in_node->CLink);
+    cgp_set_clink(in_node, temp);
+    return 1;
+}
+
+static int cgp_compare_profile_node(const void *a, const void *b)
+{
+    const cgp_profile_node *x = a, *y = b;
+
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+
+    return 0;
+}
+
+static int cgp_compare_profile_edge(const void *a, const void *b)
+{
+    const cgp_profile_edge *x = a, *y = b;
+
+    if (x->from != y->from)
+        return x->from < y->from ? -1 : 1;
+
+    if (x->to != y->to)
+        return x->to < y->to ? -1 : 1;
+
+    return 0;
+}
+
+typedef struct layout_edge {
+    uint32_t weight;
+    uint32_t from, to;      /* node indexes */
+} LayoutEdge;
+
+static int cgp_compare_layout_edge(const void *a, const void *b)
+{
+    const LayoutEdge *x = a, *y = b;
+
+    if (x->weight != y->weight)
+        return x->weight > y->weight ? -1 : 1;
+
+    if (x->from != y->from)
+        return x->from < y->from ? -1 : 1;
+
+    return x->to < y->to ? -1 : (x->to > y->to);
+}
+
+/* input offset a profile refers to, builder JMP and LABEL inherit it */
+static uint32_t cgp_profile_origin(pNode in_node)
+{
+    if (in_node->origin == INVALID_OFFSET && in_node->BLink)
+        return in_node->BLink->origin;
+
+    return in_node->origin;
+}
+
+static uint32_t cgp_profile_count(const cgp_profile_node *nodes,
+                                  uint32_t count, uint32_t origin)
+{
+    cgp_profile_node key, *found;
+
+    if (!count || origin == INVALID_OFFSET)
+        return 0;
+
+    key.offset = origin;
+    found = bsearch(&key, nodes, count, sizeof(key),
+                    cgp_compare_profile_node);
+
+    return found ? found->count : 0;
+}
+
+static uint32_t cgp_layout_find(uint32_t *chain, uint32_t index)
+{
+    while (chain[index] != index) {
+        chain[index] = chain[chain[index]];
+        index = chain[index];
+    }
+
+    return index;
+}
+
+/* hottest chain first */
+static int cgp_compare_chain(const void *a, const void *b)
+{
+    const LayoutEdge *x = a, *y = b;
+
+    if (x->weight != y->weight)
+        return x->weight > y->weight ? -1 : 1;
+
+    return x->from < y->from ? -1 : (x->from > y->from);
+}
+
+/** Order nodes by chains of hottest fallthrough edges.
+ *
+ *  Pettis-Hansen: edges are taken from hottest to coldest and join two
+ *  chains if the edge goes from tail of one to head of another. Chains are
+ *  ordered by their hottest node, entry first and never executed last.
+ *
+ *  @return count of nodes in order
+ */
+static uint32_t cgp_profile_order(cgp_ctx *ctx, const cgp_profile *profile,
+                                  pNode *order, uint32_t *cold_start)
+{
+    cgp_profile_node *nodes = NULL;
+    cgp_profile_edge *edges = NULL, key, *found;
+    LayoutEdge *layout_edges, *heads;
+    uint32_t *count, *hot, *chain, *next;
+    uint8_t *has_prev;
+    uint32_t n = ctx->nodes_count, nodes_count = 0, edges_count = 0;
+    uint32_t edge_count = 0, heads_count = 0, order_count = 0, from, to;
+    pNode curr_node, targets[2];
+
+    if (profile && profile->nodes_count && profile->nodes) {
+        nodes_count = profile->nodes_count;
+        nodes = malloc(sizeof(cgp_profile_node) * nodes_count);
+        memcpy(nodes, profile->nodes, sizeof(cgp_profile_node) * nodes_count);
+        qsort(nodes, nodes_count, sizeof(cgp_profile_node),
+              cgp_compare_profile_node);
+    }
+
+    if (profile && profile->edges_count && profile->edges) {
+        edges_count = profile->edges_count;
+        edges = malloc(sizeof(cgp_profile_edge) * edges_count);
+        memcpy(edges, profile->edges, sizeof(cgp_profile_edge) * edges_count);
+        qsort(edges, edges_count, sizeof(cgp_profile_edge),
+              cgp_compare_profile_edge);
+    }
+
+    count = (uint32_t*) calloc(n + 1, sizeof(uint32_t));
+    hot = (uint32_t*) calloc(n + 1, sizeof(uint32_t));
+    chain = (uint32_t*) malloc(sizeof(uint32_t) * (n + 1));
+    next = (uint32_t*) malloc(sizeof(uint32_t) * (n + 1));
+    heads = (LayoutEdge*) malloc(sizeof(LayoutEdge) * (n + 1));
+    has_prev = (uint8_t*) calloc(n + 1, sizeof(uint8_t));
+    layout_edges = (LayoutEdge*) malloc(sizeof(LayoutEdge) * (2 * n + 1));
+
+    for (uint32_t i = 0 ; i < n ; i++) {
+        chain[i] = i;
+        next[i] = INVALID_VALUE;
+
+        if (ctx->nodes[i])
+            count[i] = hot[i] = cgp_profile_count(nodes, nodes_count,
+                                         cgp_profile_origin(ctx->nodes[i]));
+    }
+
+    /* edges which may become fallthrough */
+    for (uint32_t i = 0 ; i < n ; i++) {
+        curr_node = ctx->nodes[i];
+
+        if (!curr_node || curr_node->type == NODE_RET)
+            continue;
+
+        targets[0] = curr_node->FLink;
+        targets[1] = NULL;
+
+        if (curr_node->type == NODE_JMP && curr_node->CLink)
+            targets[0] = curr_node->CLink;
+
+        if (curr_node->type == NODE_JCC &&
+            (curr_node->insn.opcode == 0x0F ||
+             (curr_node->insn.opcode >= 0x70 &&
+              curr_node->insn.opcode <= 0x7F)))
+            targets[1] = curr_node->CLink;
+
+        for (uint32_t k = 0 ; k < 2 ; k++) {
+            if (!targets[k] || targets[k] == curr_node ||
+                targets[k] == ctx->first_node ||
+                targets[k]->type == NODE_LABEL)
+                continue;
+
+            from = i;
+            to = targets[k]->index;
+
+            layout_edges[edge_count].from = from;
+            layout_edges[edge_count].to = to;
+            layout_edges[edge_count].weight = count[from] < count[to] ?
+                                              count[from] : count[to];
+
+            if (edges_count) {
+                key.from = cgp_profile_origin(curr_node);
+                key.to = targets[k]->origin;
+                found = bsearch(&key, edges, edges_count, sizeof(key),
+                                cgp_compare_profile_edge);
+
+                if (found)
+                    layout_edges[edge_count].weight = found->count;
             }
 
-            curr_node = curr_node->FLink;
-        } else {
-            curr_node = NULL;
+            if (layout_edges[edge_count].weight > hot[from])
+                hot[from] = layout_edges[edge_count].weight;
+
+            if (layout_edges[edge_count].weight > hot[to])
+                hot[to] = layout_edges[edge_count].weight;
+
+            edge_count++;
         }
+    }
 
-        /* process JCC | CALL branch */
-        if (!curr_node) {
-            if (jcc_count != 0) {
-                curr_node = cgp_pop_jcc();
-                curr_node = curr_node->CLink;
-                continue;
-            }
+    qsort(layout_edges, edge_count, sizeof(LayoutEdge),
+          cgp_compare_layout_edge);
 
-            if (call_count != 0) {
-                curr_node = cgp_pop_call();
-                curr_node = curr_node->CLink;
+    for (uint32_t i = 0 ; i < edge_count ; i++) {
+        from = layout_edges[i].from;
+        to = layout_edges[i].to;
+
+        /* cold code is chained only with cold code */
+        if (!layout_edges[i].weight && (hot[from] || hot[to]))
+            continue;
+
+        if (next[from] != INVALID_VALUE || has_prev[to] ||
+            cgp_layout_find(chain, from) == to)
+            continue;
+
+        next[from] = to;
+        has_prev[to] = 1;
+        chain[to] = cgp_layout_find(chain, from);
+    }
+
+    /* hottest node of every chain */
+    for (uint32_t i = 0 ; i < n ; i++) {
+        if (ctx->nodes[i] && hot[i] > hot[cgp_layout_find(chain, i)])
+            hot[cgp_layout_find(chain, i)] = hot[i];
+    }
+
+    for (uint32_t i = 0 ; i < n ; i++) {
+        if (!ctx->nodes[i] || has_prev[i] || ctx->nodes[i] == ctx->first_node)
+            continue;
+
+        /* code which runs out of input stays at the end */
+        if (ctx->nodes[i]->type == NODE_LABEL && next[i] == INVALID_VALUE)
+            continue;
+
+        heads[heads_count].weight = hot[i];
+        heads[heads_count].from = i;
+        heads_count++;
+    }
+
+    qsort(heads, heads_count, sizeof(LayoutEdge), cgp_compare_chain);
+
+    *cold_start = INVALID_VALUE;
+
+    for (uint32_t i = 0 ; i <= heads_count ; i++) {
+        if (i == 0) {
+            if (!ctx->first_node)
                 continue;
-            }
+
+            from = ctx->first_node->index;
+        } else {
+            from = heads[i - 1].from;
+
+            if (!heads[i - 1].weight && *cold_start == INVALID_VALUE)
+                *cold_start = order_count;
         }
+
+        for ( ; from != INVALID_VALUE ; from = next[from])
+            order[order_count++] = ctx->nodes[from];
     }
 
-    /* check that all nodes has been written */
-    for (uint32_t i = 0 ; i < nodes_count ; i++) {
-        if (nodes[i] && nodes[i]->offset == INVALID_OFFSET) {
-            curr_node = nodes[i];
-            curr_node->offset = offset;
-            memcpy(&buff[offset], &curr_node->data[0], curr_node->weight);
-            offset += curr_node->weight;
+    for (uint32_t i = 0 ; i < n ; i++) {
+        if (ctx->nodes[i] && ctx->nodes[i]->type == NODE_LABEL &&
+            !has_prev[i] && next[i] == INVALID_VALUE &&
+            ctx->nodes[i] != ctx->first_node)
+            order[order_count++] = ctx->nodes[i];
+    }
+
+    free(nodes);
+    free(edges);
+    free(count);
+    free(hot);
+    free(chain);
+    free(next);
+    free(heads);
+    free(has_prev);
+    free(layout_edges);
+
+    return order_count;
+}
+
+uint32_t cgp_ctx_build_layout(cgp_ctx *ctx, const cgp_profile *profile,
+                              uint8_t **out_buff)
+{
+    uint32_t i, order_count, kept, cold_start, offset = 0, size;
+    pNode *order, curr_node, next_node, new_node, cold_node = NULL;
+    CGP_STAT_START(layout_start);
+
+    order = (pNode*) malloc(sizeof(pNode) * (ctx->nodes_count + 1));
+    order_count = cgp_profile_order(ctx, profile, order, &cold_start);
+
+    if (cold_start != INVALID_VALUE)
+        cold_node = order[cold_start];
+
+    /* JMP to the next node is not needed, go from the end for JMP chains */
+    for (i = order_count, kept = order_count, next_node = NULL ; i-- > 0 ; ) {
+        curr_node = order[i];
+
+        if (curr_node->type == NODE_JMP && next_node &&
+            cgp_branch_target(curr_node) == next_node &&
+            curr_node != ctx->first_node)
+        {
+            if (cold_node == curr_node)
+                cold_node = next_node;
+
+            cgp_except_node(ctx, curr_node);
+            continue;
         }
+
+        order[--kept] = next_node = curr_node;
     }
 
-    /* configure branch's address */
-    for (uint32_t i = 0 ; i < nodes_count ; i++) if (nodes[i]) {
-        if (nodes[i]->type != NODE_JMP &&
-            nodes[i]->type != NODE_JCC &&
-            nodes[i]->type != NODE_CALL)
+    cgp_layout_reset(ctx);
+
+    for (i = 0 ; i < ctx->nodes_count ; i++) {
+        if (ctx->nodes[i])
+            ctx->nodes[i]->offset = INVALID_OFFSET;
+    }
+
+    for (i = kept ; i < order_count ; i++) {
+        curr_node = order[i];
+        next_node = i + 1 < order_count ? order[i + 1] : NULL;
+
+        if (curr_node->type == NODE_JCC && curr_node->CLink == next_node &&
+            curr_node->FLink != next_node)
+            cgp_invert_jcc(curr_node);
+
+        cgp_layout_add(ctx, curr_node, &offset);
+
+        if (curr_node->type == NODE_JMP || curr_node->type == NODE_RET ||
+            !curr_node->FLink || curr_node->FLink == next_node)
             continue;
 
-        cgp_write_offset(nodes[i], buff);
+        new_node = cgp_allocate_jmp(ctx, curr_node->FLink);
+        new_node->BLink = curr_node;
+
+        cgp_layout_add(ctx, new_node, &offset);
     }
 
-    *out_buff = buff;
-    return offset;
+    free(order);
+
+    /* cold code is not aligned */
+    for (i = 0 ; cold_node && i < ctx->layout_count ; i++) {
+        if (ctx->layout[i] == cold_node) {
+            ctx->layout_cold = i;
+            break;
+        }
+    }
+
+    CGP_STAT_STOP(ctx->stats.layout_ns, layout_start);
+
+    size = cgp_emit_layout(ctx, out_buff);
+    ctx->build_info.cold_offset = cold_node ? cold_node->offset : size;
+
+    return size;
 }
 
-static void cgp_add_reduntant_nop(void)
+void cgp_ctx_coalesce_blocks(cgp_ctx *ctx)
 {
-    uint32_t original_nodes_count = nodes_count;
-    pNode insert_node;
+    uint32_t weight;
+    uint8_t *absorbed, *data;
+    pNode head, curr_node, next_node;
+
+    cgp_graph_changed(ctx);
+
+    absorbed = (uint8_t*) calloc(ctx->nodes_count + 1, sizeof(uint8_t));
+
+    /* linear node reached only by fallthrough of another linear node */
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        curr_node = ctx->nodes[i];
 
-    for (uint32_t i = 0 ; i < original_nodes_count - 1 ; i++) {
-        if (!nodes[i])
+        if (!curr_node || curr_node->type != NODE_LINE)
             continue;
 
-        insert_node = cgp_insert_node(nodes[i], INSERT_AFTER);
+        next_node = curr_node->FLink;
 
-        insert_node->weight = 1;
-        insert_node->data = (uint8_t*) malloc(insert_node->weight);
-        insert_node->data[0] = OPCODE_X86_NOP;
+        if (next_node && next_node != curr_node &&
+            next_node->type == NODE_LINE &&
+            next_node != ctx->first_node &&
+            next_node->FPreds == curr_node && !curr_node->FNext &&
+            !next_node->CPreds)
+        {
+            absorbed[next_node->index] = 1;
+        }
+    }
 
-        insert_node->CLink = NULL;
-        insert_node->type = NODE_LINE;
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        head = ctx->nodes[i];
+
+        if (!head || head->type != NODE_LINE || absorbed[i])
+            continue;
+
+        next_node = head->FLink;
+        if (!next_node || !absorbed[next_node->index])
+            continue;
+
+        /* one contiguous copy of the whole run */
+        weight = head->weight;
+        for (curr_node = next_node ; curr_node && absorbed[curr_node->index] ;
+             curr_node = curr_node->FLink)
+            weight += curr_node->weight;
+
+        data = cgp_allocate_data(ctx, weight);
+        memcpy(data, head->data, head->weight);
+
+        head->data = data;
+        data += head->weight;
+
+        while ((next_node = head->FLink) && absorbed[next_node->index]) {
+            absorbed[next_node->index] = 0;
+
+            memcpy(data, next_node->data, next_node->weight);
+            data += next_node->weight;
+
+            cgp_merge_nodes(head, next_node);
+
+            if (head->FLink && head->FLink->BLink == next_node)
+                head->FLink->BLink = head;
+
+            cgp_remove_node(ctx, next_node);
+        }
     }
+
+    free(absorbed);
 }
 
-uint32_t cgp_build_reduntant_nop(uint8_t **out_buff)
+void cgp_ctx_get_build_info(cgp_ctx *ctx, cgp_build_info *info)
 {
-    cgp_add_reduntant_nop();
-    return cgp_build(out_buff);
+    *info = ctx->build_info;
 }
 
-uint32_t cgp_build_spaghetti(uint8_t **out_buff)
+void cgp_ctx_remove_simple_obfuscation(cgp_ctx *ctx)
 {
-    uint32_t i, original_nodes_count, offset = 0;
-    uint8_t *buff;
-    pNode curr_node, new_node;
+    pNode target;
 
-    buff = (uint8_t*) calloc(sizeof(uint8_t), CODE_BUFFER_LIMIT);
+    cgp_graph_changed(ctx);
 
-    #define SKIP_FIRST_X_NODES 0
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        if (!ctx->nodes[i] || ctx->nodes[i]->type != NODE_CALL)
+            continue;
 
-    shuffle_array(&nodes[SKIP_FIRST_X_NODES],
-                  nodes_count - SKIP_FIRST_X_NODES,
-                  sizeof(pNode));
+        /* target out of code is a LABEL without bytes */
+        target = ctx->nodes[i]->CLink;
+        if (!ctx->nodes[i]->FLink || !target || target->weight < 4)
+            continue;
 
-    original_nodes_count = nodes_count;
+        /* CALL -> JMP */
+        if (*(uint32_t*) &target->data[0] == 0x0424648D) {
+            cgp_except_node(ctx, ctx->nodes[i]->FLink);
+            cgp_except_node(ctx, ctx->nodes[i]->CLink);
+            cgp_except_node(ctx, ctx->nodes[i]);
+        }
+    }
+}
 
-    if (first_node && SKIP_FIRST_X_NODES == 0) {
-        new_node = cgp_allocate_node();
+/* marks nodes reachable from entry points, by index */
+static uint8_t *cgp_mark_reachable(cgp_ctx *ctx)
+{
+    pNode *stack, curr_node, next_node;
+    uint32_t count = 0;
+    uint8_t *marks;
 
-        new_node->offset = offset;
-        new_node->type = NODE_JMP;
-        new_node->weight = 5;
-        new_node->data = (uint8_t*) malloc(new_node->weight);
-        new_node->data[0] = OPCODE_X86_JMP_REL32;
-        new_node->data[1] = 0xCC;
-        new_node->data[2] = 0xCC;
-        new_node->data[3] = 0xCC;
-        new_node->data[4] = 0xCC;
-        new_node->FLink = first_node;
+    stack = (pNode*) malloc(sizeof(pNode) * (ctx->nodes_count + 1));
+    marks = (uint8_t*) calloc(ctx->nodes_count + 1, 1);
 
-        memcpy(&buff[offset], &new_node->data[0], new_node->weight);
-        offset += new_node->weight;
-    }
+    for (uint32_t i = 0 ; i <= ctx->roots_count ; i++) {
+        curr_node = i < ctx->roots_count ? ctx->roots[i] : ctx->first_node;
 
-    for (i = 0 ; i < original_nodes_count ; i++) {
-        if (!nodes[i])
+        /* a root may be removed by optimization */
+        if (!curr_node || ctx->nodes[curr_node->index] != curr_node ||
+            marks[curr_node->index])
             continue;
 
-        assert(offset < CODE_BUFFER_LIMIT);
+        marks[curr_node->index] = 1;
+        stack[count++] = curr_node;
 
-        nodes[i]->offset = offset;
-        memcpy(&buff[offset], &nodes[i]->data[0], nodes[i]->weight);
-        offset += nodes[i]->weight;
+        while (count) {
+            curr_node = stack[--count];
 
-        if (i < SKIP_FIRST_X_NODES)
-            continue;
+            for (uint32_t k = 0 ; k < 2 ; k++) {
+                next_node = k ? curr_node->CLink : curr_node->FLink;
 
-        curr_node = nodes[i];
+                if (next_node && !marks[next_node->index]) {
+                    marks[next_node->index] = 1;
+                    stack[count++] = next_node;
+                }
+            }
+        }
+    }
 
-        /* there execution flow after RET */
-        if (curr_node->type == NODE_RET)
+    free(stack);
+    return marks;
+}
+
+void cgp_ctx_optimize(cgp_ctx *ctx, cgp_optimize_info *info)
+{
+    cgp_optimize_info stats;
+    pNode curr_node, pred;
+    uint8_t *marks;
+
+    memset(&stats, 0, sizeof(stats));
+    cgp_graph_changed(ctx);
+
+    /*
+     *  Bypass every JMP: its predecessors go right to its target, so a
+     *  chain is threaded link by link and a JMP to the next node becomes
+     *  fallthrough. A builder puts JMP back only where target is placed
+     *  somewhere else.
+     */
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        curr_node = ctx->nodes[i];
+
+        if (!curr_node || curr_node->type != NODE_JMP ||
+            !curr_node->FLink || curr_node->FLink == curr_node)
             continue;
 
-        new_node = cgp_allocate_node();
-
-        new_node->offset = offset;
-        new_node->type = NODE_JMP;
-        new_node->weight = 5;
-        new_node->data = (uint8_t*) malloc(new_node->weight);
-        new_node->data[0] = OPCODE_X86_JMP_REL32;
-        new_node->data[1] = 0xCC;
-        new_node->data[2] = 0xCC;
-        new_node->data[3] = 0xCC;
-        new_node->data[4] = 0xCC;
-        new_node->BLink = curr_node->BLink;
-        new_node->FLink = curr_node->FLink;
+        for (pred = curr_node->FPreds ; pred ; pred = pred->FNext)
+            stats.jumps_threaded++;
+
+        for (pred = curr_node->CPreds ; pred ; pred = pred->CNext) {
+            if (pred->type == NODE_JCC) {
+                stats.jcc_retargeted++;
+            } else {
+                stats.jumps_threaded++;
+            }
+        }
+
+        /* JMP may be the last node of a removed chain */
+        for (uint32_t k = 0 ; k < ctx->roots_count ; k++) {
+            if (ctx->roots[k] == curr_node)
+                ctx->roots[k] = curr_node->FLink;
+        }
 
-        memcpy(&buff[offset], &new_node->data[0], new_node->weight);
-        offset += new_node->weight;
+        cgp_except_node(ctx, curr_node);
+        stats.jumps_removed++;
     }
 
-    /* calculate branch address */
-    for (i = 0 ; i < nodes_count ; i++) {
-        if (!nodes[i])
-            continue;
+    marks = cgp_mark_reachable(ctx);
+
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        curr_node = ctx->nodes[i];
+
+        if (curr_node && !marks[i]) {
+            cgp_remove_node(ctx, curr_node);
+            stats.unreachable_removed++;
+        }
+    }
 
-        if (nodes[i]->type != NODE_JMP &&
-            nodes[i]->type != NODE_JCC &&
-            nodes[i]->type != NODE_CALL)
+    free(marks);
+
+    /* BLink of a node may refer to a removed node */
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        curr_node = ctx->nodes[i];
+        if (!curr_node || !curr_node->BLink ||
+            ctx->nodes[curr_node->BLink->index] == curr_node->BLink)
             continue;
 
-        cgp_write_offset(nodes[i], buff);
+        curr_node->BLink = curr_node->FPreds ? curr_node->FPreds
+                                             : curr_node->CPreds;
     }
 
-    *out_buff = buff;
-    return offset;
+    if (info)
+        *info = stats;
 }
 
-void cgp_remove_simple_obfuscation(void)
+cgp_ctx *cgp_ctx_create(void)
 {
-    for (uint32_t i = 0 ; i < nodes_count ; i++) {
-        if (!nodes[i])
-            continue;
+    return (cgp_ctx *) calloc(1, sizeof(cgp_ctx));
+}
 
-        /* CALL -> JMP */
-        if (nodes[i]->type == NODE_CALL &&
-           *(uint32_t*) &nodes[i]->CLink->data[0] == 0x0424648D) {
-            cgp_except_node(nodes[i]->FLink);
-            cgp_except_node(nodes[i]->CLink);
-            cgp_except_node(nodes[i]);
-        }
+void cgp_ctx_destroy(cgp_ctx *ctx)
+{
+    if (!ctx)
+        return;
+
+    cgp_ctx_free(ctx);
+    free(ctx);
+}
+
+void cgp_ctx_set_seed(cgp_ctx *ctx, uint32_t seed)
+{
+    ctx->rand_seed = seed;
+}
+
+void cgp_ctx_set_traversal(cgp_ctx *ctx, uint32_t traversal)
+{
+    if (traversal > CGP_TRAVERSAL_ADDRESS)
+        traversal = CGP_TRAVERSAL_DFS;
+
+    ctx->traversal = traversal;
+}
+
+void cgp_ctx_set_alignment(cgp_ctx *ctx, uint32_t boundary,
+                           uint32_t max_padding, uint32_t targets)
+{
+    /* only powers of two up to a page make sense */
+    if (boundary < 2 || boundary > 0x1000 || (boundary & (boundary - 1)))
+        boundary = 0;
+
+    ctx->align_boundary = boundary;
+    ctx->align_max = max_padding < boundary ? max_padding : boundary - 1;
+    ctx->align_targets = targets;
+}
+
+void cgp_ctx_set_flags(cgp_ctx *ctx, uint32_t flags)
+{
+    ctx->flags = flags;
+}
+
+int cgp_ctx_init(cgp_ctx *ctx, uint8_t *in_buff, uint32_t in_size,
+                 uint32_t entry_point)
+{
+    int result;
+
+    cgp_ctx_free(ctx);
+    cgp_randomize(ctx);
+
+    CGP_STAT_START(parse_start);
+
+    cgp_reset_work(ctx);
+    cgp_reset_index(ctx, in_size);
+    result = cgp_parse(ctx, in_buff, in_size, entry_point);
+
+    /* nodes parsed before the error are dropped, the context is empty */
+    if (result)
+        cgp_ctx_free(ctx);
+
+    CGP_STAT_STOP(ctx->stats.parse_ns, parse_start);
+    return result;
+}
+
+void cgp_ctx_free(cgp_ctx *ctx)
+{
+#ifdef CGP_STATS
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        if (ctx->nodes[i])
+            ctx->stats.nodes_freed++;
+    }
+#endif
+
+    while (ctx->node_slabs) {
+        pNodeSlab next = ctx->node_slabs->next;
+        free(ctx->node_slabs);
+        ctx->node_slabs = next;
+    }
+
+    while (ctx->data_chunks) {
+        pDataChunk next = ctx->data_chunks->next;
+        free(ctx->data_chunks);
+        ctx->data_chunks = next;
     }
+
+    free(ctx->jcc_work.items);
+    free(ctx->call_work.items);
+
+    memset(&ctx->jcc_work, 0, sizeof(Worklist));
+    memset(&ctx->call_work, 0, sizeof(Worklist));
+
+    free(ctx->nodes);
+    free(ctx->layout);
+    free(ctx->layout_align);
+    free(ctx->image);
+    free(ctx->image_offsets);
+
+    free(ctx->inserts);
+
+    ctx->layout = NULL;
+    ctx->layout_align = NULL;
+    ctx->inserts = NULL;
+    ctx->inserts_count = 0;
+    ctx->inserts_size = 0;
+    ctx->image = NULL;
+    ctx->image_offsets = NULL;
+    ctx->image_offsets_size = 0;
+    ctx->image_size = 0;
+    ctx->image_capacity = 0;
+    ctx->image_valid = 0;
+    ctx->layout_count = 0;
+    ctx->layout_size = 0;
+    ctx->layout_cold = 0;
+    memset(&ctx->build_info, 0, sizeof(cgp_build_info));
+
+    ctx->nodes = NULL;
+    ctx->nodes_count = 0;
+    ctx->nodes_size = 0;
+    ctx->first_node = NULL;
+    ctx->graph_version++;
+    free(ctx->offset_index);
+
+    ctx->offset_index = NULL;
+    ctx->offset_index_size = 0;
+    free(ctx->roots);
+
+    ctx->roots = NULL;
+    ctx->roots_count = 0;
+
+    cgp_free_analysis(ctx);
+    cgp_unmap_ir(ctx);
+}
+
+int cgp_init(uint8_t *in_buff, uint32_t in_size, uint32_t entry_point)
+{
+    return cgp_ctx_init(&default_ctx, in_buff, in_size, entry_point);
+}
+
+int cgp_init_entries(uint8_t *in_buff, uint32_t in_size,
+                     const uint32_t *entries, uint32_t entries_count,
+                     uint32_t threads)
+{
+    return cgp_ctx_init_entries(&default_ctx, in_buff, in_size, entries,
+                                entries_count, threads);
+}
+
+int cgp_get_stats(cgp_stats *stats)
+{
+    return cgp_ctx_get_stats(&default_ctx, stats);
+}
+
+void cgp_reset_stats(void)
+{
+    cgp_ctx_reset_stats(&default_ctx);
+}
+
+int cgp_dump_stats(int fd)
+{
+    return cgp_ctx_dump_stats(&default_ctx, fd);
+}
+
+void cgp_set_traversal(uint32_t traversal)
+{
+    cgp_ctx_set_traversal(&default_ctx, traversal);
+}
+
+void cgp_set_alignment(uint32_t boundary, uint32_t max_padding,
+                       uint32_t targets)
+{
+    cgp_ctx_set_alignment(&default_ctx, boundary, max_padding, targets);
+}
+
+void cgp_set_flags(uint32_t flags)
+{
+    cgp_ctx_set_flags(&default_ctx, flags);
 }
 
-void cgp_init(uint8_t *in_buff, uint32_t in_size, uint32_t entry_point)
+int cgp_save_ir(const uint8_t *in_buff, uint32_t in_size,
+                const char *file_name)
 {
-    cgp_randomize();
-    nodes_count = 0;
-    nodes = NULL;
-    cgp_parse(in_buff, in_size, entry_point);
+    return cgp_ctx_save_ir(&default_ctx, in_buff, in_size, file_name);
+}
+
+int cgp_load_ir(uint32_t in_size, uint32_t in_hash, const char *file_name)
+{
+    return cgp_ctx_load_ir(&default_ctx, in_size, in_hash, file_name);
+}
+
+void cgp_optimize(cgp_optimize_info *info)
+{
+    cgp_ctx_optimize(&default_ctx, info);
 }
 
 void cgp_free(void)
 {
-    for (uint32_t i = 0 ; i < nodes_count ; i++) {
-        if (!nodes[i])
-            continue;
+    cgp_ctx_free(&default_ctx);
+}
 
-        free(nodes[i]->data);
-        free(nodes[i]);
-    }
+uint32_t cgp_insert_code(uint32_t node, const uint8_t *code, uint32_t size)
+{
+    return cgp_ctx_insert_code(&default_ctx, node, code, size);
+}
 
-    free(nodes);
+int cgp_replace_code(uint32_t node, const uint8_t *code, uint32_t size)
+{
+    return cgp_ctx_replace_code(&default_ctx, node, code, size);
+}
+
+uint32_t cgp_build_incremental(const uint8_t **out_buff)
+{
+    return cgp_ctx_build_incremental(&default_ctx, out_buff);
+}
+
+int cgp_analyze(cgp_analysis_info *info)
+{
+    return cgp_ctx_analyze(&default_ctx, info);
+}
+
+uint32_t cgp_get_idom(uint32_t node)
+{
+    return cgp_ctx_get_idom(&default_ctx, node);
+}
+
+uint32_t cgp_get_loop(uint32_t node)
+{
+    return cgp_ctx_get_loop(&default_ctx, node);
+}
+
+const cgp_loop *cgp_get_loops(uint32_t *count)
+{
+    return cgp_ctx_get_loops(&default_ctx, count);
+}
+
+int cgp_export(int fd, uint32_t format)
+{
+    return cgp_ctx_export(&default_ctx, fd, format);
+}
+
+void export_to_gdl(const char *file_name)
+{
+    cgp_ctx_export_to_gdl(&default_ctx, file_name);
+}
+
+void cgp_remove_simple_obfuscation(void)
+{
+    cgp_ctx_remove_simple_obfuscation(&default_ctx);
+}
+
+uint32_t cgp_build(uint8_t **out_buff)
+{
+    return cgp_ctx_build(&default_ctx, out_buff);
+}
+
+uint32_t cgp_build_reduntant_nop(uint8_t **out_buff)
+{
+    return cgp_ctx_build_reduntant_nop(&default_ctx, out_buff);
+}
+
+uint32_t cgp_build_spaghetti(uint8_t **out_buff)
+{
+    return cgp_ctx_build_spaghetti(&default_ctx, out_buff);
+}
+
+uint32_t cgp_build_instrumented(uint32_t counters_address,
+                                const char *map_file, uint8_t **out_buff)
+{
+    return cgp_ctx_build_instrumented(&default_ctx, counters_address,
+                                      map_file, out_buff);
+}
+
+uint32_t cgp_build_layout(const cgp_profile *profile, uint8_t **out_buff)
+{
+    return cgp_ctx_build_layout(&default_ctx, profile, out_buff);
+}
+
+void cgp_coalesce_blocks(void)
+{
+    cgp_ctx_coalesce_blocks(&default_ctx);
+}
+
+void cgp_get_build_info(cgp_build_info *info)
+{
+    cgp_ctx_get_build_info(&default_ctx, info);
 }
@@ -5,14 +5,398 @@
 extern "C" {
 #endif
 
-/** Parse input code to intermediate representation.
+/** Opaque CGP session.
+ *
+ *  Every context owns its own IR, so different contexts may be used from
+ *  different threads at the same time. The functions without a context
+ *  argument operate on a single default context.
+ */
+typedef struct cgp_ctx cgp_ctx;
+
+/* flags of cgp_ctx_set_flags(...) */
+#define CGP_ZERO_COPY       0x00000001  /* unchanged nodes point to input */
+
+/* targets of cgp_ctx_set_alignment(...) */
+#define CGP_ALIGN_LOOPS     0x00000001  /* targets of backward branches */
+#define CGP_ALIGN_BRANCHES  0x00000002  /* hot targets not reached by fall */
+
+/* orders of pending branches of cgp_ctx_set_traversal(...) */
+#define CGP_TRAVERSAL_DFS       0   /* last found branch first, default */
+#define CGP_TRAVERSAL_BFS       1   /* first found branch first */
+#define CGP_TRAVERSAL_ADDRESS   2   /* lowest target offset first */
+
+/* formats of cgp_export(...) */
+enum cgp_export_formats {
+    CGP_EXPORT_GDL,
+    CGP_EXPORT_DOT,
+    CGP_EXPORT_JSONL            /* a JSON object per node and per edge */
+};
+
+/** Summary of the last build of a context. */
+typedef struct cgp_build_info {
+    uint32_t size;              /* size of output code */
+    uint32_t nodes;             /* nodes laid out to output */
+    uint32_t relaxed_branches;  /* JMP/JCC emitted in rel8 form */
+    uint32_t relaxed_bytes;     /* bytes saved against all rel32 forms */
+    uint32_t cold_offset;       /* never executed code of cgp_build_layout */
+    uint32_t counters;          /* counters of cgp_build_instrumented */
+    uint32_t aligned;           /* nodes moved to alignment boundary */
+    uint32_t padding;           /* bytes of NOP inserted before them */
+    uint32_t patched;           /* branches rewritten by incremental build */
+    uint32_t shifted;           /* bytes moved by incremental build */
+} cgp_build_info;
+
+/** Counters of a context since cgp_reset_stats(), see CGP_STATS. */
+typedef struct cgp_stats {
+    uint64_t nodes_allocated;   /* nodes added to the nodes table */
+    uint64_t nodes_freed;       /* nodes removed or released by free */
+    uint64_t find_probes;       /* lookups of offset -> node index */
+    uint64_t lde_calls;         /* instructions decoded by LDE */
+    uint64_t bytes_emitted;     /* bytes written to output code */
+    uint64_t branches_patched;  /* rel8/rel32 fixed by cgp_write_offset */
+    uint64_t parse_ns;          /* parse of input code */
+    uint64_t layout_ns;         /* ordering, alignment and relaxation */
+    uint64_t emit_ns;           /* copy of instructions and index rebuild */
+    uint64_t patch_ns;          /* branch offsets of output code */
+} cgp_stats;
+
+/** Counts of cgp_optimize(...). */
+typedef struct cgp_optimize_info {
+    uint32_t jumps_threaded;        /* edges moved from JMP to its target */
+    uint32_t jcc_retargeted;        /* JCC moved past a trampoline JMP */
+    uint32_t jumps_removed;         /* JMP which are bypassed */
+    uint32_t unreachable_removed;   /* nodes unreachable from entry points */
+} cgp_optimize_info;
+
+/** Counts of cgp_analyze(...). */
+typedef struct cgp_analysis_info {
+    uint32_t reachable;         /* nodes reachable from entry points */
+    uint32_t loops;             /* natural loops */
+    uint32_t max_depth;         /* deepest nesting of loops, 1 is outermost */
+    uint32_t irreducible;       /* retreating edges to not a dominator */
+    uint32_t passes;            /* sweeps of dominator fixpoint */
+} cgp_analysis_info;
+
+/** Natural loop of cgp_get_loops(...). */
+typedef struct cgp_loop {
+    uint32_t header;            /* node number of the header */
+    uint32_t parent;            /* enclosing loop or 0xFFFFFFFF */
+    uint32_t depth;             /* 1 for outermost loop */
+    uint32_t nodes;             /* nodes of the body with nested loops */
+} cgp_loop;
+
+/** Execution count of an instruction of input code. */
+typedef struct cgp_profile_node {
+    uint32_t offset;            /* offset in input code */
+    uint32_t count;             /* times it was executed */
+} cgp_profile_node;
+
+/** Count of transfers between two instructions of input code. */
+typedef struct cgp_profile_edge {
+    uint32_t from;              /* offset of source in input code */
+    uint32_t to;                /* offset of target in input code */
+    uint32_t count;             /* times it was taken */
+} cgp_profile_edge;
+
+/** Execution profile for cgp_build_layout(...), any part may be empty. */
+typedef struct cgp_profile {
+    uint32_t nodes_count;
+    const cgp_profile_node *nodes;
+    uint32_t edges_count;
+    const cgp_profile_edge *edges;
+} cgp_profile;
+
+/** Allocate an empty context.
  *
+ *  @return new context or NULL on allocation failure
+ */
+cgp_ctx *cgp_ctx_create(void);
+
+/** Free the IR of a context and the context itself.
+ *
+ *  @param ctx Context from cgp_ctx_create(...)
+ *  @return void
+ */
+void cgp_ctx_destroy(cgp_ctx *ctx);
+
+/** Parse input code to intermediate representation of a context.
+ *
+ *  Seeds the context random generator, see cgp_ctx_set_seed(...). On
+ *  error the context is left empty.
+ *
+ *  @param ctx Context from cgp_ctx_create(...)
  *  @param in_buff An input buffer which must contains x86 code
  *  @param in_size The length of the input code
  *  @param entry_point Entry point of code
+ *  @return 0 on success, -1 on invalid instruction, CALL out of code or
+ *          out of memory
+ */
+int cgp_ctx_init(cgp_ctx *ctx, uint8_t *in_buff, uint32_t in_size,
+                 uint32_t entry_point);
+
+/** Same as cgp_init_entries(...) for given context. */
+int cgp_ctx_init_entries(cgp_ctx *ctx, uint8_t *in_buff, uint32_t in_size,
+                         const uint32_t *entries, uint32_t entries_count,
+                         uint32_t threads);
+
+/** Set flags of a context, they are kept by cgp_ctx_free(...).
+ *
+ *  With CGP_ZERO_COPY plain instructions and RET reference input buffer
+ *  instead of own copy, so input must be alive and unchanged until
+ *  cgp_ctx_free(...). Branches are still copied, they are rewritten. Input
+ *  may be a read-only mapping of a file.
+ *
+ *  @param ctx Context
+ *  @param flags CGP_* flags
+ *  @return void
+ */
+void cgp_ctx_set_flags(cgp_ctx *ctx, uint32_t flags);
+
+/** Align branch targets of next builds of a context, kept like flags.
+ *
+ *  Loop headers and branch targets are moved to a boundary by multi-byte
+ *  NOP forms of 0F 1F, runs are split by 9 bytes. A target is aligned only
+ *  if it costs at most max_padding bytes, code after cold_offset of
+ *  cgp_build_layout(...) is never aligned. Branch displacements are
+ *  computed after padding, so a rel8 branch which doesn't fit anymore
+ *  becomes rel32. LOOP and JECXZ have no rel32 form, padding between them
+ *  and their targets is dropped instead. Cost is reported by aligned and
+ *  padding of build info.
+ *
+ *  @param ctx Context
+ *  @param boundary Power of two up to 4096, 0 disables alignment
+ *  @param max_padding Most of NOP bytes before one target
+ *  @param targets CGP_ALIGN_* flags
+ *  @return void
+ */
+void cgp_ctx_set_alignment(cgp_ctx *ctx, uint32_t boundary,
+                           uint32_t max_padding, uint32_t targets);
+
+/** Select order in which pending branches are followed, kept like flags.
+ *
+ *  Both parse of cgp_ctx_init(...) and lay out of cgp_ctx_build(...) keep
+ *  JCC and CALL targets which aren't visited yet in growable worklists, so
+ *  count of pending branches isn't limited. CGP_TRAVERSAL_ADDRESS decodes
+ *  input mostly sequentially and lays code out close to the input order.
+ *  Graph is the same for any order, only node numbers and layout differ.
+ *
+ *  @param ctx Context
+ *  @param traversal CGP_TRAVERSAL_* value, unknown values select DFS
+ *  @return void
+ */
+void cgp_ctx_set_traversal(cgp_ctx *ctx, uint32_t traversal);
+
+/** Same as cgp_save_ir(...) for given context. */
+int cgp_ctx_save_ir(cgp_ctx *ctx, const uint8_t *in_buff, uint32_t in_size,
+                    const char *file_name);
+
+/** Same as cgp_load_ir(...) for given context. */
+int cgp_ctx_load_ir(cgp_ctx *ctx, uint32_t in_size, uint32_t in_hash,
+                    const char *file_name);
+
+/** Set random seed used by cgp_ctx_build_spaghetti(...).
+ *
+ *  Call it after cgp_ctx_init(...) to get reproducible output.
+ *
+ *  @param ctx Context
+ *  @param seed Seed value
  *  @return void
  */
-void cgp_init(uint8_t *in_buff, uint32_t in_size, uint32_t entry_point);
+void cgp_ctx_set_seed(cgp_ctx *ctx, uint32_t seed);
+
+/** Free IR of a context, the context can be initialized again.
+ *
+ *  @param ctx Context
+ *  @return void
+ */
+void cgp_ctx_free(cgp_ctx *ctx);
+
+/** Same as cgp_export(...) for given context. */
+int cgp_ctx_export(cgp_ctx *ctx, int fd, uint32_t format);
+
+/** Same as export_to_gdl(...) for given context. */
+void cgp_ctx_export_to_gdl(cgp_ctx *ctx, const char *file_name);
+
+/** Same as cgp_remove_simple_obfuscation(...) for given context. */
+void cgp_ctx_remove_simple_obfuscation(cgp_ctx *ctx);
+
+/** Same as cgp_optimize(...) for given context. */
+void cgp_ctx_optimize(cgp_ctx *ctx, cgp_optimize_info *info);
+
+/** Same as cgp_analyze(...) for given context. */
+int cgp_ctx_analyze(cgp_ctx *ctx, cgp_analysis_info *info);
+
+/** Same as cgp_get_idom(...) for given context. */
+uint32_t cgp_ctx_get_idom(cgp_ctx *ctx, uint32_t node);
+
+/** Same as cgp_get_loop(...) for given context. */
+uint32_t cgp_ctx_get_loop(cgp_ctx *ctx, uint32_t node);
+
+/** Same as cgp_get_loops(...) for given context. */
+const cgp_loop *cgp_ctx_get_loops(cgp_ctx *ctx, uint32_t *count);
+
+/** Same as cgp_coalesce_blocks(...) for given context. */
+void cgp_ctx_coalesce_blocks(cgp_ctx *ctx);
+
+/** Same as cgp_build(...) for given context. */
+uint32_t cgp_ctx_build(cgp_ctx *ctx, uint8_t **out_buff);
+
+/** Same as cgp_build_reduntant_nop(...) for given context. */
+uint32_t cgp_ctx_build_reduntant_nop(cgp_ctx *ctx, uint8_t **out_buff);
+
+/** Same as cgp_build_instrumented(...) for given context. */
+uint32_t cgp_ctx_build_instrumented(cgp_ctx *ctx, uint32_t counters_address,
+                                    const char *map_file, uint8_t **out_buff);
+
+/** Same as cgp_insert_code(...) for given context. */
+uint32_t cgp_ctx_insert_code(cgp_ctx *ctx, uint32_t node, const uint8_t *code,
+                             uint32_t size);
+
+/** Same as cgp_replace_code(...) for given context. */
+int cgp_ctx_replace_code(cgp_ctx *ctx, uint32_t node, const uint8_t *code,
+                         uint32_t size);
+
+/** Same as cgp_build_incremental(...) for given context. */
+uint32_t cgp_ctx_build_incremental(cgp_ctx *ctx, const uint8_t **out_buff);
+
+/** Same as cgp_build_spaghetti(...) for given context. */
+uint32_t cgp_ctx_build_spaghetti(cgp_ctx *ctx, uint8_t **out_buff);
+
+/** Same as cgp_build_layout(...) for given context. */
+uint32_t cgp_ctx_build_layout(cgp_ctx *ctx, const cgp_profile *profile,
+                              uint8_t **out_buff);
+
+/** Same as cgp_get_build_info(...) for given context. */
+void cgp_ctx_get_build_info(cgp_ctx *ctx, cgp_build_info *info);
+
+/** Same as cgp_get_stats(...) for given context. */
+int cgp_ctx_get_stats(cgp_ctx *ctx, cgp_stats *stats);
+
+/** Same as cgp_reset_stats(...) for given context. */
+void cgp_ctx_reset_stats(cgp_ctx *ctx);
+
+/** Same as cgp_dump_stats(...) for given context. */
+int cgp_ctx_dump_stats(cgp_ctx *ctx, int fd);
+
+/** Parse input code to intermediate representation.
+ *
+ *  An error is printed and IR is left empty, the caller decides whether
+ *  to go on.
+ *
+ *  @param in_buff An input buffer which must contains x86 code
+ *  @param in_size The length of the input code
+ *  @param entry_point Entry point of code
+ *  @return 0 on success, -1 on invalid instruction, CALL out of code or
+ *          out of memory
+ */
+int cgp_init(uint8_t *in_buff, uint32_t in_size, uint32_t entry_point);
+
+/** Hash of input code, as kept by cgp_save_ir(...).
+ *
+ *  @param in_buff An input buffer which must contains x86 code
+ *  @param in_size The length of the input code
+ *  @return hash for cgp_load_ir(...)
+ */
+uint32_t cgp_hash_input(const uint8_t *in_buff, uint32_t in_size);
+
+/** Save IR to a file to skip parsing of the same code next time.
+ *
+ *  The file is versioned and has no pointers: a table of nodes, a table of
+ *  their edges as node numbers and a pool of instruction bytes. Size and
+ *  hash of the input code are kept in its header.
+ *
+ *  @param in_buff Input code the IR was made from or NULL
+ *  @param in_size The length of the input code
+ *  @param file_name Name of the file
+ *  @return 0 on success, -1 if the file can't be written
+ */
+int cgp_save_ir(const uint8_t *in_buff, uint32_t in_size,
+                const char *file_name);
+
+/** Load IR of cgp_save_ir(...) instead of cgp_init(...).
+ *
+ *  The file is mapped, instruction bytes of nodes point to the mapping
+ *  until cgp_free(...), instruction records come from the file too, so
+ *  nothing is decoded or hashed. A file of wrong size, of other version,
+ *  with a size, offset, link or record out of range, with links which
+ *  parse doesn't make, e.g. JCC without a target, or made from code of
+ *  other size or hash is refused and the current IR is kept, so the
+ *  caller can parse the code again.
+ *
+ *  @param in_size The length of the input code, 0 skips the check
+ *  @param in_hash cgp_hash_input(...) of the input code, kept by the
+ *                 caller, 0 skips the check
+ *  @param file_name Name of the file
+ *  @return 0 on success, -1 if the file is missing or stale
+ */
+int cgp_load_ir(uint32_t in_size, uint32_t in_hash, const char *file_name);
+
+/** Insert code after a node, on its fallthrough path.
+ *
+ *  The node must be plain code, CALL or JCC, code must be whole
+ *  instructions without branches. If there is a layout of a build, the new
+ *  node is put right after the node, so cgp_build_incremental(...) can
+ *  emit it without new layout.
+ *
+ *  @param node Node number, as "n12" of export
+ *  @param code Instruction bytes, they are copied
+ *  @param size Length of code
+ *  @return Number of the new node or 0xFFFFFFFF on error
+ */
+uint32_t cgp_insert_code(uint32_t node, const uint8_t *code, uint32_t size);
+
+/** Replace code of a plain code node, the size may change.
+ *
+ *  @param node Node number, as "n12" of export
+ *  @param code Instruction bytes without branches, they are copied
+ *  @param size Length of code
+ *  @return 0 on success, -1 on error
+ */
+int cgp_replace_code(uint32_t node, const uint8_t *code, uint32_t size);
+
+/** Emit code again after cgp_insert_code(...) and cgp_replace_code(...).
+ *
+ *  The first call writes the layout of the last build (or makes one by
+ *  cgp_build(...)) to an image owned by CGP. Next calls keep the layout:
+ *  changed nodes are written in place, code after them is shifted only
+ *  where their size changed and alignment padding can't absorb it, and
+ *  only branches whose displacement changed are patched. A rel8 branch
+ *  which gets out of range becomes rel32, branches are never shrunk, so
+ *  output may be a bit larger than of a full build. Any other build or
+ *  a pass which changes the graph starts from scratch again.
+ *
+ *  @param out_buff Receives the image, valid until next build or cgp_free()
+ *  @return Size of the image
+ */
+uint32_t cgp_build_incremental(const uint8_t **out_buff);
+
+/** Same as cgp_ctx_set_alignment(...) for default context. */
+void cgp_set_alignment(uint32_t boundary, uint32_t max_padding,
+                       uint32_t targets);
+
+/** Same as cgp_ctx_set_flags(...) for default context. */
+void cgp_set_flags(uint32_t flags);
+
+/** Same as cgp_ctx_set_traversal(...) for default context. */
+void cgp_set_traversal(uint32_t traversal);
+
+/** Parse code reachable from several entry points on several threads.
+ *
+ *  Threads sweep code from their own queues of branch targets and steal
+ *  targets of each other, every offset is decoded only once. The result is
+ *  the same graph which cgp_init(...) makes, nodes are ordered by address
+ *  and the first entry point becomes the first node.
+ *
+ *  @param in_buff An input buffer which must contains x86 code
+ *  @param in_size The length of the input code
+ *  @param entries Offsets of entry points, e.g. exported functions
+ *  @param entries_count Count of entry points
+ *  @param threads Count of threads, 0 means count of online CPUs
+ *  @return 0 on success, -1 on invalid instruction, IR is empty then
+ */
+int cgp_init_entries(uint8_t *in_buff, uint32_t in_size,
+                     const uint32_t *entries, uint32_t entries_count,
+                     uint32_t threads);
 
 /** Free internal resources of CGP.
  *
@@ -27,6 +411,56 @@ void cgp_free(void);
  */
 void export_to_gdl(const char *file_name);
 
+/** Write graph to a file descriptor.
+ *
+ *  Output goes through one large buffer. Nodes are named by their
+ *  position in the nodes table ("n12"), so names are the same from run to
+ *  run. JCC and CALL without CLink are counted and skipped. After
+ *  cgp_analyze(...) nodes carry their immediate dominator and innermost
+ *  loop, loop headers are highlighted.
+ *
+ *  @param fd Descriptor opened for writing, it isn't closed
+ *  @param format CGP_EXPORT_GDL, CGP_EXPORT_DOT or CGP_EXPORT_JSONL
+ *  @return 0 on success, -1 on write error or unknown format
+ */
+int cgp_export(int fd, uint32_t format);
+
+/** Find dominators and natural loops of the graph.
+ *
+ *  Every entry point hangs off one virtual root, so code reachable from
+ *  several entry points has one dominator tree. CALL is an edge to its
+ *  target like a branch. Time is linear in nodes for reducible code, loops
+ *  of irreducible code are not found, their retreating edges are counted.
+ *  Results are kept until a node is added, removed or bypassed, by a build,
+ *  cgp_insert_code(...) or cgp_optimize(...), then export and getters
+ *  below ignore them.
+ *
+ *  @param info Receives counts, may be NULL
+ *  @return 0 on success, -1 if there is no graph
+ */
+int cgp_analyze(cgp_analysis_info *info);
+
+/** Immediate dominator of a node after cgp_analyze(...).
+ *
+ *  @param node Node number, as "n12" of export
+ *  @return Node number, 0xFFFFFFFF for entry points and unreachable nodes
+ */
+uint32_t cgp_get_idom(uint32_t node);
+
+/** Innermost loop of a node after cgp_analyze(...).
+ *
+ *  @param node Node number, as "n12" of export
+ *  @return Loop index of cgp_get_loops(...) or 0xFFFFFFFF
+ */
+uint32_t cgp_get_loop(uint32_t node);
+
+/** Loops of cgp_analyze(...), nested loops go before enclosing ones.
+ *
+ *  @param count Receives count of loops
+ *  @return Array owned by CGP, NULL if the graph changed since analysis
+ */
+const cgp_loop *cgp_get_loops(uint32_t *count);
+
 /** @brief Remove simple obfuscation of input code.
  *
  *  Remove simple obfuscation of input code, to get finished binary you must
@@ -37,10 +471,42 @@ void export_to_gdl(const char *file_name);
  */
 void cgp_remove_simple_obfuscation(void);
 
+/** Thread jumps and remove dead code.
+ *
+ *  Every JMP node is bypassed: nodes which go to it, including JCC which
+ *  use it as a trampoline, go right to its target, so chains of JMP
+ *  disappear and a JMP to the next instruction becomes fallthrough. Then
+ *  nodes unreachable from the entry point (or entry points of
+ *  cgp_init_entries(...)) are removed. Useful after
+ *  cgp_remove_simple_obfuscation(...) or a build which left JMP nodes,
+ *  like cgp_build_spaghetti(...).
+ *
+ *  @param info Receives counts of changes, may be NULL
+ *  @return void
+ */
+void cgp_optimize(cgp_optimize_info *info);
+
+/** Switch IR to basic blocks.
+ *
+ *  Coalesce every run of linear instructions, which is entered only from
+ *  its first instruction, into one node with contiguous code. Graph
+ *  operations, builders and export_to_gdl(...) work on blocks after that.
+ *  Use cgp_remove_simple_obfuscation(...) before it, the obfuscation
+ *  patterns are matched per instruction.
+ *
+ *  @return void
+ */
+void cgp_coalesce_blocks(void);
+
 /** Build code from intermediate representation.
  *
- *  @param out_buff The pointer to output code.
- *  @return size of buffer
+ *  Every build relaxes JMP/JCC to the shortest encoding which reaches its
+ *  target, see cgp_get_build_info(...). A build fails if LOOP or JECXZ
+ *  is laid out too far from its target, or out of memory. Every build
+ *  gives 0 and NULL when IR is empty, e.g. after cgp_init(...) failed.
+ *
+ *  @param out_buff The pointer to output code, NULL if build failed
+ *  @return size of buffer, 0 if build failed
  */
 uint32_t cgp_build(uint8_t **out_buff);
 
@@ -51,6 +517,27 @@ uint32_t cgp_build(uint8_t **out_buff);
  */
 uint32_t cgp_build_reduntant_nop(uint8_t **out_buff);
 
+/** Build code which counts executions of every basic block.
+ *
+ *  Every node which starts a basic block gets <inc dword [counter]> in
+ *  front of it, wrapped in pushfd/popfd only where flags may be live, so
+ *  a block costs one 6 byte instruction in most cases. Counters are 32 bit
+ *  and go one after another from counters_address, their number is in
+ *  build info counters. The IR keeps the counters after build.
+ *
+ *  The map file has a line <counter offset> for every instruction of input
+ *  code, instructions of one block share a counter, so it converts counters
+ *  to cgp_profile_node entries for cgp_build_layout(...).
+ *
+ *  @param counters_address Address of counter area in the instrumented
+ *                          process, zeroed by the caller
+ *  @param map_file Name of the map file, may be NULL
+ *  @param out_buff The pointer to output code.
+ *  @return size of buffer
+ */
+uint32_t cgp_build_instrumented(uint32_t counters_address,
+                                const char *map_file, uint8_t **out_buff);
+
 /** Build shuffled code linked with JMP instructions.
  *
  *  @param out_buff The pointer to output code.
@@ -58,6 +545,52 @@ uint32_t cgp_build_reduntant_nop(uint8_t **out_buff);
  */
 uint32_t cgp_build_spaghetti(uint8_t **out_buff);
 
+/** Build code laid out by execution profile.
+ *
+ *  Hottest fallthrough edges are chained together (Pettis-Hansen), JCC are
+ *  inverted when their taken side follows them, chains go from hottest to
+ *  coldest and never executed code is placed from build info cold_offset
+ *  to the end. Edge counts are used where given, otherwise edge weight is
+ *  the smaller count of its two instructions.
+ *
+ *  @param profile Counts keyed by offsets of input code, NULL lays out
+ *                 everything as cold
+ *  @param out_buff The pointer to output code.
+ *  @return size of buffer
+ */
+uint32_t cgp_build_layout(const cgp_profile *profile, uint8_t **out_buff);
+
+/** Get summary of the last cgp_build* call.
+ *
+ *  @param info Receives output size and branch relaxation savings
+ *  @return void
+ */
+void cgp_get_build_info(cgp_build_info *info);
+
+/** Get counters and phase times accumulated since the last reset.
+ *
+ *  Counting is compiled in only with CGP_STATS defined (make STATS=1),
+ *  otherwise it costs nothing and the counters stay zero. Counters are
+ *  kept across cgp_init and cgp_free.
+ *
+ *  @param stats Receives the counters
+ *  @return 0 on success, -1 if compiled without CGP_STATS
+ */
+int cgp_get_stats(cgp_stats *stats);
+
+/** Set all counters of cgp_get_stats(...) to zero.
+ *
+ *  @return void
+ */
+void cgp_reset_stats(void);
+
+/** Write counters of cgp_get_stats(...) as one line of JSON object.
+ *
+ *  @param fd File descriptor to write to
+ *  @return 0 on success, -1 on write error or without CGP_STATS
+ */
+int cgp_dump_stats(int fd);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
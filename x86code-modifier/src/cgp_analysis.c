@@ -0,0 +1,504 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "cgp.h"
+#include "cgp_internal.h"
+
+/*
+ *  Everything below works on reverse postorder numbers of reachable nodes,
+ *  number 0 is a virtual root which has an edge to every entry point, so
+ *  several entry points have one dominator tree.
+ *
+ *  Dominators are found by the iterative algorithm of Cooper, Harvey and
+ *  Kennedy, which passes reducible graphs in two or three sweeps. Loops are
+ *  found from the bottom of the dominator tree up: edges to a dominator are
+ *  back edges, their header collects its body by a backward walk, a nested
+ *  loop met on the walk is entered by its header only.
+ */
+
+typedef struct dom_graph {
+    uint32_t count;         /* reachable nodes plus the virtual root */
+    uint32_t *numbers;      /* reverse postorder number by node index */
+    pNode *nodes;           /* node by number */
+
+    uint32_t *preds_start;  /* predecessors of number n are */
+    uint32_t *preds;        /* preds[preds_start[n] .. preds_start[n + 1]) */
+
+    uint32_t *idoms;        /* by number */
+    uint32_t *enter, *leave;/* interval of number in dominator tree */
+} DomGraph;
+
+static pNode dom_successor(pNode in_node, uint32_t k)
+{
+    return k ? in_node->CLink : in_node->FLink;
+}
+
+static int dom_is_alive(cgp_ctx *ctx, pNode in_node)
+{
+    return in_node && ctx->nodes[in_node->index] == in_node;
+}
+
+/* depth first walk from entry points, numbers nodes in reverse postorder */
+static void dom_number(cgp_ctx *ctx, DomGraph *graph)
+{
+    pNode *stack, curr_node, next_node;
+    uint8_t *state;
+    uint32_t count = 0, post = 0;
+
+    graph->numbers = (uint32_t*) malloc(sizeof(uint32_t) *
+                                        (ctx->nodes_count + 1));
+    graph->nodes = (pNode*) malloc(sizeof(pNode) * (ctx->nodes_count + 1));
+    stack = (pNode*) malloc(sizeof(pNode) * (ctx->nodes_count + 1));
+
+    /* 0 not seen, 1 FLink next, 2 CLink next, 3 done */
+    state = (uint8_t*) calloc(ctx->nodes_count + 1, 1);
+
+    for (uint32_t i = 0 ; i <= ctx->roots_count ; i++) {
+        curr_node = i < ctx->roots_count ? ctx->roots[i] : ctx->first_node;
+
+        if (!dom_is_alive(ctx, curr_node) || state[curr_node->index])
+            continue;
+
+        state[curr_node->index] = 1;
+        stack[count++] = curr_node;
+
+        while (count) {
+            curr_node = stack[count - 1];
+
+            if (state[curr_node->index] == 3) {
+                graph->nodes[post++] = curr_node;
+                count--;
+                continue;
+            }
+
+            next_node = dom_successor(curr_node, state[curr_node->index] - 1);
+            state[curr_node->index]++;
+
+            if (next_node && !state[next_node->index]) {
+                state[next_node->index] = 1;
+                stack[count++] = next_node;
+            }
+        }
+    }
+
+    /* postorder is collected from 0, turn it to reverse order after root */
+    graph->count = post + 1;
+
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++)
+        graph->numbers[i] = INVALID_VALUE;
+
+    for (uint32_t i = 0 ; i < post / 2 ; i++) {
+        curr_node = graph->nodes[i];
+        graph->nodes[i] = graph->nodes[post - 1 - i];
+        graph->nodes[post - 1 - i] = curr_node;
+    }
+
+    memmove(&graph->nodes[1], &graph->nodes[0], sizeof(pNode) * post);
+    graph->nodes[0] = NULL;
+
+    for (uint32_t n = 1 ; n < graph->count ; n++)
+        graph->numbers[graph->nodes[n]->index] = n;
+
+    free(state);
+    free(stack);
+}
+
+/* compact predecessor lists by number, unreachable sources are dropped */
+static void dom_collect_preds(cgp_ctx *ctx, DomGraph *graph)
+{
+    uint32_t *fill, target;
+    uint8_t *is_root;
+    pNode next_node, root;
+
+    graph->preds_start = (uint32_t*) calloc(graph->count + 1,
+                                            sizeof(uint32_t));
+    is_root = (uint8_t*) calloc(graph->count, 1);
+
+    for (uint32_t i = 0 ; i <= ctx->roots_count ; i++) {
+        root = i < ctx->roots_count ? ctx->roots[i] : ctx->first_node;
+
+        if (dom_is_alive(ctx, root))
+            is_root[graph->numbers[root->index]] = 1;
+    }
+
+    for (uint32_t n = 1 ; n < graph->count ; n++) {
+        for (uint32_t k = 0 ; k < 2 ; k++) {
+            next_node = dom_successor(graph->nodes[n], k);
+            if (next_node)
+                graph->preds_start[graph->numbers[next_node->index] + 1]++;
+        }
+    }
+
+    /* edges of the virtual root */
+    for (uint32_t n = 1 ; n < graph->count ; n++)
+        graph->preds_start[n + 1] += is_root[n];
+
+    for (uint32_t n = 0 ; n < graph->count ; n++)
+        graph->preds_start[n + 1] += graph->preds_start[n];
+
+    graph->preds = (uint32_t*) malloc(sizeof(uint32_t) *
+                                      (graph->preds_start[graph->count] + 1));
+    fill = (uint32_t*) malloc(sizeof(uint32_t) * (graph->count + 1));
+    memcpy(fill, graph->preds_start, sizeof(uint32_t) * graph->count);
+
+    for (uint32_t n = 1 ; n < graph->count ; n++) {
+        if (is_root[n])
+            graph->preds[fill[n]++] = 0;
+
+        for (uint32_t k = 0 ; k < 2 ; k++) {
+            next_node = dom_successor(graph->nodes[n], k);
+            if (!next_node)
+                continue;
+
+            target = graph->numbers[next_node->index];
+            graph->preds[fill[target]++] = n;
+        }
+    }
+
+    free(fill);
+    free(is_root);
+}
+
+static uint32_t dom_intersect(uint32_t *idoms, uint32_t a, uint32_t b)
+{
+    while (a != b) {
+        while (a > b)
+            a = idoms[a];
+
+        while (b > a)
+            b = idoms[b];
+    }
+
+    return a;
+}
+
+static uint32_t dom_compute(DomGraph *graph)
+{
+    uint32_t changed, new_idom, pred, passes = 0;
+
+    graph->idoms = (uint32_t*) malloc(sizeof(uint32_t) * graph->count);
+
+    graph->idoms[0] = 0;
+    for (uint32_t n = 1 ; n < graph->count ; n++)
+        graph->idoms[n] = INVALID_VALUE;
+
+    do {
+        changed = 0;
+        passes++;
+
+        for (uint32_t n = 1 ; n < graph->count ; n++) {
+            new_idom = INVALID_VALUE;
+
+            for (uint32_t p = graph->preds_start[n] ;
+                 p < graph->preds_start[n + 1] ; p++) {
+                pred = graph->preds[p];
+
+                if (graph->idoms[pred] == INVALID_VALUE)
+                    continue;
+
+                new_idom = new_idom == INVALID_VALUE ? pred :
+                           dom_intersect(graph->idoms, pred, new_idom);
+            }
+
+            if (graph->idoms[n] != new_idom) {
+                graph->idoms[n] = new_idom;
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    return passes;
+}
+
+/* enter/leave times of dominator tree walk, for dominance in O(1) */
+static void dom_number_tree(DomGraph *graph)
+{
+    uint32_t *start, *children, *fill, *stack, *next;
+    uint32_t count = 0, time = 0, n;
+
+    start = (uint32_t*) calloc(graph->count + 1, sizeof(uint32_t));
+    children = (uint32_t*) malloc(sizeof(uint32_t) * graph->count);
+    fill = (uint32_t*) malloc(sizeof(uint32_t) * (graph->count + 1));
+
+    for (n = 1 ; n < graph->count ; n++)
+        start[graph->idoms[n] + 1]++;
+
+    for (n = 0 ; n < graph->count ; n++)
+        start[n + 1] += start[n];
+
+    memcpy(fill, start, sizeof(uint32_t) * graph->count);
+
+    for (n = 1 ; n < graph->count ; n++)
+        children[fill[graph->idoms[n]]++] = n;
+
+    graph->enter = (uint32_t*) malloc(sizeof(uint32_t) * graph->count);
+    graph->leave = (uint32_t*) malloc(sizeof(uint32_t) * graph->count);
+
+    /* fill is reused as the next child to visit */
+    stack = (uint32_t*) malloc(sizeof(uint32_t) * graph->count);
+    next = fill;
+    memcpy(next, start, sizeof(uint32_t) * graph->count);
+
+    stack[count++] = 0;
+    graph->enter[0] = time++;
+
+    while (count) {
+        n = stack[count - 1];
+
+        if (next[n] == start[n + 1]) {
+            graph->leave[n] = time++;
+            count--;
+            continue;
+        }
+
+        n = children[next[n]++];
+        graph->enter[n] = time++;
+        stack[count++] = n;
+    }
+
+    free(stack);
+    free(fill);
+    free(children);
+    free(start);
+}
+
+static int dom_dominates(DomGraph *graph, uint32_t a, uint32_t b)
+{
+    return graph->enter[a] <= graph->enter[b] &&
+           graph->leave[b] <= graph->leave[a];
+}
+
+/* outermost loop found so far which contains the loop */
+static uint32_t loop_find_top(uint32_t *tops, uint32_t loop)
+{
+    while (tops[loop] != loop) {
+        tops[loop] = tops[tops[loop]];
+        loop = tops[loop];
+    }
+
+    return loop;
+}
+
+static void loop_add(cgp_ctx *ctx, uint32_t header)
+{
+    if (ctx->loops_count == ctx->loops_size) {
+        ctx->loops_size = ctx->loops_size ? ctx->loops_size * 2 : 0x40;
+        ctx->loops = (cgp_loop*) realloc(ctx->loops,
+                                         sizeof(cgp_loop) * ctx->loops_size);
+    }
+
+    ctx->loops[ctx->loops_count].header = header;
+    ctx->loops[ctx->loops_count].parent = INVALID_VALUE;
+    ctx->loops[ctx->loops_count].depth = 0;
+    ctx->loops[ctx->loops_count].nodes = 0;
+    ctx->loops_count++;
+}
+
+static void loop_find(cgp_ctx *ctx, DomGraph *graph, cgp_analysis_info *info)
+{
+    uint32_t *loop_of, *tops, *stack, count, pred, n, loop, top;
+
+    loop_of = (uint32_t*) malloc(sizeof(uint32_t) * graph->count);
+    for (n = 0 ; n < graph->count ; n++)
+        loop_of[n] = INVALID_VALUE;
+
+    /* a node is pushed once for its own loop and once per outer loop */
+    stack = (uint32_t*) malloc(sizeof(uint32_t) *
+                               (graph->preds_start[graph->count] * 2 + 1));
+    tops = NULL;
+
+    /* a dominator has smaller number, so inner headers go first */
+    for (uint32_t h = graph->count - 1 ; h > 0 ; h--) {
+        count = 0;
+
+        for (uint32_t p = graph->preds_start[h] ;
+             p < graph->preds_start[h + 1] ; p++) {
+            pred = graph->preds[p];
+
+            if (pred < h)
+                continue;
+
+            if (dom_dominates(graph, h, pred)) {
+                stack[count++] = pred;
+            } else {
+                info->irreducible++;
+            }
+        }
+
+        if (!count)
+            continue;
+
+        loop = ctx->loops_count;
+        loop_add(ctx, graph->nodes[h]->index);
+        tops = (uint32_t*) realloc(tops, sizeof(uint32_t) * ctx->loops_size);
+        tops[loop] = loop;
+
+        loop_of[h] = loop;
+
+        while (count) {
+            n = stack[--count];
+
+            if (loop_of[n] == INVALID_VALUE) {
+                loop_of[n] = loop;
+            } else {
+                top = loop_find_top(tops, loop_of[n]);
+                if (top == loop)
+                    continue;
+
+                /* nested loop, the walk goes on from its header */
+                tops[top] = loop;
+                ctx->loops[top].parent = loop;
+                n = graph->numbers[ctx->loops[top].header];
+            }
+
+            /* virtual root is never inside of a loop */
+            for (uint32_t p = graph->preds_start[n] ;
+                 p < graph->preds_start[n + 1] ; p++) {
+                if (graph->preds[p])
+                    stack[count++] = graph->preds[p];
+            }
+        }
+    }
+
+    for (n = 1 ; n < graph->count ; n++) {
+        loop = loop_of[n];
+        ctx->analysis_loops[graph->nodes[n]->index] = loop;
+
+        if (loop != INVALID_VALUE)
+            ctx->loops[loop].nodes++;
+    }
+
+    /* parents are found after their nested loops */
+    for (loop = 0 ; loop < ctx->loops_count ; loop++) {
+        if (ctx->loops[loop].parent != INVALID_VALUE)
+            ctx->loops[ctx->loops[loop].parent].nodes +=
+                ctx->loops[loop].nodes;
+    }
+
+    for (loop = ctx->loops_count ; loop-- > 0 ; ) {
+        top = ctx->loops[loop].parent;
+        ctx->loops[loop].depth = top == INVALID_VALUE ? 1 :
+                                 ctx->loops[top].depth + 1;
+
+        if (ctx->loops[loop].depth > info->max_depth)
+            info->max_depth = ctx->loops[loop].depth;
+    }
+
+    free(tops);
+    free(stack);
+    free(loop_of);
+}
+
+void cgp_free_analysis(cgp_ctx *ctx)
+{
+    free(ctx->analysis_idoms);
+    free(ctx->analysis_loops);
+    free(ctx->loops);
+
+    ctx->analysis_idoms = NULL;
+    ctx->analysis_loops = NULL;
+    ctx->analysis_count = 0;
+
+    ctx->loops = NULL;
+    ctx->loops_count = 0;
+    ctx->loops_size = 0;
+}
+
+/* no node was added, removed or bypassed since cgp_ctx_analyze(...) */
+int cgp_analysis_current(cgp_ctx *ctx)
+{
+    return ctx->analysis_count &&
+           ctx->analysis_version == ctx->graph_version;
+}
+
+int cgp_ctx_analyze(cgp_ctx *ctx, cgp_analysis_info *info)
+{
+    cgp_analysis_info stats;
+    DomGraph graph;
+    uint32_t idom;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(&graph, 0, sizeof(graph));
+
+    cgp_free_analysis(ctx);
+
+    if (!ctx->nodes_count) {
+        if (info)
+            *info = stats;
+        return -1;
+    }
+
+    dom_number(ctx, &graph);
+    dom_collect_preds(ctx, &graph);
+    stats.passes = dom_compute(&graph);
+    dom_number_tree(&graph);
+
+    ctx->analysis_count = ctx->nodes_count;
+    ctx->analysis_version = ctx->graph_version;
+    ctx->analysis_idoms = (uint32_t*) malloc(sizeof(uint32_t) *
+                                             ctx->nodes_count);
+    ctx->analysis_loops = (uint32_t*) malloc(sizeof(uint32_t) *
+                                             ctx->nodes_count);
+
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        ctx->analysis_idoms[i] = INVALID_VALUE;
+        ctx->analysis_loops[i] = INVALID_VALUE;
+    }
+
+    /* entry points are dominated by the virtual root only */
+    for (uint32_t n = 1 ; n < graph.count ; n++) {
+        idom = graph.idoms[n];
+        if (idom)
+            ctx->analysis_idoms[graph.nodes[n]->index] =
+                graph.nodes[idom]->index;
+    }
+
+    loop_find(ctx, &graph, &stats);
+
+    stats.reachable = graph.count - 1;
+    stats.loops = ctx->loops_count;
+
+    free(graph.enter);
+    free(graph.leave);
+    free(graph.idoms);
+    free(graph.preds);
+    free(graph.preds_start);
+    free(graph.nodes);
+    free(graph.numbers);
+
+    if (info)
+        *info = stats;
+
+    return 0;
+}
+
+uint32_t cgp_ctx_get_idom(cgp_ctx *ctx, uint32_t node)
+{
+    if (!cgp_analysis_current(ctx) || node >= ctx->analysis_count)
+        return INVALID_VALUE;
+
+    return ctx->analysis_idoms[node];
+}
+
+uint32_t cgp_ctx_get_loop(cgp_ctx *ctx, uint32_t node)
+{
+    if (!cgp_analysis_current(ctx) || node >= ctx->analysis_count)
+        return INVALID_VALUE;
+
+    return ctx->analysis_loops[node];
+}
+
+const cgp_loop *cgp_ctx_get_loops(cgp_ctx *ctx, uint32_t *count)
+{
+    if (!cgp_analysis_current(ctx)) {
+        if (count)
+            *count = 0;
+        return NULL;
+    }
+
+    if (count)
+        *count = ctx->loops_count;
+
+    return ctx->loops;
+}
@@ -0,0 +1,431 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cgp.h"
+#include "cgp_internal.h"
+
+#define EXPORT_BUFFER_SIZE  0x40000
+#define EXPORT_RECORD_MAX   0x100       /* longest line of any format */
+
+typedef struct export_buffer {
+    int fd;
+    int error;
+    uint32_t used;
+    char data[EXPORT_BUFFER_SIZE];
+} ExportBuffer;
+
+enum edge_kinds {
+    EDGE_NEXT,
+    EDGE_FALSE,
+    EDGE_TRUE,
+    EDGE_CALL
+};
+
+static const char *node_names[] = {
+    "LINEAR CODE", "JMP", "JCC", "CALL", "RET", "LABEL"
+};
+
+static const char *edge_names[] = {
+    "next", "false", "true", "call"
+};
+
+static void export_flush(ExportBuffer *out)
+{
+    uint32_t done = 0;
+    ssize_t written;
+
+    while (done < out->used && !out->error) {
+        written = write(out->fd, &out->data[done], out->used - done);
+
+        if (written < 0) {
+            if (errno != EINTR)
+                out->error = 1;
+            continue;
+        }
+
+        done += (uint32_t) written;
+    }
+
+    out->used = 0;
+}
+
+/* records are short, so the room is checked once per record */
+static void export_reserve(ExportBuffer *out)
+{
+    if (EXPORT_BUFFER_SIZE - out->used < EXPORT_RECORD_MAX)
+        export_flush(out);
+}
+
+static void export_str(ExportBuffer *out, const char *str)
+{
+    size_t length = strlen(str);
+
+    /* only headers may be not reserved */
+    if (length > EXPORT_BUFFER_SIZE - out->used)
+        export_flush(out);
+
+    memcpy(&out->data[out->used], str, length);
+    out->used += (uint32_t) length;
+}
+
+static void export_dec(ExportBuffer *out, uint32_t value)
+{
+    char digits[10];
+    uint32_t count = 0;
+
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (count)
+        out->data[out->used++] = digits[--count];
+}
+
+/* as %0*X */
+static void export_hex(ExportBuffer *out, uint32_t value, uint32_t digits)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    uint32_t count = 8;
+
+    while (count > digits && !(value >> ((count - 1) * 4)))
+        count--;
+
+    while (count--)
+        out->data[out->used++] = hex[(value >> (count * 4)) & 0xF];
+}
+
+/* loop of a node if results of cgp_ctx_analyze(...) fit the graph */
+static uint32_t export_loop(cgp_ctx *ctx, pNode in_node)
+{
+    if (!cgp_analysis_current(ctx))
+        return INVALID_VALUE;
+
+    return ctx->analysis_loops[in_node->index];
+}
+
+static int export_is_header(cgp_ctx *ctx, pNode in_node)
+{
+    uint32_t loop = export_loop(ctx, in_node);
+
+    return loop != INVALID_VALUE && ctx->loops[loop].header == in_node->index;
+}
+
+/* dominator and loop lines of a label */
+static void export_annotation(ExportBuffer *out, cgp_ctx *ctx,
+                              pNode in_node)
+{
+    uint32_t loop = export_loop(ctx, in_node);
+
+    if (!cgp_analysis_current(ctx))
+        return;
+
+    if (ctx->analysis_idoms[in_node->index] != INVALID_VALUE) {
+        export_str(out, "\\nidom: n");
+        export_dec(out, ctx->analysis_idoms[in_node->index]);
+    }
+
+    if (loop != INVALID_VALUE) {
+        export_str(out, "\\nloop: n");
+        export_dec(out, ctx->loops[loop].header);
+        export_str(out, " depth: ");
+        export_dec(out, ctx->loops[loop].depth);
+    }
+}
+
+static void export_node_gdl(ExportBuffer *out, cgp_ctx *ctx, pNode in_node)
+{
+    export_str(out, "node: {title: \"n");
+    export_dec(out, in_node->index);
+    export_str(out, "\" label: \"Offset: 0x");
+    export_hex(out, in_node->offset, 4);
+    export_str(out, " (size: ");
+    export_hex(out, in_node->weight, 1);
+    export_str(out, ") ");
+    export_str(out, node_names[in_node->type]);
+    export_annotation(out, ctx, in_node);
+
+    if (export_is_header(ctx, in_node)) {
+        export_str(out, "\" color: lightyellow}\n");
+    } else {
+        export_str(out, "\"}\n");
+    }
+}
+
+static void export_edge_gdl(ExportBuffer *out, pNode from, pNode to,
+                            uint32_t kind)
+{
+    export_str(out, "edge: {sourcename: \"n");
+    export_dec(out, from->index);
+    export_str(out, "\" targetname: \"n");
+    export_dec(out, to->index);
+
+    switch (kind) {
+        case EDGE_FALSE:
+            export_str(out, "\" label: \"false\" color: red}\n");
+            break;
+
+        case EDGE_TRUE:
+            export_str(out, "\" label: \"true\" color: darkgreen}\n");
+            break;
+
+        case EDGE_CALL:
+            export_str(out, "\" label: \"call\" color: blue}\n");
+            break;
+
+        default:
+            export_str(out, "\"}\n");
+            break;
+    }
+}
+
+static void export_node_dot(ExportBuffer *out, cgp_ctx *ctx, pNode in_node)
+{
+    export_str(out, "n");
+    export_dec(out, in_node->index);
+    export_str(out, " [label=\"0x");
+    export_hex(out, in_node->offset, 4);
+    export_str(out, " (size: ");
+    export_hex(out, in_node->weight, 1);
+    export_str(out, ") ");
+    export_str(out, node_names[in_node->type]);
+    export_annotation(out, ctx, in_node);
+
+    if (export_is_header(ctx, in_node)) {
+        export_str(out, "\", style=filled, fillcolor=lightyellow];\n");
+    } else {
+        export_str(out, "\"];\n");
+    }
+}
+
+static void export_edge_dot(ExportBuffer *out, pNode from, pNode to,
+                            uint32_t kind)
+{
+    export_str(out, "n");
+    export_dec(out, from->index);
+    export_str(out, " -> n");
+    export_dec(out, to->index);
+
+    switch (kind) {
+        case EDGE_FALSE:
+            export_str(out, " [label=\"false\", color=red];\n");
+            break;
+
+        case EDGE_TRUE:
+            export_str(out, " [label=\"true\", color=darkgreen];\n");
+            break;
+
+        case EDGE_CALL:
+            export_str(out, " [label=\"call\", color=blue];\n");
+            break;
+
+        default:
+            export_str(out, ";\n");
+            break;
+    }
+}
+
+static void export_node_jsonl(ExportBuffer *out, cgp_ctx *ctx,
+                              pNode in_node)
+{
+    uint32_t loop;
+
+    export_str(out, "{\"node\":");
+    export_dec(out, in_node->index);
+    export_str(out, ",\"type\":\"");
+    export_str(out, node_names[in_node->type]);
+    export_str(out, "\",\"offset\":");
+
+    if (in_node->offset == INVALID_OFFSET) {
+        export_str(out, "null");
+    } else {
+        export_dec(out, in_node->offset);
+    }
+
+    export_str(out, ",\"size\":");
+    export_dec(out, in_node->weight);
+
+    if (cgp_analysis_current(ctx)) {
+        export_str(out, ",\"idom\":");
+
+        if (ctx->analysis_idoms[in_node->index] == INVALID_VALUE) {
+            export_str(out, "null");
+        } else {
+            export_dec(out, ctx->analysis_idoms[in_node->index]);
+        }
+
+        loop = export_loop(ctx, in_node);
+        export_str(out, ",\"loop\":");
+
+        if (loop == INVALID_VALUE) {
+            export_str(out, "null,\"depth\":0");
+        } else {
+            export_dec(out, ctx->loops[loop].header);
+            export_str(out, ",\"depth\":");
+            export_dec(out, ctx->loops[loop].depth);
+        }
+    }
+
+    export_str(out, "}\n");
+}
+
+static void export_edge_jsonl(ExportBuffer *out, pNode from, pNode to,
+                              uint32_t kind)
+{
+    export_str(out, "{\"from\":");
+    export_dec(out, from->index);
+    export_str(out, ",\"to\":");
+    export_dec(out, to->index);
+    export_str(out, ",\"kind\":\"");
+    export_str(out, edge_names[kind]);
+    export_str(out, "\"}\n");
+}
+
+static void export_edge(ExportBuffer *out, uint32_t format, pNode from,
+                        pNode to, uint32_t kind)
+{
+    export_reserve(out);
+
+    switch (format) {
+        case CGP_EXPORT_GDL:
+            export_edge_gdl(out, from, to, kind);
+            break;
+
+        case CGP_EXPORT_DOT:
+            export_edge_dot(out, from, to, kind);
+            break;
+
+        case CGP_EXPORT_JSONL:
+            export_edge_jsonl(out, from, to, kind);
+            break;
+    }
+}
+
+int cgp_ctx_export(cgp_ctx *ctx, int fd, uint32_t format)
+{
+    ExportBuffer *out;
+    pNode curr_node;
+    uint32_t missing = 0;
+    int result;
+
+    if (format > CGP_EXPORT_JSONL)
+        return -1;
+
+    out = (ExportBuffer*) malloc(sizeof(ExportBuffer));
+    if (!out)
+        return -1;
+
+    out->fd = fd;
+    out->error = 0;
+    out->used = 0;
+
+    /* graph header begin */
+    switch (format) {
+        case CGP_EXPORT_GDL:
+            export_str(out,
+                       "graph: {\n"
+                       "manhattan_edges: yes\n"
+                       "layoutalgorithm: mindepth\n"
+                       "finetuning: no\n"
+                       "layout_downfactor: 100\n"
+                       "layout_upfactor: 0\n"
+                       "layout_nearfactor: 0\n\n");
+            break;
+
+        case CGP_EXPORT_DOT:
+            export_str(out, "digraph cgp {\nnode [shape=box];\n\n");
+            break;
+    }
+
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        curr_node = ctx->nodes[i];
+        if (!curr_node)
+            continue;
+
+        export_reserve(out);
+
+        switch (format) {
+            case CGP_EXPORT_GDL:
+                export_node_gdl(out, ctx, curr_node);
+                break;
+
+            case CGP_EXPORT_DOT:
+                export_node_dot(out, ctx, curr_node);
+                break;
+
+            case CGP_EXPORT_JSONL:
+                export_node_jsonl(out, ctx, curr_node);
+                break;
+        }
+    }
+
+    if (format != CGP_EXPORT_JSONL)
+        export_str(out, "\n");
+
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        curr_node = ctx->nodes[i];
+        if (!curr_node)
+            continue;
+
+        switch (curr_node->type) {
+            case NODE_JCC:
+            case NODE_CALL:
+                if (curr_node->FLink) {
+                    export_edge(out, format, curr_node, curr_node->FLink,
+                                curr_node->type == NODE_JCC ? EDGE_FALSE
+                                                            : EDGE_NEXT);
+                }
+
+                /* unfinished graph is exported anyway */
+                if (curr_node->CLink) {
+                    export_edge(out, format, curr_node, curr_node->CLink,
+                                curr_node->type == NODE_JCC ? EDGE_TRUE
+                                                            : EDGE_CALL);
+                } else {
+                    missing++;
+                }
+                break;
+
+            default:
+                if (curr_node->FLink)
+                    export_edge(out, format, curr_node, curr_node->FLink,
+                                EDGE_NEXT);
+                break;
+        }
+    }
+
+    /* graph header end */
+    if (format != CGP_EXPORT_JSONL)
+        export_str(out, "}\n");
+
+    export_flush(out);
+
+    if (missing)
+        printf("[CGP] warning: %u branches haven't CLink\n", missing);
+
+    result = out->error ? -1 : 0;
+    free(out);
+    return result;
+}
+
+void cgp_ctx_export_to_gdl(cgp_ctx *ctx, const char *file_name)
+{
+    int fd;
+
+    fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("[CGP] error: can`t open %s\n", file_name);
+        return;
+    }
+
+    printf("[CGP] export graph to file: %s\n", file_name);
+
+    if (cgp_ctx_export(ctx, fd, CGP_EXPORT_GDL))
+        printf("[CGP] error: can`t write %s\n", file_name);
+
+    close(fd);
+}
@@ -0,0 +1,189 @@
+#if !defined(__CGP_INTERNAL_H__)
+#define __CGP_INTERNAL_H__
+
+/* IR shared by the parts of CGP, not a public interface */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cgp.h"
+#include "lde.h"
+
+#define OPCODE_X86_JMP_REL8     0xEB
+#define OPCODE_X86_JMP_REL32    0xE9
+#define OPCODE_X86_CALL         0xE8
+#define OPCODE_X86_RET          0xC3
+#define OPCODE_X86_NOP          0x90
+
+#define INVALID_OFFSET          0xFFFFFFFF
+#define INVALID_VALUE           0xFFFFFFFF
+
+#define WORKLIST_MIN            0x100
+
+#define NODE_SLAB_SIZE          0x200       /* nodes per arena slab */
+#define DATA_CHUNK_SIZE         0x10000     /* bytes per instruction chunk */
+#define NODE_TABLE_MIN          0x100
+
+/* counters of cgp_stats, nothing is left of them without CGP_STATS but
+   unevaluated references, so a parameter used only to count is used */
+#ifdef CGP_STATS
+#define CGP_STAT_ADD(counter, value)    ((counter) += (value))
+#define CGP_STAT_START(timer)           uint64_t timer = cgp_stats_now()
+#define CGP_STAT_STOP(counter, timer)   ((counter) += cgp_stats_now() - (timer))
+#else
+#define CGP_STAT_ADD(counter, value)    ((void) sizeof((counter) + (value)))
+#define CGP_STAT_START(timer)           ((void) 0)
+#define CGP_STAT_STOP(counter, timer)   ((void) sizeof(counter))
+#endif
+
+enum node_types {
+    NODE_LINE,
+    NODE_JMP,
+    NODE_JCC,
+    NODE_CALL,
+    NODE_RET,
+    NODE_LABEL              /* abstract node */
+};
+
+typedef struct node {
+    uint32_t index;         /* position in nodes table */
+    uint32_t type;
+    uint8_t *data;
+    uint32_t weight;
+    uint32_t offset;        /* absolute offset of data */
+    uint32_t origin;        /* offset in input code */
+    uint32_t layout_index;  /* position in layout, valid if layout has it */
+    lde_insn insn;          /* first instruction of data, kept for branches */
+    struct node *BLink;     /* backward */
+    struct node *FLink;     /* forward */
+    struct node *CLink;     /* condition */
+    struct node *FPreds;    /* nodes which FLink here */
+    struct node *CPreds;    /* nodes which CLink here */
+    struct node *FNext;     /* next node of FLink->FPreds */
+    struct node *CNext;     /* next node of CLink->CPreds */
+} Node, *pNode;
+
+/* branch whose target is not visited yet */
+typedef struct work_item {
+    pNode owner;
+    uint32_t key;           /* target offset for CGP_TRAVERSAL_ADDRESS */
+} WorkItem;
+
+/* stack, queue or min-heap of pending branches by traversal */
+typedef struct worklist {
+    WorkItem *items;
+    uint32_t head;          /* first item of a queue */
+    uint32_t count;
+    uint32_t size;
+} Worklist;
+
+/* node of cgp_ctx_insert_code(...) which isn't in the layout array yet */
+typedef struct layout_insert {
+    pNode prev;
+    pNode node;
+} LayoutInsert;
+
+typedef struct node_slab {
+    struct node_slab *next;
+    uint32_t used;
+    Node nodes[NODE_SLAB_SIZE];
+} NodeSlab, *pNodeSlab;
+
+typedef struct data_chunk {
+    struct data_chunk *next;
+    uint32_t used;
+    uint32_t size;
+    uint8_t data[];
+} DataChunk, *pDataChunk;
+
+struct cgp_ctx {
+    uint32_t nodes_count, nodes_size;
+    pNode *nodes, first_node;
+    uint32_t graph_version; /* node added, removed or bypassed */
+
+    /* entry points of cgp_ctx_init_entries(...), first_node is one too */
+    uint32_t roots_count;
+    pNode *roots;
+
+    /* arenas which own every Node and every instruction byte */
+    pNodeSlab node_slabs;
+    pDataChunk data_chunks;
+
+    /* direct-mapped offset -> node index over [0, offset_index_size), it's
+       NULL after cgp_ctx_load_ir(...) until a build */
+    uint32_t offset_index_size;
+    pNode *offset_index;
+
+    /* emission order of the last build */
+    uint32_t layout_count, layout_size;
+    pNode *layout;
+    uint8_t *layout_align;  /* node of layout starts at a boundary */
+    uint32_t layout_cold;   /* layout index of cold code, not aligned */
+
+    /* inserts merged into layout by next incremental build, the node of
+       insert k has layout_index layout_count + k */
+    LayoutInsert *inserts;
+    uint32_t inserts_count, inserts_size;
+
+    /* output of cgp_ctx_build_incremental(...), kept between builds */
+    uint8_t *image;
+    uint32_t image_size, image_capacity, image_valid;
+    uint32_t *image_offsets;    /* by node index, INVALID_OFFSET if changed */
+    uint32_t image_offsets_size;
+
+    /* cgp_ctx_set_alignment(...) */
+    uint32_t align_boundary, align_max, align_targets;
+
+    cgp_build_info build_info;
+    cgp_stats stats;        /* counted only with CGP_STATS */
+
+    /* cgp_ctx_analyze(...), by node index below analysis_count, they fit
+       the graph while graph_version is analysis_version */
+    uint32_t analysis_count, analysis_version;
+    uint32_t *analysis_idoms, *analysis_loops;
+    uint32_t loops_count, loops_size;
+    cgp_loop *loops;
+
+    uint32_t rand_seed;
+    uint32_t flags;         /* CGP_ZERO_COPY, ... */
+    uint32_t traversal;     /* CGP_TRAVERSAL_* */
+
+    /* file of cgp_ctx_load_ir(...), instruction bytes point to it */
+    void *ir_map;
+    size_t ir_map_size;
+    pNode ir_nodes;         /* nodes of the file by number, one block */
+    size_t ir_nodes_size;
+
+    /* pending branches of parse and build */
+    Worklist jcc_work;
+    Worklist call_work;
+};
+
+void cgp_reset_work(cgp_ctx *ctx);
+uint64_t cgp_stats_now(void);
+
+pNode cgp_arena_node(pNodeSlab *slabs);
+uint8_t *cgp_arena_data(pDataChunk *chunks, uint32_t size);
+pNode cgp_register_node(cgp_ctx *ctx, pNode in_node);
+
+uint8_t *cgp_node_data(cgp_ctx *ctx, pDataChunk *chunks, uint8_t *buff,
+                       uint32_t offset, uint32_t type, uint32_t size);
+
+void cgp_reset_index(cgp_ctx *ctx, uint32_t size);
+void cgp_rebuild_index(cgp_ctx *ctx, uint32_t size);
+
+void cgp_set_flink(pNode in_node, pNode target);
+void cgp_set_clink(pNode in_node, pNode target);
+void cgp_randomize(cgp_ctx *ctx);
+
+int cgp_get_node_type(const lde_insn *insn);
+uint32_t cgp_get_branch_offset(const uint8_t *buff, uint32_t code_offset,
+                               const lde_insn *insn);
+
+void cgp_unmap_ir(cgp_ctx *ctx);
+void cgp_free_analysis(cgp_ctx *ctx);
+int cgp_analysis_current(cgp_ctx *ctx);
+
+void cgp_long2short(pNode in_node);
+void cgp_short2long(pNode in_node);
+
+#endif
@@ -0,0 +1,410 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cgp.h"
+#include "cgp_internal.h"
+
+/*
+ *  IR file, fields are little endian uint32_t but lde_insn records:
+ *
+ *  header    magic, version, counts and sizes, input code
+ *  nodes     type, weight, offset, origin, data offset in pool, record
+ *  edges     FLink, CLink, BLink as node numbers
+ *  pool      instruction bytes
+ *
+ *  Nothing is a pointer, so the file may be mapped at any address. Load
+ *  checks every size, offset and link, but doesn't hash the file and
+ *  doesn't decode any instruction.
+ */
+
+#define IR_MAGIC            0x49504743  /* "CGPI" */
+#define IR_VERSION          3
+#define IR_NONE             0xFFFFFFFF  /* no node or no data */
+#define IR_LONG_RESERVE     10          /* long form of JMP/JCC */
+#define IR_HASH_SEED        0x9E3779B97F4A7C15ULL
+#define IR_HASH_PRIME       0x100000001B3ULL
+
+typedef struct ir_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nodes_count;
+    uint32_t first_node;
+    uint32_t pool_size;
+    uint32_t index_size;    /* offsets of nodes are below it */
+    uint32_t input_size;    /* of input code, 0 if it wasn't given */
+    uint32_t input_hash;    /* cgp_hash_input(...) of input code */
+} IrHeader;
+
+typedef struct ir_node {
+    uint32_t type;
+    uint32_t weight;
+    uint32_t offset;
+    uint32_t origin;
+    uint32_t data;
+    lde_insn insn;          /* bytes as they are in memory */
+} IrNode;
+
+typedef struct ir_edges {
+    uint32_t flink;
+    uint32_t clink;
+    uint32_t blink;
+} IrEdges;
+
+/* four independent lanes of multiply-rotate, bytes of tail go to lane 0 */
+uint32_t cgp_hash_input(const uint8_t *buff, uint32_t size)
+{
+    uint64_t lanes[4] = {IR_HASH_SEED, IR_HASH_SEED + 1, IR_HASH_SEED + 2,
+                         IR_HASH_SEED + 3};
+    uint64_t word, hash;
+    uint32_t i = 0;
+
+    for ( ; size - i >= 32 ; i += 32) {
+        for (uint32_t k = 0 ; k < 4 ; k++) {
+            memcpy(&word, &buff[i + k * 8], 8);
+            lanes[k] = (lanes[k] ^ word) * IR_HASH_PRIME;
+            lanes[k] = (lanes[k] << 31) | (lanes[k] >> 33);
+        }
+    }
+
+    for ( ; i < size ; i++)
+        lanes[0] = (lanes[0] ^ buff[i]) * IR_HASH_PRIME;
+
+    hash = size;
+    for (uint32_t k = 0 ; k < 4 ; k++)
+        hash = (hash ^ lanes[k]) * IR_HASH_PRIME;
+
+    return (uint32_t) (hash ^ (hash >> 32));
+}
+
+/* bytes which may be written to the node data */
+static uint32_t cgp_ir_data_size(uint32_t type, uint32_t weight)
+{
+    if (type == NODE_LABEL)
+        return 0;
+
+    if ((type == NODE_JMP || type == NODE_JCC) && weight < IR_LONG_RESERVE)
+        return IR_LONG_RESERVE;
+
+    return weight;
+}
+
+static uint32_t cgp_ir_number(uint32_t *numbers, pNode in_node)
+{
+    return in_node ? numbers[in_node->index] : IR_NONE;
+}
+
+int cgp_ctx_save_ir(cgp_ctx *ctx, const uint8_t *in_buff, uint32_t in_size,
+                    const char *file_name)
+{
+    IrHeader *header;
+    IrNode *nodes;
+    IrEdges *edges;
+    uint8_t *file, *pool;
+    uint32_t *numbers, count = 0, pool_size = 0, size;
+    size_t file_size;
+    pNode curr_node;
+    FILE *fh;
+    int result = 0;
+
+    /* removed nodes leave holes in nodes table */
+    numbers = (uint32_t*) malloc(sizeof(uint32_t) * (ctx->nodes_count + 1));
+
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        curr_node = ctx->nodes[i];
+        if (!curr_node)
+            continue;
+
+        numbers[i] = count++;
+        pool_size += cgp_ir_data_size(curr_node->type, curr_node->weight);
+    }
+
+    file_size = sizeof(IrHeader) + (sizeof(IrNode) + sizeof(IrEdges)) *
+                (size_t) count + pool_size;
+    file = (uint8_t*) calloc(1, file_size);
+
+    header = (IrHeader*) file;
+    nodes = (IrNode*) &header[1];
+    edges = (IrEdges*) &nodes[count];
+    pool = (uint8_t*) &edges[count];
+
+    header->magic = IR_MAGIC;
+    header->version = IR_VERSION;
+    header->nodes_count = count;
+    header->first_node = cgp_ir_number(numbers, ctx->first_node);
+    header->pool_size = pool_size;
+    header->index_size = ctx->offset_index_size;
+    header->input_size = in_buff ? in_size : 0;
+    header->input_hash = in_buff ? cgp_hash_input(in_buff, in_size) : 0;
+
+    pool_size = 0;
+
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++) {
+        curr_node = ctx->nodes[i];
+        if (!curr_node)
+            continue;
+
+        size = cgp_ir_data_size(curr_node->type, curr_node->weight);
+
+        nodes->type = curr_node->type;
+        nodes->weight = curr_node->weight;
+        nodes->offset = curr_node->offset;
+        nodes->origin = curr_node->origin;
+        nodes->data = size ? pool_size : IR_NONE;
+        nodes->insn = curr_node->insn;
+
+        edges->flink = cgp_ir_number(numbers, curr_node->FLink);
+        edges->clink = cgp_ir_number(numbers, curr_node->CLink);
+        edges->blink = cgp_ir_number(numbers, curr_node->BLink);
+
+        if (size) {
+            memcpy(&pool[pool_size], curr_node->data, curr_node->weight);
+            pool_size += size;
+        }
+
+        nodes++;
+        edges++;
+    }
+
+    fh = fopen(file_name, "wb");
+    if (!fh || fwrite(file, 1, file_size, fh) != file_size)
+        result = -1;
+
+    if (fh && fclose(fh))
+        result = -1;
+
+    free(file);
+    free(numbers);
+    return result;
+}
+
+static int cgp_ir_valid_link(const IrHeader *header, uint32_t number)
+{
+    return number == IR_NONE || number < header->nodes_count;
+}
+
+/* branches are rewritten by imm_offset and imm_size of their record */
+static int cgp_ir_valid_insn(const IrNode *in_node)
+{
+    const lde_insn *insn = &in_node->insn;
+
+    if (insn->length > in_node->weight ||
+        insn->imm_offset + insn->imm_size > insn->length ||
+        insn->disp_offset + insn->disp_size > insn->length)
+        return 0;
+
+    if (in_node->type != NODE_JMP && in_node->type != NODE_JCC &&
+        in_node->type != NODE_CALL)
+        return 1;
+
+    return insn->length == in_node->weight &&
+           (insn->imm_size == 1 || insn->imm_size == 4);
+}
+
+/* edges as parse makes them, cgp_ctx_build(...) follows them blindly */
+static int cgp_ir_valid_edges(const IrNode *in_node, const IrEdges *edges)
+{
+    switch (in_node->type) {
+        case NODE_JCC:
+        case NODE_CALL:
+            return edges->flink != IR_NONE && edges->clink != IR_NONE;
+
+        case NODE_LINE:
+        case NODE_JMP:
+            return edges->flink != IR_NONE && edges->clink == IR_NONE;
+    }
+
+    /* RET and LABEL end a run, nothing is a target of them */
+    return edges->clink == IR_NONE;
+}
+
+/* everything is checked before the context is touched */
+static int cgp_ir_validate(const uint8_t *file, size_t file_size,
+                           uint32_t in_size, uint32_t in_hash)
+{
+    const IrHeader *header = (const IrHeader*) file;
+    const IrNode *nodes;
+    const IrEdges *edges;
+    uint32_t size;
+
+    if (file_size < sizeof(IrHeader) || header->magic != IR_MAGIC ||
+        header->version != IR_VERSION)
+        return -1;
+
+    if ((uint64_t) header->nodes_count * (sizeof(IrNode) + sizeof(IrEdges)) +
+        header->pool_size != file_size - sizeof(IrHeader))
+        return -1;
+
+    /* cache of other code, the caller hashes it once */
+    if ((in_size && header->input_size != in_size) ||
+        (in_hash && header->input_hash != in_hash))
+        return -1;
+
+    if (!cgp_ir_valid_link(header, header->first_node))
+        return -1;
+
+    nodes = (const IrNode*) &header[1];
+    edges = (const IrEdges*) &nodes[header->nodes_count];
+
+    for (uint32_t i = 0 ; i < header->nodes_count ; i++) {
+        if (nodes[i].type > NODE_LABEL)
+            return -1;
+
+        size = cgp_ir_data_size(nodes[i].type, nodes[i].weight);
+
+        /* labels have neither data nor weight */
+        if (!size) {
+            if (nodes[i].data != IR_NONE || nodes[i].weight)
+                return -1;
+        }
+        else if (nodes[i].weight > size ||
+                 nodes[i].data > header->pool_size ||
+                 size > header->pool_size - nodes[i].data)
+            return -1;
+
+        if (!cgp_ir_valid_insn(&nodes[i]))
+            return -1;
+
+        if (!cgp_ir_valid_link(header, edges[i].flink) ||
+            !cgp_ir_valid_link(header, edges[i].clink) ||
+            !cgp_ir_valid_link(header, edges[i].blink))
+            return -1;
+
+        if (!cgp_ir_valid_edges(&nodes[i], &edges[i]))
+            return -1;
+    }
+
+    return 0;
+}
+
+int cgp_ctx_load_ir(cgp_ctx *ctx, uint32_t in_size, uint32_t in_hash,
+                    const char *file_name)
+{
+    const IrHeader *header;
+    const IrNode *nodes;
+    const IrEdges *edges;
+    uint8_t *file, *pool;
+    struct stat st;
+    pNode curr_node, target;
+    size_t file_size;
+    int fd;
+    CGP_STAT_START(parse_start);
+
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(IrHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    /* private writable mapping, rewritten branches become own pages */
+    file_size = (size_t) st.st_size;
+    file = (uint8_t*) mmap(NULL, file_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (file == MAP_FAILED)
+        return -1;
+
+    if (cgp_ir_validate(file, file_size, in_size, in_hash)) {
+        munmap(file, file_size);
+        return -1;
+    }
+
+    cgp_ctx_free(ctx);
+    cgp_randomize(ctx);
+
+    cgp_reset_work(ctx);
+    ctx->ir_map = file;
+    ctx->ir_map_size = file_size;
+
+    header = (const IrHeader*) file;
+    nodes = (const IrNode*) &header[1];
+    edges = (const IrEdges*) &nodes[header->nodes_count];
+    pool = (uint8_t*) &edges[header->nodes_count];
+
+    /* nodes table is allocated once instead of growing */
+    ctx->nodes_size = header->nodes_count ? header->nodes_count
+                                          : NODE_TABLE_MIN;
+    ctx->nodes = (pNode*) malloc(sizeof(pNode) * ctx->nodes_size);
+
+    /* node of number i is ir_nodes[i], so links are set in one pass, the
+       block is zeroed and faulted in at once instead of node by node */
+    ctx->ir_nodes_size = sizeof(Node) * (header->nodes_count + 1);
+    ctx->ir_nodes = (pNode) mmap(NULL, ctx->ir_nodes_size,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+                                 -1, 0);
+
+    if (ctx->ir_nodes == MAP_FAILED) {
+        ctx->ir_nodes = NULL;
+        cgp_ctx_free(ctx);
+        return -1;
+    }
+
+    for (uint32_t i = 0 ; i < header->nodes_count ; i++) {
+        curr_node = &ctx->ir_nodes[i];
+        ctx->nodes[i] = curr_node;
+
+        curr_node->index = i;
+        curr_node->type = nodes[i].type;
+        curr_node->weight = nodes[i].weight;
+        curr_node->offset = nodes[i].offset;
+        curr_node->origin = nodes[i].origin;
+        curr_node->insn = nodes[i].insn;
+
+        if (nodes[i].data != IR_NONE)
+            curr_node->data = &pool[nodes[i].data];
+
+        /* nodes are new, so a link only goes to the head of a list */
+        if (edges[i].flink != IR_NONE) {
+            target = &ctx->ir_nodes[edges[i].flink];
+            curr_node->FLink = target;
+            curr_node->FNext = target->FPreds;
+            target->FPreds = curr_node;
+        }
+
+        if (edges[i].clink != IR_NONE) {
+            target = &ctx->ir_nodes[edges[i].clink];
+            curr_node->CLink = target;
+            curr_node->CNext = target->CPreds;
+            target->CPreds = curr_node;
+        }
+
+        if (edges[i].blink != IR_NONE)
+            curr_node->BLink = &ctx->ir_nodes[edges[i].blink];
+    }
+
+    ctx->nodes_count = header->nodes_count;
+    ctx->graph_version++;
+    CGP_STAT_ADD(ctx->stats.nodes_allocated, header->nodes_count);
+
+    ctx->first_node = header->first_node != IR_NONE ?
+                      ctx->nodes[header->first_node] : NULL;
+
+    /* nothing looks nodes up by offset until a build makes the index */
+    ctx->offset_index_size = header->index_size;
+
+    CGP_STAT_STOP(ctx->stats.parse_ns, parse_start);
+    return 0;
+}
+
+void cgp_unmap_ir(cgp_ctx *ctx)
+{
+    if (ctx->ir_map)
+        munmap(ctx->ir_map, ctx->ir_map_size);
+
+    if (ctx->ir_nodes)
+        munmap(ctx->ir_nodes, ctx->ir_nodes_size);
+
+    ctx->ir_map = NULL;
+    ctx->ir_map_size = 0;
+    ctx->ir_nodes = NULL;
+    ctx->ir_nodes_size = 0;
+}
@@ -0,0 +1,530 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "cgp.h"
+#include "cgp_internal.h"
+#include "lde.h"
+
+#define DEQUE_MIN           0x100
+#define JMP_CHAIN_LIMIT     0x40        /* JMP followed without a node */
+
+/* offset is taken by a thread which decodes it right now */
+static Node claimed_node;
+
+typedef struct parse_worker {
+    pthread_t thread;
+    struct parse_job *job;
+    uint32_t id;
+
+    /* pending branch targets, owner works on bottom, thieves take top */
+    pthread_mutex_t lock;
+    uint32_t *deque;
+    uint32_t top, bottom, size;
+
+    /* own arenas, moved to the context after parse */
+    pNodeSlab node_slabs;
+    pDataChunk data_chunks;
+
+    /* labels for targets out of code */
+    pNode *labels;
+    uint32_t labels_count, labels_size;
+
+    uint32_t rand_seed;
+    uint64_t lde_calls;     /* summed to the context stats after parse */
+} ParseWorker;
+
+typedef struct parse_job {
+    cgp_ctx *ctx;
+    uint8_t *buff;
+    uint32_t size;
+
+    ParseWorker *workers;
+    uint32_t workers_count;
+
+    uint32_t pending;       /* targets pushed and not swept yet */
+    uint32_t error;         /* offset of invalid instruction + 1 */
+} ParseJob;
+
+static void cgp_deque_push(ParseWorker *worker, uint32_t offset)
+{
+    __atomic_add_fetch(&worker->job->pending, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->bottom == worker->size) {
+        /* compact or grow */
+        if (worker->top > worker->size / 2) {
+            memmove(worker->deque, &worker->deque[worker->top],
+                    sizeof(uint32_t) * (worker->bottom - worker->top));
+        } else {
+            worker->size = worker->size ? worker->size * 2 : DEQUE_MIN;
+            worker->deque = (uint32_t*) realloc(worker->deque,
+                                        sizeof(uint32_t) * worker->size);
+
+            memmove(worker->deque, &worker->deque[worker->top],
+                    sizeof(uint32_t) * (worker->bottom - worker->top));
+        }
+
+        worker->bottom -= worker->top;
+        worker->top = 0;
+    }
+
+    worker->deque[worker->bottom++] = offset;
+
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static int cgp_deque_pop(ParseWorker *worker, uint32_t *offset)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->bottom != worker->top) {
+        *offset = worker->deque[--worker->bottom];
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+static int cgp_deque_steal(ParseWorker *victim, uint32_t *offset)
+{
+    int found = 0;
+
+    if (pthread_mutex_trylock(&victim->lock))
+        return 0;
+
+    if (victim->bottom != victim->top) {
+        *offset = victim->deque[victim->top++];
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&victim->lock);
+    return found;
+}
+
+static pNode cgp_map_get(ParseJob *job, uint32_t offset)
+{
+    return __atomic_load_n(&job->ctx->offset_index[offset], __ATOMIC_ACQUIRE);
+}
+
+/* skip JMP after discovery, they don't become nodes as in cgp_parse(...),
+   so only an offset without node is decoded */
+static uint32_t cgp_resolve_jmp(ParseJob *job, uint32_t offset,
+                                uint64_t *lde_calls)
+{
+    lde_insn insn;
+
+    for (uint32_t i = 0 ; i < JMP_CHAIN_LIMIT ; i++) {
+        if (offset >= job->size || job->ctx->offset_index[offset])
+            return offset;
+
+        CGP_STAT_ADD(*lde_calls, 1);
+
+        if (!lde_decode_insn(&job->buff[offset], &insn) ||
+            cgp_get_node_type(&insn) != NODE_JMP)
+            return offset;
+
+        offset = cgp_get_branch_offset(job->buff, offset, &insn);
+    }
+
+    return INVALID_OFFSET;
+}
+
+/* target may be JMP, the sweep follows it */
+static void cgp_push_target(ParseWorker *worker, uint32_t offset)
+{
+    if (offset < worker->job->size && !cgp_map_get(worker->job, offset))
+        cgp_deque_push(worker, offset);
+}
+
+/* decode linearly until RET or code which is owned already */
+static void cgp_sweep(ParseWorker *worker, uint32_t offset)
+{
+    ParseJob *job = worker->job;
+    pNode *slot, expected, current_node;
+    uint32_t instruction_size, jmp_chain = 0;
+    lde_insn insn;
+
+    while (offset < job->size) {
+        /* claim offset before decoding, so nobody else decodes it */
+        slot = &job->ctx->offset_index[offset];
+        expected = NULL;
+
+        if (!__atomic_compare_exchange_n(slot, &expected, &claimed_node, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return;
+
+        instruction_size = lde_decode_insn(&job->buff[offset], &insn);
+        CGP_STAT_ADD(worker->lde_calls, 1);
+
+        if (!instruction_size) {
+            __atomic_store_n(&job->error, offset + 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        /* JMP doesn't become a node, give its offset back and follow it */
+        if (cgp_get_node_type(&insn) == NODE_JMP) {
+            __atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+
+            if (++jmp_chain == JMP_CHAIN_LIMIT)
+                return;
+
+            offset = cgp_get_branch_offset(job->buff, offset, &insn);
+            continue;
+        }
+
+        jmp_chain = 0;
+
+        current_node = cgp_arena_node(&worker->node_slabs);
+        current_node->type = cgp_get_node_type(&insn);
+        current_node->insn = insn;
+
+        current_node->data = cgp_node_data(job->ctx, &worker->data_chunks,
+                                           job->buff, offset,
+                                           current_node->type,
+                                           instruction_size);
+
+        /* long forms are made when linking, weight is needed until then */
+        current_node->weight = instruction_size;
+        current_node->offset = offset;
+        current_node->origin = offset;
+
+        __atomic_store_n(slot, current_node, __ATOMIC_RELEASE);
+
+        switch (current_node->type) {
+            case NODE_JCC:
+            case NODE_CALL:
+                cgp_push_target(worker,
+                                cgp_get_branch_offset(job->buff, offset,
+                                                      &insn));
+                break;
+
+            case NODE_RET:
+                return;
+        }
+
+        offset += instruction_size;
+    }
+}
+
+static int cgp_next_target(ParseWorker *worker, uint32_t *offset)
+{
+    ParseJob *job = worker->job;
+    uint32_t victim;
+
+    if (cgp_deque_pop(worker, offset))
+        return 1;
+
+    for (uint32_t i = 1 ; i < job->workers_count ; i++) {
+        worker->rand_seed = worker->rand_seed * 1103515245 + 12345;
+        victim = (worker->rand_seed >> 16) % job->workers_count;
+
+        if (victim != worker->id &&
+            cgp_deque_steal(&job->workers[victim], offset))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void *cgp_discover_thread(void *param)
+{
+    ParseWorker *worker = (ParseWorker*) param;
+    ParseJob *job = worker->job;
+    uint32_t offset;
+
+    while (!__atomic_load_n(&job->error, __ATOMIC_RELAXED)) {
+        if (cgp_next_target(worker, &offset)) {
+            cgp_sweep(worker, offset);
+            __atomic_sub_fetch(&job->pending, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        if (!__atomic_load_n(&job->pending, __ATOMIC_ACQUIRE))
+            break;
+
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+static pNode cgp_allocate_label(ParseWorker *worker)
+{
+    pNode label = cgp_arena_node(&worker->node_slabs);
+
+    label->type = NODE_LABEL;
+
+    if (worker->labels_count == worker->labels_size) {
+        worker->labels_size = worker->labels_size ? worker->labels_size * 2
+                                                  : DEQUE_MIN;
+        worker->labels = (pNode*) realloc(worker->labels,
+                                      sizeof(pNode) * worker->labels_size);
+    }
+
+    worker->labels[worker->labels_count++] = label;
+    return label;
+}
+
+/* node at offset behind JMP, a new label when it is out of code */
+static pNode cgp_link_target(ParseWorker *worker, uint32_t offset)
+{
+    ParseJob *job = worker->job;
+
+    offset = cgp_resolve_jmp(job, offset, &worker->lde_calls);
+
+    if (offset >= job->size || !job->ctx->offset_index[offset])
+        return cgp_allocate_label(worker);
+
+    return job->ctx->offset_index[offset];
+}
+
+/* in_node is new, only the predecessor list of target is shared */
+static void cgp_link_atomic(pNode in_node, pNode target, int condition)
+{
+    pNode *list = condition ? &target->CPreds : &target->FPreds;
+    pNode *next = condition ? &in_node->CNext : &in_node->FNext;
+    pNode head = __atomic_load_n(list, __ATOMIC_RELAXED);
+
+    if (condition) {
+        in_node->CLink = target;
+    } else {
+        in_node->FLink = target;
+    }
+
+    do {
+        *next = head;
+    } while (!__atomic_compare_exchange_n(list, &head, in_node, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void *cgp_link_thread(void *param)
+{
+    ParseWorker *worker = (ParseWorker*) param;
+    ParseJob *job = worker->job;
+    uint32_t begin, end, next_offset;
+    pNode curr_node;
+
+    /* every thread links nodes of its own part of code */
+    begin = (uint32_t) ((uint64_t) job->size * worker->id /
+                        job->workers_count);
+    end = (uint32_t) ((uint64_t) job->size * (worker->id + 1) /
+                      job->workers_count);
+
+    for (uint32_t offset = begin ; offset < end ; offset++) {
+        curr_node = job->ctx->offset_index[offset];
+        if (!curr_node)
+            continue;
+
+        next_offset = offset + curr_node->weight;
+
+        if (curr_node->type != NODE_RET)
+            cgp_link_atomic(curr_node, cgp_link_target(worker, next_offset), 0);
+
+        /* code right at the end only falls out of it */
+        if (next_offset > job->size)
+            curr_node->offset = INVALID_OFFSET;
+
+        if (curr_node->type == NODE_JCC || curr_node->type == NODE_CALL) {
+            /* record is of the input form until short2long */
+            cgp_link_atomic(curr_node, cgp_link_target(worker,
+                            cgp_get_branch_offset(job->buff, offset,
+                                                  &curr_node->insn)), 1);
+
+            cgp_short2long(curr_node);
+
+            if (curr_node->type == NODE_CALL) {
+                *(uint32_t*) &curr_node->data[1] = 0xCCCCCCCC;
+            } else {
+                *(uint32_t*) &curr_node->data[2] = 0xCCCCCCCC;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* run fn on every worker, on this thread if there is only one */
+static void cgp_run_workers(ParseJob *job, void *(*fn)(void *))
+{
+    if (job->workers_count == 1) {
+        fn(&job->workers[0]);
+        return;
+    }
+
+    for (uint32_t i = 0 ; i < job->workers_count ; i++)
+        pthread_create(&job->workers[i].thread, NULL, fn, &job->workers[i]);
+
+    for (uint32_t i = 0 ; i < job->workers_count ; i++)
+        pthread_join(job->workers[i].thread, NULL);
+}
+
+static pNode cgp_first_pred(pNode in_node)
+{
+    pNode best = NULL;
+
+    for (pNode pred = in_node->FPreds ; pred ; pred = pred->FNext) {
+        if (!best || pred->origin < best->origin)
+            best = pred;
+    }
+
+    if (best)
+        return best;
+
+    for (pNode pred = in_node->CPreds ; pred ; pred = pred->CNext) {
+        if (!best || pred->origin < best->origin)
+            best = pred;
+    }
+
+    return best;
+}
+
+/* move arenas of workers to context, cgp_ctx_free(...) owns them then */
+static void cgp_collect_arenas(ParseJob *job)
+{
+    cgp_ctx *ctx = job->ctx;
+    ParseWorker *worker;
+    pNodeSlab *slab_tail;
+    pDataChunk *chunk_tail;
+
+    for (uint32_t i = 0 ; i < job->workers_count ; i++) {
+        worker = &job->workers[i];
+
+        for (slab_tail = &worker->node_slabs ; *slab_tail ;
+             slab_tail = &(*slab_tail)->next)
+            ;
+
+        *slab_tail = ctx->node_slabs;
+        ctx->node_slabs = worker->node_slabs;
+
+        for (chunk_tail = &worker->data_chunks ; *chunk_tail ;
+             chunk_tail = &(*chunk_tail)->next)
+            ;
+
+        *chunk_tail = ctx->data_chunks;
+        ctx->data_chunks = worker->data_chunks;
+    }
+}
+
+/* fill nodes table by address */
+static void cgp_collect_nodes(ParseJob *job)
+{
+    cgp_ctx *ctx = job->ctx;
+    ParseWorker *worker;
+
+    cgp_collect_arenas(job);
+
+    for (uint32_t offset = 0 ; offset < job->size ; offset++) {
+        if (!ctx->offset_index[offset])
+            continue;
+
+        cgp_register_node(ctx, ctx->offset_index[offset]);
+
+        if (ctx->offset_index[offset]->offset == INVALID_OFFSET)
+            ctx->offset_index[offset] = NULL;
+    }
+
+    for (uint32_t i = 0 ; i < job->workers_count ; i++) {
+        worker = &job->workers[i];
+
+        for (uint32_t k = 0 ; k < worker->labels_count ; k++)
+            cgp_register_node(ctx, worker->labels[k]);
+    }
+
+    /* predecessor lists are built in any order, choose BLink stable */
+    for (uint32_t i = 0 ; i < ctx->nodes_count ; i++)
+        ctx->nodes[i]->BLink = cgp_first_pred(ctx->nodes[i]);
+}
+
+int cgp_ctx_init_entries(cgp_ctx *ctx, uint8_t *in_buff, uint32_t in_size,
+                         const uint32_t *entries, uint32_t entries_count,
+                         uint32_t threads)
+{
+    ParseJob job;
+    ParseWorker *worker;
+    uint32_t entry;
+    uint64_t lde_calls = 0;
+    CGP_STAT_START(parse_start);
+
+    cgp_ctx_free(ctx);
+    cgp_randomize(ctx);
+
+    cgp_reset_work(ctx);
+    cgp_reset_index(ctx, in_size);
+
+    if (!threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (uint32_t) cpus : 1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.ctx = ctx;
+    job.buff = in_buff;
+    job.size = in_size;
+    job.workers_count = threads;
+    job.workers = (ParseWorker*) calloc(threads, sizeof(ParseWorker));
+
+    for (uint32_t i = 0 ; i < threads ; i++) {
+        worker = &job.workers[i];
+        worker->job = &job;
+        worker->id = i;
+        worker->rand_seed = i + 1;
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+
+    /* entries are dealt round robin, stealing evens the rest */
+    for (uint32_t i = 0 ; i < entries_count ; i++) {
+        if (entries[i] < in_size)
+            cgp_deque_push(&job.workers[i % threads], entries[i]);
+    }
+
+    cgp_run_workers(&job, cgp_discover_thread);
+
+    if (job.error) {
+        printf("[CGP] error: lde error at %X!\n", job.error - 1);
+        cgp_collect_arenas(&job);
+    } else {
+        cgp_run_workers(&job, cgp_link_thread);
+        cgp_collect_nodes(&job);
+    }
+
+    /* every entry is a root of graph, the first one is entry point */
+    ctx->roots = (pNode*) malloc(sizeof(pNode) * (entries_count + 1));
+
+    for (uint32_t i = 0 ; i < entries_count && !job.error ; i++) {
+        entry = cgp_resolve_jmp(&job, entries[i], &lde_calls);
+
+        if (entry >= in_size || !ctx->offset_index[entry])
+            continue;
+
+        if (i == 0)
+            ctx->first_node = ctx->offset_index[entry];
+
+        ctx->roots[ctx->roots_count++] = ctx->offset_index[entry];
+    }
+
+    CGP_STAT_ADD(ctx->stats.lde_calls, lde_calls);
+
+    for (uint32_t i = 0 ; i < threads ; i++) {
+        CGP_STAT_ADD(ctx->stats.lde_calls, job.workers[i].lde_calls);
+        pthread_mutex_destroy(&job.workers[i].lock);
+        free(job.workers[i].deque);
+        free(job.workers[i].labels);
+    }
+
+    free(job.workers);
+
+    /* nodes which were decoded are dropped, the context is empty */
+    if (job.error)
+        cgp_ctx_free(ctx);
+
+    CGP_STAT_STOP(ctx->stats.parse_ns, parse_start);
+    return job.error ? -1 : 0;
+}
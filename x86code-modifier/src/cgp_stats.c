@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "cgp.h"
+#include "cgp_internal.h"
+
+#define STATS_JSON_MAX      0x200
+
+uint64_t cgp_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+int cgp_ctx_get_stats(cgp_ctx *ctx, cgp_stats *stats)
+{
+#ifdef CGP_STATS
+    *stats = ctx->stats;
+    return 0;
+#else
+    (void) ctx;
+    memset(stats, 0, sizeof(cgp_stats));
+    return -1;
+#endif
+}
+
+void cgp_ctx_reset_stats(cgp_ctx *ctx)
+{
+    memset(&ctx->stats, 0, sizeof(cgp_stats));
+}
+
+int cgp_ctx_dump_stats(cgp_ctx *ctx, int fd)
+{
+    char line[STATS_JSON_MAX];
+    cgp_stats stats;
+    uint32_t done = 0;
+    ssize_t written;
+    int length;
+
+    if (cgp_ctx_get_stats(ctx, &stats))
+        return -1;
+
+    length = snprintf(line, sizeof(line),
+                      "{\"nodes_allocated\":%" PRIu64 ","
+                      "\"nodes_freed\":%" PRIu64 ","
+                      "\"find_probes\":%" PRIu64 ","
+                      "\"lde_calls\":%" PRIu64 ","
+                      "\"bytes_emitted\":%" PRIu64 ","
+                      "\"branches_patched\":%" PRIu64 ","
+                      "\"parse_ns\":%" PRIu64 ","
+                      "\"layout_ns\":%" PRIu64 ","
+                      "\"emit_ns\":%" PRIu64 ","
+                      "\"patch_ns\":%" PRIu64 "}\n",
+                      stats.nodes_allocated, stats.nodes_freed,
+                      stats.find_probes, stats.lde_calls,
+                      stats.bytes_emitted, stats.branches_patched,
+                      stats.parse_ns, stats.layout_ns,
+                      stats.emit_ns, stats.patch_ns);
+
+    if (length < 0 || length >= (int) sizeof(line))
+        return -1;
+
+    while (done < (uint32_t) length) {
+        written = write(fd, &line[done], (uint32_t) length - done);
+
+        if (written < 0) {
+            if (errno != EINTR)
+                return -1;
+            continue;
+        }
+
+        done += (uint32_t) written;
+    }
+
+    return 0;
+}
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "elf_loader.h"
+
+/* section header of either class */
+typedef struct elf_section {
+    uint32_t name;
+    uint32_t type;
+    uint64_t address;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t entry_size;
+} ElfSection;
+
+typedef struct elf_file {
+    uint8_t *map;
+    size_t size;
+    int is64;
+    uint64_t sections_offset;
+    uint32_t sections_count, section_size, names_index;
+} ElfFile;
+
+static int elf_in_file(ElfFile *elf, uint64_t offset, uint64_t size)
+{
+    return offset <= elf->size && size <= elf->size - offset;
+}
+
+static int elf_get_section(ElfFile *elf, uint32_t index, ElfSection *section)
+{
+    uint64_t offset = elf->sections_offset + (uint64_t) index *
+                      elf->section_size;
+
+    if (index >= elf->sections_count ||
+        !elf_in_file(elf, offset, elf->section_size))
+        return -1;
+
+    if (elf->is64) {
+        Elf64_Shdr *shdr = (Elf64_Shdr*) &elf->map[offset];
+
+        section->name = shdr->sh_name;
+        section->type = shdr->sh_type;
+        section->address = shdr->sh_addr;
+        section->offset = shdr->sh_offset;
+        section->size = shdr->sh_size;
+        section->entry_size = shdr->sh_entsize;
+    } else {
+        Elf32_Shdr *shdr = (Elf32_Shdr*) &elf->map[offset];
+
+        section->name = shdr->sh_name;
+        section->type = shdr->sh_type;
+        section->address = shdr->sh_addr;
+        section->offset = shdr->sh_offset;
+        section->size = shdr->sh_size;
+        section->entry_size = shdr->sh_entsize;
+    }
+
+    /* NOBITS have no bytes in file */
+    if (section->type != SHT_NOBITS &&
+        !elf_in_file(elf, section->offset, section->size))
+        return -1;
+
+    return 0;
+}
+
+static uint32_t elf_find_text(ElfFile *elf, ElfSection *text)
+{
+    ElfSection names, section;
+    const char *name;
+
+    if (elf_get_section(elf, elf->names_index, &names))
+        return 0;
+
+    for (uint32_t i = 1 ; i < elf->sections_count ; i++) {
+        if (elf_get_section(elf, i, &section) ||
+            section.type != SHT_PROGBITS || section.name >= names.size)
+            continue;
+
+        name = (const char*) &elf->map[names.offset + section.name];
+
+        /* name must be terminated inside of the table */
+        if (!memchr(name, 0, names.size - section.name))
+            continue;
+
+        if (!strcmp(name, ".text")) {
+            *text = section;
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* function symbols of .symtab and .dynsym as offsets in .text */
+static uint32_t elf_collect_symbols(ElfFile *elf, uint32_t text_index,
+                                    ElfSection *text, int relative,
+                                    uint32_t *entries, uint32_t max_count)
+{
+    ElfSection section;
+    uint64_t value, symbol_size;
+    uint32_t count = 0, type, section_index;
+    uint8_t *symbol;
+
+    for (uint32_t i = 1 ; i < elf->sections_count ; i++) {
+        if (elf_get_section(elf, i, &section) ||
+            (section.type != SHT_SYMTAB && section.type != SHT_DYNSYM))
+            continue;
+
+        symbol_size = elf->is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+        if (section.entry_size && section.entry_size != symbol_size)
+            continue;
+
+        for (uint64_t k = 1 ; k < section.size / symbol_size ; k++) {
+            symbol = &elf->map[section.offset + k * symbol_size];
+
+            if (elf->is64) {
+                type = ELF64_ST_TYPE(((Elf64_Sym*) symbol)->st_info);
+                section_index = ((Elf64_Sym*) symbol)->st_shndx;
+                value = ((Elf64_Sym*) symbol)->st_value;
+            } else {
+                type = ELF32_ST_TYPE(((Elf32_Sym*) symbol)->st_info);
+                section_index = ((Elf32_Sym*) symbol)->st_shndx;
+                value = ((Elf32_Sym*) symbol)->st_value;
+            }
+
+            if (type != STT_FUNC || section_index != text_index)
+                continue;
+
+            /* values of relocatable objects are section offsets */
+            if (!relative) {
+                if (value < text->address)
+                    continue;
+
+                value -= text->address;
+            }
+
+            if (value < text->size && count < max_count)
+                entries[count++] = (uint32_t) value;
+        }
+    }
+
+    return count;
+}
+
+int elf_load(const char *file_name, elf_image *image)
+{
+    ElfFile elf;
+    ElfSection text;
+    struct stat st;
+    uint32_t text_index, count, *entries, unique, from, type, machine;
+    uint64_t entry;
+    int fd;
+
+    memset(&elf, 0, sizeof(elf));
+
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(Elf32_Ehdr)) {
+        close(fd);
+        return -1;
+    }
+
+    elf.size = (size_t) st.st_size;
+    elf.map = (uint8_t*) mmap(NULL, elf.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (elf.map == MAP_FAILED)
+        return -1;
+
+    if (memcmp(elf.map, ELFMAG, SELFMAG) ||
+        (elf.map[EI_CLASS] != ELFCLASS32 && elf.map[EI_CLASS] != ELFCLASS64) ||
+        elf.map[EI_DATA] != ELFDATA2LSB)
+        goto error;
+
+    elf.is64 = elf.map[EI_CLASS] == ELFCLASS64;
+
+    if (elf.is64) {
+        Elf64_Ehdr *ehdr = (Elf64_Ehdr*) elf.map;
+
+        if (elf.size < sizeof(Elf64_Ehdr) ||
+            ehdr->e_shentsize != sizeof(Elf64_Shdr))
+            goto error;
+
+        elf.sections_offset = ehdr->e_shoff;
+        elf.sections_count = ehdr->e_shnum;
+        elf.names_index = ehdr->e_shstrndx;
+        elf.section_size = ehdr->e_shentsize;
+        machine = ehdr->e_machine;
+        type = ehdr->e_type;
+        entry = ehdr->e_entry;
+    } else {
+        Elf32_Ehdr *ehdr = (Elf32_Ehdr*) elf.map;
+
+        if (ehdr->e_shentsize != sizeof(Elf32_Shdr))
+            goto error;
+
+        elf.sections_offset = ehdr->e_shoff;
+        elf.sections_count = ehdr->e_shnum;
+        elf.names_index = ehdr->e_shstrndx;
+        elf.section_size = ehdr->e_shentsize;
+        machine = ehdr->e_machine;
+        type = ehdr->e_type;
+        entry = ehdr->e_entry;
+    }
+
+    text_index = elf_find_text(&elf, &text);
+    if (!text_index || text.size == 0 || text.size > UINT32_MAX)
+        goto error;
+
+    /* program entry plus every symbol at most */
+    count = 0;
+    entries = (uint32_t*) malloc(sizeof(uint32_t) * (elf.size /
+                                 sizeof(Elf32_Sym) + 1));
+    if (!entries)
+        goto error;
+
+    if (type != ET_REL && entry >= text.address &&
+        entry - text.address < text.size)
+        entries[count++] = (uint32_t) (entry - text.address);
+
+    /* keep program entry first, symbols are sorted after it */
+    from = count;
+
+    count += elf_collect_symbols(&elf, text_index, &text, type == ET_REL,
+                                 &entries[count],
+                                 (uint32_t) (elf.size / sizeof(Elf32_Sym)));
+
+    qsort(&entries[from], count - from, sizeof(uint32_t), compare_offsets);
+
+    unique = from;
+    for (uint32_t i = from ; i < count ; i++) {
+        if (from && entries[i] == entries[0])
+            continue;
+
+        if (unique > from && entries[unique - 1] == entries[i])
+            continue;
+
+        entries[unique++] = entries[i];
+    }
+
+    image->map = elf.map;
+    image->map_size = elf.size;
+    image->machine = machine;
+    image->elf_class = elf.is64 ? ELFCLASS64 : ELFCLASS32;
+    image->text = &elf.map[text.offset];
+    image->text_size = (uint32_t) text.size;
+    image->text_address = text.address;
+    image->entries = entries;
+    image->entries_count = unique;
+    return 0;
+
+error:
+    munmap(elf.map, elf.size);
+    return -1;
+}
+
+void elf_unload(elf_image *image)
+{
+    if (image->map)
+        munmap(image->map, image->map_size);
+
+    free(image->entries);
+    memset(image, 0, sizeof(*image));
+}
@@ -0,0 +1,52 @@
+#if !defined(__ELF_LOADER_H__)
+#define __ELF_LOADER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* read-only view of an executable */
+typedef struct elf_image {
+    void *map;              /* whole file mapped by mmap(...) */
+    size_t map_size;
+
+    uint32_t elf_class;     /* ELFCLASS32 or ELFCLASS64 */
+    uint32_t machine;       /* EM_386, EM_X86_64, ... */
+
+    uint8_t *text;          /* .text section inside of map */
+    uint32_t text_size;
+    uint64_t text_address;  /* virtual address of .text */
+
+    uint32_t *entries;      /* offsets in .text, e_entry goes first */
+    uint32_t entries_count;
+} elf_image;
+
+/** Map ELF32 or ELF64 file and find .text and its entry points.
+ *
+ *  Entry points are the program entry and every function symbol of
+ *  .symtab and .dynsym which lies in .text, sorted without duplicates
+ *  after the program entry. Nothing is copied, image->text points inside
+ *  of the read-only mapping, so it may be given to cgp_init*(...) together
+ *  with CGP_ZERO_COPY.
+ *
+ *  @param file_name Path of executable or shared object
+ *  @param image Receives the view
+ *  @return 0 on success, -1 on error with image untouched
+ */
+int elf_load(const char *file_name, elf_image *image);
+
+/** Unmap a file of elf_load(...).
+ *
+ *  @param image Image from elf_load(...)
+ *  @return void
+ */
+void elf_unload(elf_image *image);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
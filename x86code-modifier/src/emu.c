@@ -0,0 +1,1019 @@
+#include <string.h>
+#include <stdint.h>
+#include "emu.h"
+
+/* jumps and NOPs in a row before emulation gives up */
+#define EMU_HANG_LIMIT      0x10000
+
+#define EMU_ARITH_FLAGS     (EMU_CF | EMU_PF | EMU_AF | EMU_ZF | EMU_SF | \
+                             EMU_OF)
+
+/* operations of 00-3F opcodes and of 80-83 group */
+enum emu_alu_ops {
+    ALU_ADD, ALU_OR, ALU_ADC, ALU_SBB, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP
+};
+
+typedef struct emu_modrm {
+    uint32_t reg;
+    uint32_t rm;
+    uint32_t memory;
+    uint32_t address;
+} EmuModrm;
+
+static const uint32_t emu_mask[5] = {0, 0xFF, 0xFFFF, 0, 0xFFFFFFFF};
+static const uint32_t emu_sign[5] = {0, 0x80, 0x8000, 0, 0x80000000};
+
+static int64_t emu_sext(uint64_t value, uint32_t size)
+{
+    uint32_t shift = 64 - size * 8;
+
+    return (int64_t) (value << shift) >> shift;
+}
+
+static uint32_t emu_imm(const uint8_t *p, uint32_t size)
+{
+    uint32_t value = 0;
+
+    memcpy(&value, p, size);
+    return value;
+}
+
+static uint8_t *emu_memory(emu_cpu *cpu, uint32_t address, uint32_t size,
+                           int write)
+{
+    emu_region *region;
+
+    for (uint32_t i = 0 ; i < cpu->regions_count ; i++) {
+        region = &cpu->regions[i];
+
+        if (address - region->base < region->size &&
+            region->size - (address - region->base) >= size) {
+            if (write && !region->writable)
+                break;
+
+            return &region->data[address - region->base];
+        }
+    }
+
+    /* code may be read as data */
+    if (!write && address - cpu->code_base < cpu->code_size &&
+        cpu->code_size - (address - cpu->code_base) >= size)
+        return (uint8_t*) &cpu->code[address - cpu->code_base];
+
+    cpu->status = EMU_FAULT;
+    return NULL;
+}
+
+static uint32_t emu_read(emu_cpu *cpu, uint32_t address, uint32_t size)
+{
+    uint8_t *p = emu_memory(cpu, address, size, 0);
+    uint32_t value = 0;
+
+    if (p)
+        memcpy(&value, p, size);
+
+    return value;
+}
+
+static void emu_write(emu_cpu *cpu, uint32_t address, uint32_t size,
+                      uint32_t value)
+{
+    uint8_t *p = emu_memory(cpu, address, size, 1);
+
+    if (p)
+        memcpy(p, &value, size);
+}
+
+static void emu_push(emu_cpu *cpu, uint32_t value)
+{
+    cpu->regs[EMU_ESP] -= 4;
+    emu_write(cpu, cpu->regs[EMU_ESP], 4, value);
+}
+
+static uint32_t emu_pop(emu_cpu *cpu)
+{
+    uint32_t value = emu_read(cpu, cpu->regs[EMU_ESP], 4);
+
+    cpu->regs[EMU_ESP] += 4;
+    return value;
+}
+
+/* byte registers 4-7 are AH, CH, DH and BH */
+static uint32_t emu_get_reg(emu_cpu *cpu, uint32_t reg, uint32_t size)
+{
+    if (size == 1)
+        return reg < 4 ? cpu->regs[reg] & 0xFF : cpu->regs[reg - 4] >> 8 & 0xFF;
+
+    return cpu->regs[reg] & emu_mask[size];
+}
+
+static void emu_set_reg(emu_cpu *cpu, uint32_t reg, uint32_t size,
+                        uint32_t value)
+{
+    switch (size) {
+        case 1:
+            if (reg < 4) {
+                cpu->regs[reg] = (cpu->regs[reg] & ~0xFFu) | (value & 0xFF);
+            } else {
+                cpu->regs[reg - 4] = (cpu->regs[reg - 4] & ~0xFF00u) |
+                                     (value & 0xFF) << 8;
+            }
+            break;
+
+        case 2:
+            cpu->regs[reg] = (cpu->regs[reg] & ~0xFFFFu) | (value & 0xFFFF);
+            break;
+
+        default:
+            cpu->regs[reg] = value;
+            break;
+    }
+}
+
+static const uint8_t *emu_modrm(emu_cpu *cpu, const uint8_t *p, EmuModrm *m)
+{
+    uint32_t mod = p[0] >> 6, sib, base;
+
+    m->reg = p[0] >> 3 & 7;
+    m->rm = p[0] & 7;
+    m->memory = mod != 3;
+    m->address = 0;
+    p++;
+
+    if (!m->memory)
+        return p;
+
+    if (m->rm == 4) {
+        sib = *p++;
+        base = sib & 7;
+
+        if ((sib >> 3 & 7) != 4)
+            m->address = cpu->regs[sib >> 3 & 7] << (sib >> 6);
+
+        if (base == 5 && !mod) {
+            m->address += emu_imm(p, 4);
+            p += 4;
+        } else {
+            m->address += cpu->regs[base];
+        }
+    } else if (m->rm == 5 && !mod) {
+        m->address = emu_imm(p, 4);
+        p += 4;
+    } else {
+        m->address = cpu->regs[m->rm];
+    }
+
+    if (mod == 1) {
+        m->address += (uint32_t) (int8_t) *p++;
+    } else if (mod == 2) {
+        m->address += emu_imm(p, 4);
+        p += 4;
+    }
+
+    return p;
+}
+
+static uint32_t emu_get_rm(emu_cpu *cpu, EmuModrm *m, uint32_t size)
+{
+    if (m->memory)
+        return emu_read(cpu, m->address, size);
+
+    return emu_get_reg(cpu, m->rm, size);
+}
+
+static void emu_set_rm(emu_cpu *cpu, EmuModrm *m, uint32_t size,
+                       uint32_t value)
+{
+    if (m->memory) {
+        emu_write(cpu, m->address, size, value);
+    } else {
+        emu_set_reg(cpu, m->rm, size, value);
+    }
+}
+
+/* SF, ZF and PF of result */
+static uint32_t emu_szp(uint32_t result, uint32_t size)
+{
+    uint32_t flags = 0, parity;
+
+    result &= emu_mask[size];
+
+    if (!result)
+        flags |= EMU_ZF;
+
+    if (result & emu_sign[size])
+        flags |= EMU_SF;
+
+    parity = result ^ result >> 4;
+    parity ^= parity >> 2;
+    parity ^= parity >> 1;
+
+    if (!(parity & 1))
+        flags |= EMU_PF;
+
+    return flags;
+}
+
+static void emu_set_flags(emu_cpu *cpu, uint32_t flags)
+{
+    cpu->flags = (cpu->flags & ~EMU_ARITH_FLAGS) | flags;
+}
+
+static uint32_t emu_alu(emu_cpu *cpu, uint32_t op, uint32_t a, uint32_t b,
+                        uint32_t size)
+{
+    uint32_t mask = emu_mask[size], sign = emu_sign[size];
+    uint32_t carry = 0, result, flags = 0;
+
+    a &= mask;
+    b &= mask;
+
+    switch (op) {
+        case ALU_ADC:
+            carry = cpu->flags & EMU_CF;
+            /* fall through */
+
+        case ALU_ADD:
+            result = a + b + carry;
+
+            if ((uint64_t) a + b + carry > mask)
+                flags |= EMU_CF;
+
+            if ((a ^ result) & (b ^ result) & sign)
+                flags |= EMU_OF;
+            break;
+
+        case ALU_SBB:
+            carry = cpu->flags & EMU_CF;
+            /* fall through */
+
+        case ALU_SUB:
+        case ALU_CMP:
+            result = a - b - carry;
+
+            if ((uint64_t) b + carry > a)
+                flags |= EMU_CF;
+
+            if ((a ^ b) & (a ^ result) & sign)
+                flags |= EMU_OF;
+            break;
+
+        case ALU_OR:
+            result = a | b;
+            break;
+
+        case ALU_AND:
+            result = a & b;
+            break;
+
+        default:
+            result = a ^ b;
+            break;
+    }
+
+    if (op != ALU_OR && op != ALU_AND && op != ALU_XOR &&
+        (a ^ b ^ result) & 0x10)
+        flags |= EMU_AF;
+
+    emu_set_flags(cpu, flags | emu_szp(result, size));
+    return result & mask;
+}
+
+/* INC and DEC keep CF */
+static uint32_t emu_incdec(emu_cpu *cpu, uint32_t value, uint32_t size,
+                           int decrement)
+{
+    uint32_t carry = cpu->flags & EMU_CF, result;
+
+    result = emu_alu(cpu, decrement ? ALU_SUB : ALU_ADD, value, 1, size);
+    cpu->flags = (cpu->flags & ~EMU_CF) | carry;
+
+    return result;
+}
+
+/* ROL, ROR, SHL, SHR and SAR, no RCL and RCR */
+static uint32_t emu_shift(emu_cpu *cpu, uint32_t op, uint32_t value,
+                          uint32_t count, uint32_t size)
+{
+    uint32_t bits = size * 8, mask = emu_mask[size], sign = emu_sign[size];
+    uint32_t result, flags, rotate;
+    uint64_t wide;
+
+    count &= 0x1F;
+    value &= mask;
+
+    if (!count)
+        return value;
+
+    switch (op) {
+        case 0:
+        case 1:
+            rotate = count % bits;
+            result = value;
+
+            if (rotate && op == 0) {
+                result = (value << rotate | value >> (bits - rotate)) & mask;
+            } else if (rotate) {
+                result = (value >> rotate | value << (bits - rotate)) & mask;
+            }
+
+            flags = cpu->flags & ~(EMU_CF | EMU_OF);
+
+            if (op == 0) {
+                flags |= result & 1 ? EMU_CF : 0;
+                flags |= (result & sign ? 1 : 0) ^ (result & 1) ? EMU_OF : 0;
+            } else {
+                flags |= result & sign ? EMU_CF : 0;
+                flags |= (result ^ result << 1) & sign ? EMU_OF : 0;
+            }
+
+            cpu->flags = flags;
+            return result;
+
+        case 4:
+        case 6:
+            wide = (uint64_t) value << count;
+            result = (uint32_t) wide & mask;
+            flags = wide >> bits & 1 ? EMU_CF : 0;
+
+            if ((result & sign ? 1 : 0) ^ (flags & EMU_CF))
+                flags |= EMU_OF;
+            break;
+
+        case 5:
+            result = value >> count;
+            flags = value >> (count - 1) & 1 ? EMU_CF : 0;
+
+            if (value & sign)
+                flags |= EMU_OF;
+            break;
+
+        case 7:
+            wide = (uint64_t) emu_sext(value, size);
+            result = (uint32_t) ((int64_t) wide >> count) & mask;
+            flags = (int64_t) wide >> (count - 1) & 1 ? EMU_CF : 0;
+            break;
+
+        default:
+            cpu->status = EMU_UNSUPPORTED;
+            return value;
+    }
+
+    emu_set_flags(cpu, flags | emu_szp(result, size));
+    return result;
+}
+
+/* IMUL with two or three operands */
+static uint32_t emu_imul(emu_cpu *cpu, uint32_t a, uint32_t b, uint32_t size)
+{
+    int64_t product = emu_sext(a, size) * emu_sext(b, size);
+    uint32_t result = (uint32_t) product & emu_mask[size];
+    uint32_t flags = emu_szp(result, size);
+
+    if (emu_sext(result, size) != product)
+        flags |= EMU_CF | EMU_OF;
+
+    emu_set_flags(cpu, flags);
+    return result;
+}
+
+/* MUL, IMUL, DIV and IDIV of AL, AX, DX:AX or EDX:EAX */
+static void emu_muldiv(emu_cpu *cpu, uint32_t op, uint32_t src, uint32_t size)
+{
+    uint32_t bits = size * 8, mask = emu_mask[size];
+    uint64_t dividend, quotient, remainder;
+    int64_t product, sdividend, sdivisor, squotient;
+
+    if (op == 4 || op == 5) {
+        if (op == 4) {
+            product = (int64_t) ((uint64_t) emu_get_reg(cpu, EMU_EAX, size) *
+                                 (src & mask));
+        } else {
+            product = emu_sext(emu_get_reg(cpu, EMU_EAX, size), size) *
+                      emu_sext(src, size);
+        }
+
+        if (size == 1) {
+            emu_set_reg(cpu, EMU_EAX, 2, (uint32_t) product);
+        } else {
+            emu_set_reg(cpu, EMU_EAX, size, (uint32_t) product);
+            emu_set_reg(cpu, EMU_EDX, size, (uint32_t) (product >> bits));
+        }
+
+        if (op == 4 ? (uint64_t) product >> bits != 0
+                    : emu_sext((uint64_t) product & mask, size) != product) {
+            cpu->flags |= EMU_CF | EMU_OF;
+        } else {
+            cpu->flags &= ~(EMU_CF | EMU_OF);
+        }
+        return;
+    }
+
+    if (size == 1) {
+        dividend = emu_get_reg(cpu, EMU_EAX, 2);
+    } else {
+        dividend = (uint64_t) emu_get_reg(cpu, EMU_EDX, size) << bits |
+                   emu_get_reg(cpu, EMU_EAX, size);
+    }
+
+    src &= mask;
+
+    if (!src) {
+        cpu->status = EMU_DIVIDE;
+        return;
+    }
+
+    if (op == 6) {
+        quotient = dividend / src;
+        remainder = dividend % src;
+
+        if (quotient > mask) {
+            cpu->status = EMU_DIVIDE;
+            return;
+        }
+    } else {
+        sdividend = emu_sext(dividend, size * 2);
+        sdivisor = emu_sext(src, size);
+
+        if (sdivisor == -1 && sdividend == INT64_MIN) {
+            cpu->status = EMU_DIVIDE;
+            return;
+        }
+
+        squotient = sdividend / sdivisor;
+        quotient = (uint64_t) squotient;
+        remainder = (uint64_t) (sdividend % sdivisor);
+
+        if (emu_sext(quotient & mask, size) != squotient) {
+            cpu->status = EMU_DIVIDE;
+            return;
+        }
+    }
+
+    if (size == 1) {
+        emu_set_reg(cpu, EMU_EAX, 1, (uint32_t) quotient);
+        emu_set_reg(cpu, 4, 1, (uint32_t) remainder);
+    } else {
+        emu_set_reg(cpu, EMU_EAX, size, (uint32_t) quotient);
+        emu_set_reg(cpu, EMU_EDX, size, (uint32_t) remainder);
+    }
+}
+
+static int emu_condition(uint32_t flags, uint32_t cc)
+{
+    int result;
+
+    switch (cc >> 1) {
+        case 0: result = (flags & EMU_OF) != 0; break;
+        case 1: result = (flags & EMU_CF) != 0; break;
+        case 2: result = (flags & EMU_ZF) != 0; break;
+        case 3: result = (flags & (EMU_CF | EMU_ZF)) != 0; break;
+        case 4: result = (flags & EMU_SF) != 0; break;
+        case 5: result = (flags & EMU_PF) != 0; break;
+        case 6: result = !(flags & EMU_SF) != !(flags & EMU_OF); break;
+        default:
+            result = (flags & EMU_ZF) || !(flags & EMU_SF) != !(flags & EMU_OF);
+            break;
+    }
+
+    return cc & 1 ? !result : result;
+}
+
+/* 0F xx opcodes, p points after 0F */
+static const uint8_t *emu_step_0f(emu_cpu *cpu, const uint8_t *p,
+                                  uint32_t size, uint32_t *rel, int *branch,
+                                  int *counted)
+{
+    uint32_t op = *p++, value;
+    EmuModrm m;
+
+    if (op == 0x1F) {
+        *counted = 0;
+        return emu_modrm(cpu, p, &m);
+    }
+
+    if (op >= 0x80 && op <= 0x8F) {
+        if (size != 4) {
+            cpu->status = EMU_UNSUPPORTED;
+            return p;
+        }
+
+        *rel = emu_imm(p, 4);
+        *branch = emu_condition(cpu->flags, op & 0xF);
+        return p + 4;
+    }
+
+    if (op >= 0xC8 && op <= 0xCF) {
+        value = cpu->regs[op & 7];
+        cpu->regs[op & 7] = value >> 24 | (value >> 8 & 0xFF00) |
+                            (value << 8 & 0xFF0000) | value << 24;
+        return p;
+    }
+
+    p = emu_modrm(cpu, p, &m);
+
+    if (op >= 0x40 && op <= 0x4F) {
+        value = emu_get_rm(cpu, &m, size);
+
+        if (emu_condition(cpu->flags, op & 0xF))
+            emu_set_reg(cpu, m.reg, size, value);
+
+        return p;
+    }
+
+    if (op >= 0x90 && op <= 0x9F) {
+        emu_set_rm(cpu, &m, 1, emu_condition(cpu->flags, op & 0xF));
+        return p;
+    }
+
+    switch (op) {
+        case 0xAF:
+            value = emu_imul(cpu, emu_get_reg(cpu, m.reg, size),
+                             emu_get_rm(cpu, &m, size), size);
+            emu_set_reg(cpu, m.reg, size, value);
+            break;
+
+        case 0xB6:
+        case 0xB7:
+            value = emu_get_rm(cpu, &m, op == 0xB6 ? 1 : 2);
+            emu_set_reg(cpu, m.reg, size, value);
+            break;
+
+        case 0xBE:
+        case 0xBF:
+            value = (uint32_t) emu_sext(emu_get_rm(cpu, &m, op == 0xBE ? 1 : 2),
+                                        op == 0xBE ? 1 : 2);
+            emu_set_reg(cpu, m.reg, size, value);
+            break;
+
+        default:
+            cpu->status = EMU_UNSUPPORTED;
+            break;
+    }
+
+    return p;
+}
+
+/* executes one instruction, returns 0 for jumps and NOPs */
+static int emu_step(emu_cpu *cpu)
+{
+    const uint8_t *start = &cpu->code[cpu->eip - cpu->code_base], *p = start;
+    uint32_t size = 4, width, op, value, rel = 0, target = 0, next;
+    int counted = 1, branch = 0;
+    EmuModrm m;
+
+    /* segments are flat, LOCK and branch hints don't matter */
+    while (*p == 0x66 || *p == 0xF0 || *p == 0x26 || *p == 0x2E ||
+           *p == 0x36 || *p == 0x3E || (*p == 0xF3 && p[1] == 0xC3)) {
+        if (*p == 0x66)
+            size = 2;
+
+        if (++p - start >= EMU_CODE_PADDING) {
+            cpu->status = EMU_UNSUPPORTED;
+            return 0;
+        }
+    }
+
+    op = *p++;
+
+    /* add, or, adc, sbb, and, sub, xor and cmp */
+    if (op < 0x40 && (op & 7) < 6) {
+        width = op & 1 ? size : 1;
+
+        if ((op & 7) < 4) {
+            p = emu_modrm(cpu, p, &m);
+
+            if (op & 2) {
+                value = emu_alu(cpu, op >> 3, emu_get_reg(cpu, m.reg, width),
+                                emu_get_rm(cpu, &m, width), width);
+                if (op >> 3 != ALU_CMP)
+                    emu_set_reg(cpu, m.reg, width, value);
+            } else {
+                value = emu_alu(cpu, op >> 3, emu_get_rm(cpu, &m, width),
+                                emu_get_reg(cpu, m.reg, width), width);
+                if (op >> 3 != ALU_CMP)
+                    emu_set_rm(cpu, &m, width, value);
+            }
+        } else {
+            value = emu_alu(cpu, op >> 3, emu_get_reg(cpu, EMU_EAX, width),
+                            emu_imm(p, width), width);
+            p += width;
+
+            if (op >> 3 != ALU_CMP)
+                emu_set_reg(cpu, EMU_EAX, width, value);
+        }
+
+        goto done;
+    }
+
+    if (op == 0x0F) {
+        p = emu_step_0f(cpu, p, size, &rel, &branch, &counted);
+        goto done;
+    }
+
+    switch (op) {
+        case 0x40: case 0x41: case 0x42: case 0x43:
+        case 0x44: case 0x45: case 0x46: case 0x47:
+        case 0x48: case 0x49: case 0x4A: case 0x4B:
+        case 0x4C: case 0x4D: case 0x4E: case 0x4F:
+            value = emu_incdec(cpu, emu_get_reg(cpu, op & 7, size), size,
+                               op >= 0x48);
+            emu_set_reg(cpu, op & 7, size, value);
+            break;
+
+        case 0x50: case 0x51: case 0x52: case 0x53:
+        case 0x54: case 0x55: case 0x56: case 0x57:
+            if (size != 4)
+                goto unsupported;
+
+            emu_push(cpu, cpu->regs[op & 7]);
+            break;
+
+        case 0x58: case 0x59: case 0x5A: case 0x5B:
+        case 0x5C: case 0x5D: case 0x5E: case 0x5F:
+            if (size != 4)
+                goto unsupported;
+
+            value = emu_pop(cpu);
+            cpu->regs[op & 7] = value;
+            break;
+
+        case 0x68:
+        case 0x6A:
+            if (size != 4)
+                goto unsupported;
+
+            if (op == 0x68) {
+                value = emu_imm(p, 4);
+                p += 4;
+            } else {
+                value = (uint32_t) (int8_t) *p++;
+            }
+
+            emu_push(cpu, value);
+            break;
+
+        case 0x69:
+        case 0x6B:
+            p = emu_modrm(cpu, p, &m);
+
+            if (op == 0x69) {
+                value = emu_imm(p, size);
+                p += size;
+            } else {
+                value = (uint32_t) (int8_t) *p++;
+            }
+
+            value = emu_imul(cpu, emu_get_rm(cpu, &m, size), value, size);
+            emu_set_reg(cpu, m.reg, size, value);
+            break;
+
+        case 0x70: case 0x71: case 0x72: case 0x73:
+        case 0x74: case 0x75: case 0x76: case 0x77:
+        case 0x78: case 0x79: case 0x7A: case 0x7B:
+        case 0x7C: case 0x7D: case 0x7E: case 0x7F:
+            rel = (uint32_t) (int8_t) *p++;
+            branch = emu_condition(cpu->flags, op & 0xF);
+            break;
+
+        case 0x80:
+        case 0x81:
+        case 0x82:
+        case 0x83:
+            width = op == 0x81 || op == 0x83 ? size : 1;
+            p = emu_modrm(cpu, p, &m);
+
+            if (op == 0x81) {
+                value = emu_imm(p, width);
+                p += width;
+            } else {
+                value = (uint32_t) (int8_t) *p++;
+            }
+
+            value = emu_alu(cpu, m.reg, emu_get_rm(cpu, &m, width), value,
+                            width);
+            if (m.reg != ALU_CMP)
+                emu_set_rm(cpu, &m, width, value);
+            break;
+
+        case 0x84:
+        case 0x85:
+            width = op & 1 ? size : 1;
+            p = emu_modrm(cpu, p, &m);
+            emu_alu(cpu, ALU_AND, emu_get_rm(cpu, &m, width),
+                    emu_get_reg(cpu, m.reg, width), width);
+            break;
+
+        case 0x86:
+        case 0x87:
+            width = op & 1 ? size : 1;
+            p = emu_modrm(cpu, p, &m);
+            value = emu_get_rm(cpu, &m, width);
+            emu_set_rm(cpu, &m, width, emu_get_reg(cpu, m.reg, width));
+            emu_set_reg(cpu, m.reg, width, value);
+            break;
+
+        case 0x88:
+        case 0x89:
+            width = op & 1 ? size : 1;
+            p = emu_modrm(cpu, p, &m);
+            emu_set_rm(cpu, &m, width, emu_get_reg(cpu, m.reg, width));
+            break;
+
+        case 0x8A:
+        case 0x8B:
+            width = op & 1 ? size : 1;
+            p = emu_modrm(cpu, p, &m);
+            emu_set_reg(cpu, m.reg, width, emu_get_rm(cpu, &m, width));
+            break;
+
+        case 0x8D:
+            p = emu_modrm(cpu, p, &m);
+            if (!m.memory)
+                goto unsupported;
+
+            emu_set_reg(cpu, m.reg, size, m.address);
+            break;
+
+        case 0x8F:
+            /* address is taken after ESP is incremented */
+            value = emu_pop(cpu);
+            p = emu_modrm(cpu, p, &m);
+            if (m.reg)
+                goto unsupported;
+
+            emu_set_rm(cpu, &m, size, value);
+            break;
+
+        case 0x90:
+            counted = 0;
+            break;
+
+        case 0x91: case 0x92: case 0x93:
+        case 0x94: case 0x95: case 0x96: case 0x97:
+            value = emu_get_reg(cpu, op & 7, size);
+            emu_set_reg(cpu, op & 7, size, emu_get_reg(cpu, EMU_EAX, size));
+            emu_set_reg(cpu, EMU_EAX, size, value);
+            break;
+
+        case 0x98:
+            value = (uint32_t) emu_sext(emu_get_reg(cpu, EMU_EAX, size / 2),
+                                        size / 2);
+            emu_set_reg(cpu, EMU_EAX, size, value);
+            break;
+
+        case 0x99:
+            value = emu_get_reg(cpu, EMU_EAX, size) & emu_sign[size] ? ~0u : 0;
+            emu_set_reg(cpu, EMU_EDX, size, value);
+            break;
+
+        case 0x9C:
+            if (size != 4)
+                goto unsupported;
+
+            emu_push(cpu, cpu->flags | 2);
+            break;
+
+        case 0x9D:
+            if (size != 4)
+                goto unsupported;
+
+            cpu->flags = emu_pop(cpu) & (EMU_ARITH_FLAGS | EMU_DF);
+            break;
+
+        case 0xA8:
+        case 0xA9:
+            width = op & 1 ? size : 1;
+            emu_alu(cpu, ALU_AND, emu_get_reg(cpu, EMU_EAX, width),
+                    emu_imm(p, width), width);
+            p += width;
+            break;
+
+        case 0xB0: case 0xB1: case 0xB2: case 0xB3:
+        case 0xB4: case 0xB5: case 0xB6: case 0xB7:
+            emu_set_reg(cpu, op & 7, 1, *p++);
+            break;
+
+        case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+        case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+            emu_set_reg(cpu, op & 7, size, emu_imm(p, size));
+            p += size;
+            break;
+
+        case 0xC0:
+        case 0xC1:
+        case 0xD0:
+        case 0xD1:
+        case 0xD2:
+        case 0xD3:
+            width = op & 1 ? size : 1;
+            p = emu_modrm(cpu, p, &m);
+
+            if (op < 0xD0) {
+                value = *p++;
+            } else {
+                value = op < 0xD2 ? 1 : cpu->regs[EMU_ECX] & 0xFF;
+            }
+
+            value = emu_shift(cpu, m.reg, emu_get_rm(cpu, &m, width), value,
+                              width);
+            emu_set_rm(cpu, &m, width, value);
+            break;
+
+        case 0xC2:
+        case 0xC3:
+            target = emu_pop(cpu);
+
+            if (op == 0xC2) {
+                cpu->regs[EMU_ESP] += emu_imm(p, 2);
+                p += 2;
+            }
+
+            branch = 2;
+            break;
+
+        case 0xC6:
+        case 0xC7:
+            width = op & 1 ? size : 1;
+            p = emu_modrm(cpu, p, &m);
+            if (m.reg)
+                goto unsupported;
+
+            emu_set_rm(cpu, &m, width, emu_imm(p, width));
+            p += width;
+            break;
+
+        case 0xC9:
+            cpu->regs[EMU_ESP] = cpu->regs[EMU_EBP];
+            cpu->regs[EMU_EBP] = emu_pop(cpu);
+            break;
+
+        case 0xE8:
+        case 0xE9:
+        case 0xEB:
+            if (op == 0xEB) {
+                rel = (uint32_t) (int8_t) *p++;
+            } else if (size == 4) {
+                rel = emu_imm(p, 4);
+                p += 4;
+            } else {
+                goto unsupported;
+            }
+
+            if (op == 0xE8) {
+                emu_push(cpu, cpu->code_base + (uint32_t) (p - cpu->code));
+            } else {
+                counted = 0;
+            }
+
+            branch = 1;
+            break;
+
+        case 0xF5:
+            cpu->flags ^= EMU_CF;
+            break;
+
+        case 0xF8:
+        case 0xF9:
+            cpu->flags = (cpu->flags & ~EMU_CF) | (op & 1 ? EMU_CF : 0);
+            break;
+
+        case 0xFC:
+        case 0xFD:
+            cpu->flags = (cpu->flags & ~EMU_DF) | (op & 1 ? EMU_DF : 0);
+            break;
+
+        case 0xF6:
+        case 0xF7:
+            width = op & 1 ? size : 1;
+            p = emu_modrm(cpu, p, &m);
+
+            switch (m.reg) {
+                case 0:
+                case 1:
+                    emu_alu(cpu, ALU_AND, emu_get_rm(cpu, &m, width),
+                            emu_imm(p, width), width);
+                    p += width;
+                    break;
+
+                case 2:
+                    emu_set_rm(cpu, &m, width, ~emu_get_rm(cpu, &m, width));
+                    break;
+
+                case 3:
+                    emu_set_rm(cpu, &m, width, emu_alu(cpu, ALU_SUB, 0,
+                               emu_get_rm(cpu, &m, width), width));
+                    break;
+
+                default:
+                    emu_muldiv(cpu, m.reg, emu_get_rm(cpu, &m, width), width);
+                    break;
+            }
+            break;
+
+        case 0xFE:
+        case 0xFF:
+            width = op & 1 ? size : 1;
+            p = emu_modrm(cpu, p, &m);
+
+            switch (m.reg) {
+                case 0:
+                case 1:
+                    value = emu_incdec(cpu, emu_get_rm(cpu, &m, width), width,
+                                       m.reg);
+                    emu_set_rm(cpu, &m, width, value);
+                    break;
+
+                case 2:
+                case 4:
+                    if (op == 0xFE || size != 4)
+                        goto unsupported;
+
+                    target = emu_get_rm(cpu, &m, 4);
+
+                    if (m.reg == 2) {
+                        emu_push(cpu, cpu->code_base +
+                                      (uint32_t) (p - cpu->code));
+                    } else {
+                        counted = 0;
+                    }
+
+                    branch = 2;
+                    break;
+
+                case 6:
+                    if (op == 0xFE || size != 4)
+                        goto unsupported;
+
+                    emu_push(cpu, emu_get_rm(cpu, &m, 4));
+                    break;
+
+                default:
+                    goto unsupported;
+            }
+            break;
+
+        default:
+            goto unsupported;
+    }
+
+done:
+    next = cpu->code_base + (uint32_t) (p - cpu->code);
+
+    if (next - cpu->code_base > cpu->code_size) {
+        cpu->status = EMU_FAULT;
+        return counted;
+    }
+
+    if (cpu->status != EMU_RUNNING)
+        return counted;
+
+    /* relative branches are taken from the next instruction */
+    if (branch == 2) {
+        cpu->eip = target;
+    } else if (branch) {
+        cpu->eip = next + rel;
+    } else {
+        cpu->eip = next;
+    }
+
+    return counted;
+
+unsupported:
+    cpu->status = EMU_UNSUPPORTED;
+    return counted;
+}
+
+uint32_t emu_run(emu_cpu *cpu, uint32_t max_steps)
+{
+    uint32_t idle = 0;
+
+    cpu->status = EMU_RUNNING;
+    cpu->steps = 0;
+
+    while (cpu->status == EMU_RUNNING) {
+        if (cpu->eip == EMU_EXIT_ADDRESS) {
+            cpu->status = EMU_EXIT;
+            break;
+        }
+
+        if (cpu->eip - cpu->code_base >= cpu->code_size) {
+            cpu->status = EMU_FAULT;
+            break;
+        }
+
+        if (cpu->steps >= max_steps) {
+            cpu->status = EMU_LIMIT;
+            break;
+        }
+
+        if (emu_step(cpu)) {
+            cpu->steps++;
+            idle = 0;
+        } else if (++idle > EMU_HANG_LIMIT) {
+            cpu->status = EMU_HANG;
+        }
+    }
+
+    return cpu->status;
+}
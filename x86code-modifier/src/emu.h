@@ -0,0 +1,85 @@
+#if !defined(__EMU_H__)
+#define __EMU_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* zero bytes which must follow code, so an instruction is never cut */
+#define EMU_CODE_PADDING    16
+
+/* RET to this address stops execution */
+#define EMU_EXIT_ADDRESS    0xFFFFF000
+
+#define EMU_REGIONS         4
+
+enum emu_registers {
+    EMU_EAX, EMU_ECX, EMU_EDX, EMU_EBX, EMU_ESP, EMU_EBP, EMU_ESI, EMU_EDI
+};
+
+enum emu_flags {
+    EMU_CF = 0x001,
+    EMU_PF = 0x004,
+    EMU_AF = 0x010,
+    EMU_ZF = 0x040,
+    EMU_SF = 0x080,
+    EMU_DF = 0x400,
+    EMU_OF = 0x800
+};
+
+/* why emu_run(...) has stopped */
+enum emu_status {
+    EMU_RUNNING,
+    EMU_EXIT,           /* returned to EMU_EXIT_ADDRESS */
+    EMU_LIMIT,          /* max_steps instructions executed */
+    EMU_HANG,           /* too many jumps and NOPs in a row */
+    EMU_FAULT,          /* access out of regions or jump out of code */
+    EMU_DIVIDE,         /* division by zero or overflow */
+    EMU_UNSUPPORTED     /* instruction out of emulated subset */
+};
+
+/* flat memory of 32 bits address space */
+typedef struct emu_region {
+    uint32_t base;
+    uint32_t size;
+    uint8_t *data;
+    uint32_t writable;
+} emu_region;
+
+typedef struct emu_cpu {
+    uint32_t regs[8];
+    uint32_t eip;
+    uint32_t flags;
+    uint32_t steps;     /* executed instructions except JMP and NOP */
+    uint32_t status;
+
+    /* read only, followed by EMU_CODE_PADDING bytes */
+    uint32_t code_base;
+    uint32_t code_size;
+    const uint8_t *code;
+
+    uint32_t regions_count;
+    emu_region regions[EMU_REGIONS];
+} emu_cpu;
+
+/** Execute code until exit, fault or limit.
+ *
+ *  Emulates integer x86-32 instructions of flat code: ALU, shifts, MUL/DIV,
+ *  MOV/MOVZX/MOVSX/LEA, stack, CMOVcc/SETcc and all direct and indirect
+ *  branches. String, segment, FPU and vector instructions stop emulation
+ *  with EMU_UNSUPPORTED. JMP and the NOP forms aren't counted as steps, so
+ *  two versions of the same code stop at the same point of computation.
+ *
+ *  @param cpu State to start from, receives the final state
+ *  @param max_steps Most instructions to execute
+ *  @return EMU_* status, also stored to cpu->status
+ */
+uint32_t emu_run(emu_cpu *cpu, uint32_t max_steps);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
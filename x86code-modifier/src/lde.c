@@ -1,4 +1,8 @@
 /* Disassembler Lenght by x64 */
+#include <string.h>
+#include "lde.h"
+#include "lde_tables.h"
+
 #define C_66        0x00000001  // 66-prefix
 #define C_67        0x00000002  // 67-prefix
 #define C_LOCK      0x00000004  // lock
@@ -18,7 +22,7 @@ typedef unsigned short int word, WORD, *PWORD;
 typedef unsigned int dword, DWORD, *PDWORD;
 typedef int BOOL;
 
-BOOL GetInstructionSize(PBYTE pOpCode, PDWORD pdwInstructionSize)
+int GetInstructionSize(uint8_t *pOpCode, uint32_t *pdwInstructionSize)
 {
     PBYTE    opcode = pOpCode;
     DWORD    i = 0;
@@ -230,6 +234,7 @@ RETRY:
             switch (disasm_opcode2)
             {
                 case 0x00: case 0x01: case 0x02: case 0x03:
+                case 0x1F:
                 case 0x90: case 0x91: case 0x92: case 0x93:
                 case 0x94: case 0x95: case 0x96: case 0x97:
                 case 0x98: case 0x99: case 0x9A: case 0x9B:
@@ -337,3 +342,414 @@ RETRY:
 
     return true;
 }
+
+/* Table driven decoder, flags are described in lde_tables.h */
+#define __  0
+#define M_  T_MODRM
+#define I1  T_DATA1
+#define I2  T_DATA2
+#define IV  T_DATA66
+#define AV  T_MEM67
+#define P_  T_PREFIX
+#define X_  T_SPECIAL
+#define E_  T_ERROR
+#define O_  T_OPCODE2
+#define MB  (T_MODRM | T_DATA1)
+#define MV  (T_MODRM | T_DATA66)
+#define FV  (T_DATA2 | T_DATA66)                // far pointer
+#define EN  (T_DATA1 | T_DATA2)                 // enter
+#define JB  (T_DATA1 | T_KIND(LDE_KIND_JCC))
+#define JV  (T_DATA66 | T_KIND(LDE_KIND_JCC))
+#define JS  (T_DATA1 | T_KIND(LDE_KIND_JMP))
+#define JN  (T_DATA66 | T_KIND(LDE_KIND_JMP))
+#define CN  (T_DATA66 | T_KIND(LDE_KIND_CALL))
+#define R_  T_KIND(LDE_KIND_RET)
+#define RW  (T_DATA2 | T_KIND(LDE_KIND_RET))
+
+const uint16_t lde_table_1[256] = {
+    /* 0_ */ M_,M_,M_,M_,I1,IV,__,__,M_,M_,M_,M_,I1,IV,__,O_,
+    /* 1_ */ M_,M_,M_,M_,I1,IV,__,__,M_,M_,M_,M_,I1,IV,__,__,
+    /* 2_ */ M_,M_,M_,M_,I1,IV,P_,__,M_,M_,M_,M_,I1,IV,P_,__,
+    /* 3_ */ M_,M_,M_,M_,I1,IV,P_,__,M_,M_,M_,M_,I1,IV,P_,__,
+    /* 4_ */ __,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+    /* 5_ */ __,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,
+    /* 6_ */ __,__,M_,M_,P_,P_,P_,P_,IV,MV,I1,MB,__,__,__,__,
+    /* 7_ */ JB,JB,JB,JB,JB,JB,JB,JB,JB,JB,JB,JB,JB,JB,JB,JB,
+    /* 8_ */ MB,MV,MB,MB,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,
+    /* 9_ */ __,__,__,__,__,__,__,__,__,__,FV,__,__,__,__,__,
+    /* A_ */ AV,AV,AV,AV,__,__,__,__,I1,IV,__,__,__,__,__,__,
+    /* B_ */ I1,I1,I1,I1,I1,I1,I1,I1,IV,IV,IV,IV,IV,IV,IV,IV,
+    /* C_ */ MB,MB,RW,R_,M_,M_,MB,MV,EN,__,I2,__,__,X_,__,__,
+    /* D_ */ M_,M_,M_,M_,I1,I1,__,__,M_,M_,M_,M_,M_,M_,M_,M_,
+    /* E_ */ JB,JB,JB,JB,I1,I1,I1,I1,CN,JN,FV,JS,__,__,__,__,
+    /* F_ */ P_,E_,P_,P_,__,__,X_,X_,__,__,__,__,__,__,M_,M_,
+};
+
+const uint16_t lde_table_2[256] = {
+    /* 0_ */ M_,M_,M_,M_,E_,E_,__,E_,__,__,__,__,E_,E_,E_,E_,
+    /* 1_ */ E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,M_,
+    /* 2_ */ E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,
+    /* 3_ */ E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,
+    /* 4_ */ E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,
+    /* 5_ */ E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,
+    /* 6_ */ E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,
+    /* 7_ */ E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,
+    /* 8_ */ JV,JV,JV,JV,JV,JV,JV,JV,JV,JV,JV,JV,JV,JV,JV,JV,
+    /* 9_ */ M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,
+    /* A_ */ __,__,__,M_,MB,M_,E_,E_,__,__,__,M_,MB,M_,E_,M_,
+    /* B_ */ M_,M_,M_,M_,M_,M_,M_,M_,E_,E_,MB,M_,M_,M_,M_,M_,
+    /* C_ */ M_,M_,E_,E_,E_,E_,E_,E_,__,__,__,__,__,__,__,__,
+    /* D_ */ E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,
+    /* E_ */ E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,
+    /* F_ */ E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,E_,
+};
+
+#undef __
+#undef M_
+#undef I1
+#undef I2
+#undef IV
+#undef AV
+#undef P_
+#undef X_
+#undef E_
+#undef O_
+#undef MB
+#undef MV
+#undef FV
+#undef EN
+#undef JB
+#undef JV
+#undef JS
+#undef JN
+#undef CN
+#undef R_
+#undef RW
+
+/* low nibble is size of modrm, sib and displacement,
+   0x10 - sib present, base 5 brings disp32 when mod is 0 */
+static const uint8_t lde_modrm_32[256] = {
+    /* 00 */ 0x01, 0x01, 0x01, 0x01, 0x12, 0x05, 0x01, 0x01,
+    /* 08 */ 0x01, 0x01, 0x01, 0x01, 0x12, 0x05, 0x01, 0x01,
+    /* 10 */ 0x01, 0x01, 0x01, 0x01, 0x12, 0x05, 0x01, 0x01,
+    /* 18 */ 0x01, 0x01, 0x01, 0x01, 0x12, 0x05, 0x01, 0x01,
+    /* 20 */ 0x01, 0x01, 0x01, 0x01, 0x12, 0x05, 0x01, 0x01,
+    /* 28 */ 0x01, 0x01, 0x01, 0x01, 0x12, 0x05, 0x01, 0x01,
+    /* 30 */ 0x01, 0x01, 0x01, 0x01, 0x12, 0x05, 0x01, 0x01,
+    /* 38 */ 0x01, 0x01, 0x01, 0x01, 0x12, 0x05, 0x01, 0x01,
+    /* 40 */ 0x02, 0x02, 0x02, 0x02, 0x03, 0x02, 0x02, 0x02,
+    /* 48 */ 0x02, 0x02, 0x02, 0x02, 0x03, 0x02, 0x02, 0x02,
+    /* 50 */ 0x02, 0x02, 0x02, 0x02, 0x03, 0x02, 0x02, 0x02,
+    /* 58 */ 0x02, 0x02, 0x02, 0x02, 0x03, 0x02, 0x02, 0x02,
+    /* 60 */ 0x02, 0x02, 0x02, 0x02, 0x03, 0x02, 0x02, 0x02,
+    /* 68 */ 0x02, 0x02, 0x02, 0x02, 0x03, 0x02, 0x02, 0x02,
+    /* 70 */ 0x02, 0x02, 0x02, 0x02, 0x03, 0x02, 0x02, 0x02,
+    /* 78 */ 0x02, 0x02, 0x02, 0x02, 0x03, 0x02, 0x02, 0x02,
+    /* 80 */ 0x05, 0x05, 0x05, 0x05, 0x06, 0x05, 0x05, 0x05,
+    /* 88 */ 0x05, 0x05, 0x05, 0x05, 0x06, 0x05, 0x05, 0x05,
+    /* 90 */ 0x05, 0x05, 0x05, 0x05, 0x06, 0x05, 0x05, 0x05,
+    /* 98 */ 0x05, 0x05, 0x05, 0x05, 0x06, 0x05, 0x05, 0x05,
+    /* A0 */ 0x05, 0x05, 0x05, 0x05, 0x06, 0x05, 0x05, 0x05,
+    /* A8 */ 0x05, 0x05, 0x05, 0x05, 0x06, 0x05, 0x05, 0x05,
+    /* B0 */ 0x05, 0x05, 0x05, 0x05, 0x06, 0x05, 0x05, 0x05,
+    /* B8 */ 0x05, 0x05, 0x05, 0x05, 0x06, 0x05, 0x05, 0x05,
+    /* C0 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* C8 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* D0 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* D8 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* E0 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* E8 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* F0 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* F8 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+};
+
+static const uint8_t lde_modrm_16[256] = {
+    /* 00 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x03, 0x01,
+    /* 08 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x03, 0x01,
+    /* 10 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x03, 0x01,
+    /* 18 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x03, 0x01,
+    /* 20 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x03, 0x01,
+    /* 28 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x03, 0x01,
+    /* 30 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x03, 0x01,
+    /* 38 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x03, 0x01,
+    /* 40 */ 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+    /* 48 */ 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+    /* 50 */ 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+    /* 58 */ 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+    /* 60 */ 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+    /* 68 */ 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+    /* 70 */ 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+    /* 78 */ 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+    /* 80 */ 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+    /* 88 */ 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+    /* 90 */ 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+    /* 98 */ 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+    /* A0 */ 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+    /* A8 */ 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+    /* B0 */ 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+    /* B8 */ 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+    /* C0 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* C8 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* D0 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* D8 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* E0 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* E8 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* F0 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* F8 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+};
+
+static uint32_t lde_prefix_flag(uint8_t prefix)
+{
+    switch (prefix)
+    {
+        case 0xF0:  return C_LOCK;
+        case 0xF2:
+        case 0xF3:  return C_REP;
+        case 0x66:  return C_66;
+        case 0x67:  return C_67;
+        default:    return C_SEG;
+    }
+}
+
+static inline uint32_t lde_decode(const uint8_t *opcode, uint32_t *kind)
+{
+    const uint8_t *p = opcode, *modrm_table = lde_modrm_32;
+    uint32_t flags, prefix, prefixes = 0, length, modrm;
+    uint32_t defdata = 4, defmem = 4;
+    uint8_t op;
+
+    for (;;)
+    {
+        op = *p++;
+        flags = lde_table_1[op];
+
+        if (!(flags & T_PREFIX)) break;
+
+        prefix = lde_prefix_flag(op);
+        if (prefixes & prefix) return 0;
+
+        prefixes |= prefix;
+
+        if (op == 0x66) defdata = 2;
+
+        if (op == 0x67)
+        {
+            defmem = 2;
+            modrm_table = lde_modrm_16;
+        }
+    }
+
+    if (flags & T_OPCODE2)
+    {
+        flags = lde_table_2[*p++];
+    }
+
+    if (flags & T_ERROR) return 0;
+
+    length = (uint32_t) (p - opcode) + T_GETDATA(flags);
+
+    if (flags & T_SPECIAL)
+    {
+        if (op == 0xCD)
+        {
+            length += (*p == 0x20 ? 1 + 4 : 1);
+        }
+        else                                // <test ..., xx> only
+        {
+            flags |= T_MODRM;
+            if (!(*p & 0x38)) length += (op & 1) ? defdata : 1;
+        }
+    }
+
+    if (flags & T_DATA66) length += defdata;
+    if (flags & T_MEM67) length += defmem;
+
+    if (flags & T_MODRM)
+    {
+        modrm = modrm_table[p[0]];
+        length += (modrm & 0x0F) +
+                  (((modrm >> 4) & ((p[1] & 0x07) == 0x05)) << 2);
+    }
+
+    *kind = T_GETKIND(flags);
+    return length;
+}
+
+uint32_t lde_get_length(const uint8_t *opcode, uint32_t *kind)
+{
+    uint32_t dummy;
+
+    return lde_decode(opcode, kind ? kind : &dummy);
+}
+
+uint32_t lde_decode_insn(const uint8_t *opcode, lde_insn *insn)
+{
+    const uint8_t *p = opcode, *modrm_table = lde_modrm_32;
+    uint32_t flags, prefix, prefixes = 0, position, modrm = 0, reg;
+    uint32_t defdata = 4, defmem = 4, mem_size = 0, data_size;
+    uint32_t modrm_offset = 0, branch = LDE_BRANCH_NONE;
+    uint8_t op, op2 = 0;
+
+    for (;;)
+    {
+        op = *p++;
+        flags = lde_table_1[op];
+
+        if (!(flags & T_PREFIX)) break;
+
+        prefix = lde_prefix_flag(op);
+        if (prefixes & prefix) goto INVALID;
+
+        prefixes |= prefix;
+
+        if (op == 0x66) defdata = 2;
+
+        if (op == 0x67)
+        {
+            defmem = 2;
+            modrm_table = lde_modrm_16;
+        }
+    }
+
+    insn->prefixes = (uint8_t) (p - opcode - 1);
+
+    if (flags & T_OPCODE2)
+    {
+        prefixes |= C_OPCODE2;
+        op2 = *p;
+        flags = lde_table_2[*p++];
+    }
+
+    if (flags & T_ERROR) goto INVALID;
+
+    data_size = T_GETDATA(flags);
+
+    if (flags & T_SPECIAL)
+    {
+        if (op == 0xCD)
+        {
+            data_size += (*p == 0x20 ? 1 + 4 : 1);
+        }
+        else                                // <test ..., xx> only
+        {
+            flags |= T_MODRM;
+            if (!(*p & 0x38)) data_size += (op & 1) ? defdata : 1;
+        }
+    }
+
+    if (flags & T_DATA66) data_size += defdata;
+    if (flags & T_MEM67) mem_size = defmem;
+
+    position = (uint32_t) (p - opcode);
+
+    if (flags & T_MODRM)
+    {
+        prefixes |= C_MODRM;
+        modrm = p[0];
+        modrm_offset = position++;
+
+        // table counts modrm, sib and displacement together
+        mem_size = (modrm_table[modrm] & 0x0F) - 1 +
+                   (((modrm_table[modrm] >> 4) & ((p[1] & 0x07) == 0x05)) << 2);
+
+        if (defmem == 4 && (modrm & 0xC0) != 0xC0 && (modrm & 0x07) == 0x04)
+        {
+            prefixes |= C_SIB;
+            mem_size--;
+            position++;
+        }
+    }
+
+    insn->kind = (uint8_t) T_GETKIND(flags);
+
+    // kinds are relative branches except RET
+    if (insn->kind == LDE_KIND_RET)
+    {
+        branch = LDE_BRANCH_RETURN;
+    }
+    else if (insn->kind)
+    {
+        branch = LDE_BRANCH_RELATIVE;
+    }
+    else if (op == 0xCA || op == 0xCB || op == 0xCF)
+    {
+        branch = LDE_BRANCH_RETURN;
+    }
+    else if (op == 0x9A || op == 0xEA)
+    {
+        branch = LDE_BRANCH_FAR;
+    }
+    else if (op == 0xFF)
+    {
+        reg = (modrm >> 3) & 7;
+        if (reg >= 2 && reg <= 5) branch = LDE_BRANCH_INDIRECT;
+    }
+
+    insn->branch = (uint8_t) branch;
+    insn->flags = (uint8_t) prefixes;
+    insn->opcode = op;
+    insn->opcode2 = op2;
+    insn->modrm_offset = (uint8_t) modrm_offset;
+    insn->disp_offset = (uint8_t) (mem_size ? position : 0);
+    insn->disp_size = (uint8_t) mem_size;
+
+    position += mem_size;
+
+    insn->imm_offset = (uint8_t) (data_size ? position : 0);
+    insn->imm_size = (uint8_t) data_size;
+
+    position += data_size;
+    insn->length = (uint8_t) position;
+
+    return position;
+
+INVALID:
+
+    memset(insn, 0, sizeof(lde_insn));
+    return 0;
+}
+
+uint32_t lde_decode_buffer(const uint8_t *buff, uint32_t size,
+                           uint8_t *lengths, uint8_t *kinds,
+                           uint32_t max_count)
+{
+    uint8_t tail[LDE_MAX_READ];
+    const uint8_t *p;
+    uint32_t offset = 0, count = 0, left, length, kind;
+
+    while (offset < size && count < max_count)
+    {
+        p = &buff[offset];
+        left = size - offset;
+
+        // do not read past the end of buffer
+        if (left < LDE_MAX_READ)
+        {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, p, left);
+            p = tail;
+        }
+
+        length = lde_decode(p, &kind);
+
+        if (!length)
+        {
+            length = 1;
+            kind = LDE_KIND_INVALID;
+        }
+
+        if (length > left)
+        {
+            length = left;
+            kind = LDE_KIND_INVALID;
+        }
+
+        lengths[count] = (uint8_t) length;
+        if (kinds) kinds[count] = (uint8_t) kind;
+
+        count++;
+        offset += length;
+    }
+
+    return count;
+}
@@ -0,0 +1,159 @@
+#if !defined(__LDE_H__)
+#define __LDE_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* most bytes the decoder may read for one instruction */
+#define LDE_MAX_READ    32
+
+/* instruction kinds, same order as CGP node types */
+enum lde_kinds {
+    LDE_KIND_LINE,
+    LDE_KIND_JMP,
+    LDE_KIND_JCC,
+    LDE_KIND_CALL,
+    LDE_KIND_RET,
+    LDE_KIND_INVALID
+};
+
+/* flags of lde_insn, same bits as the C_* flags of the decoder */
+enum lde_insn_flags {
+    LDE_F_66        = 0x01,     /* operand size prefix */
+    LDE_F_67        = 0x02,     /* address size prefix */
+    LDE_F_LOCK      = 0x04,
+    LDE_F_REP       = 0x08,     /* F2 or F3 */
+    LDE_F_SEG       = 0x10,     /* segment override or branch hint */
+    LDE_F_OPCODE2   = 0x20,     /* opcode is 0F, opcode2 follows it */
+    LDE_F_MODRM     = 0x40,     /* modrm present */
+    LDE_F_SIB       = 0x80      /* sib follows modrm */
+};
+
+#define LDE_F_PREFIXES  (LDE_F_66 | LDE_F_67 | LDE_F_LOCK | LDE_F_REP | \
+                         LDE_F_SEG)
+
+/* how a control transfer finds its target */
+enum lde_branches {
+    LDE_BRANCH_NONE,
+    LDE_BRANCH_RELATIVE,    /* immediate added to the next instruction */
+    LDE_BRANCH_INDIRECT,    /* register or memory of FF /2 - /5 */
+    LDE_BRANCH_FAR,         /* immediate segment:offset of 9A, EA */
+    LDE_BRANCH_RETURN       /* C2, C3, CA, CB, CF */
+};
+
+/* decoded instruction, offsets are from its first byte */
+typedef struct lde_insn {
+    uint8_t length;
+    uint8_t kind;           /* LDE_KIND_* */
+    uint8_t branch;         /* LDE_BRANCH_* */
+    uint8_t flags;          /* LDE_F_* */
+    uint8_t prefixes;       /* count of prefix bytes, opcode follows them */
+    uint8_t opcode;
+    uint8_t opcode2;        /* with LDE_F_OPCODE2 */
+    uint8_t modrm_offset;   /* with LDE_F_MODRM, sib is the next byte */
+    uint8_t disp_offset;
+    uint8_t disp_size;      /* 0, 1, 2 or 4 */
+    uint8_t imm_offset;
+    uint8_t imm_size;       /* 0 - 6, far pointer is the largest */
+} lde_insn;
+
+/** Get length of x86 instruction, switch based decoder.
+ *
+ *  @param pOpCode Pointer to instruction
+ *  @param pdwInstructionSize Receives length of instruction
+ *  @return 1 on success, 0 on invalid instruction
+ */
+int GetInstructionSize(uint8_t *pOpCode, uint32_t *pdwInstructionSize);
+
+/** Get length of x86 instruction, table based decoder.
+ *
+ *  Accepts exactly the same instructions as GetInstructionSize(...).
+ *
+ *  @param opcode Pointer to instruction, up to LDE_MAX_READ bytes are read
+ *  @param kind Receives LDE_KIND_* of instruction, may be NULL
+ *  @return length of instruction or 0 on invalid instruction
+ */
+uint32_t lde_get_length(const uint8_t *opcode, uint32_t *kind);
+
+/** Decode x86 instruction to a record of its parts, table based decoder.
+ *
+ *  Accepts exactly the same instructions as lde_get_length(...). Relative
+ *  branch target is the end of instruction plus the signed immediate.
+ *
+ *  @param opcode Pointer to instruction, up to LDE_MAX_READ bytes are read
+ *  @param insn Receives the record, zeroed on invalid instruction
+ *  @return length of instruction or 0 on invalid instruction
+ */
+uint32_t lde_decode_insn(const uint8_t *opcode, lde_insn *insn);
+
+/** Linearly decode a whole buffer.
+ *
+ *  An invalid instruction is reported as one byte of LDE_KIND_INVALID and
+ *  decoding goes on from the next byte. Never reads past the buffer.
+ *
+ *  @param buff Code to decode
+ *  @param size Size of code
+ *  @param lengths Receives length of every instruction
+ *  @param kinds Receives LDE_KIND_* of every instruction, may be NULL
+ *  @param max_count Capacity of lengths and kinds arrays
+ *  @return count of decoded instructions
+ */
+uint32_t lde_decode_buffer(const uint8_t *buff, uint32_t size,
+                           uint8_t *lengths, uint8_t *kinds,
+                           uint32_t max_count);
+
+/* vector units for speculative decoding */
+enum lde_simd_levels {
+    LDE_SIMD_SCALAR,
+    LDE_SIMD_SSE41,
+    LDE_SIMD_AVX2,
+    LDE_SIMD_BEST = LDE_SIMD_AVX2
+};
+
+/** Get best LDE_SIMD_* level supported by the CPU.
+ *
+ *  @return LDE_SIMD_* level
+ */
+uint32_t lde_simd_level(void);
+
+/** Speculative instruction length at every offset of a buffer.
+ *
+ *  Offsets are classified 32 (AVX2) or 16 (SSE4.1) at once, assuming no
+ *  prefixes. Invalid opcodes are 1 as in lde_decode_buffer(...), prefixes
+ *  and CD/F6/F7 are reported as 0 and need lde_get_length(...).
+ *
+ *  @param buff Code
+ *  @param size Size of code
+ *  @param spec Receives size bytes, candidate length at every offset
+ *  @param level Highest LDE_SIMD_* level to use, lower on older CPUs
+ *  @return void
+ */
+void lde_speculate(const uint8_t *buff, uint32_t size, uint8_t *spec,
+                   uint32_t level);
+
+/** Find instruction boundaries of a linear sweep from start.
+ *
+ *  Speculates lengths chunk by chunk and walks the chain of candidates in
+ *  4 lanes per chunk, joining each lane to the chain of the one before it.
+ *  One prefix is added to the speculated opcode after it, otherwise
+ *  lde_get_length(...) is used where speculation gave up. The result
+ *  equals lde_decode_buffer(...) started at the same offset.
+ *
+ *  @param buff Code
+ *  @param size Size of code
+ *  @param start Offset of first instruction
+ *  @param bitmap Receives (size + 7) / 8 bytes, bit set at every boundary
+ *  @param level Highest LDE_SIMD_* level to use
+ *  @return count of instructions
+ */
+uint32_t lde_find_boundaries(const uint8_t *buff, uint32_t size,
+                             uint32_t start, uint8_t *bitmap, uint32_t level);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
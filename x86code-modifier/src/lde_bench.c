@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "lde.h"
+
+#define DEFAULT_SIZE_MB     16
+#define BENCH_ROUNDS        5
+
+/* typical 32-bit compiler output, fixed bytes followed by random ones */
+static const struct {
+    uint8_t fixed;
+    uint8_t size;
+    uint8_t bytes[4];
+} templates[] = {
+    {1, 1, {0x55}},                     /* push ebp */
+    {2, 2, {0x8B, 0xEC}},               /* mov ebp, esp */
+    {2, 3, {0x83, 0xEC}},               /* sub esp, imm8 */
+    {2, 3, {0x8B, 0x45}},               /* mov eax, [ebp+disp8] */
+    {2, 3, {0x89, 0x45}},               /* mov [ebp+disp8], eax */
+    {3, 4, {0x8D, 0x44, 0x24}},         /* lea eax, [esp+disp8] */
+    {2, 6, {0x81, 0xC4}},               /* add esp, imm32 */
+    {3, 4, {0x66, 0x89, 0x45}},         /* mov [ebp+disp8], ax */
+    {1, 5, {0xB8}},                     /* mov eax, imm32 */
+    {3, 4, {0x0F, 0xB6, 0x45}},         /* movzx eax, byte [ebp+disp8] */
+    {2, 4, {0xF6, 0x45}},               /* test byte [ebp+disp8], imm8 */
+    {2, 6, {0xFF, 0x15}},               /* call [abs32] */
+    {2, 7, {0xC7, 0x45}},               /* mov dword [ebp+disp8], imm32 */
+    {2, 2, {0x85, 0xC0}},               /* test eax, eax */
+    {1, 2, {0x74}},                     /* jz rel8 */
+    {2, 6, {0x0F, 0x84}},               /* jz rel32 */
+    {1, 5, {0xE8}},                     /* call rel32 */
+    {1, 1, {0xC3}},                     /* ret */
+};
+
+static uint8_t *generate_code(uint32_t size)
+{
+    uint8_t *code = (uint8_t *) malloc(size);
+    uint32_t offset = 0, t;
+
+    srand(1);
+
+    while (offset < size) {
+        t = rand() % (sizeof(templates) / sizeof(templates[0]));
+
+        for (uint32_t i = 0 ; i < templates[t].size && offset < size ; i++) {
+            code[offset++] = i < templates[t].fixed ? templates[t].bytes[i]
+                                                    : (uint8_t) rand();
+        }
+    }
+
+    return code;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* reference: one GetInstructionSize() call per instruction */
+static uint32_t sweep_switch(uint8_t *code, uint32_t size)
+{
+    uint32_t offset = 0, count = 0, length;
+
+    /* keep last instructions in bounds like lde_decode_buffer() does */
+    while (offset < size - LDE_MAX_READ) {
+        if (GetInstructionSize(&code[offset], &length) != 1)
+            length = 1;
+
+        offset += length;
+        count++;
+    }
+
+    return count;
+}
+
+/* full record of every instruction, as parse of CGP does */
+static uint32_t sweep_insn(uint8_t *code, uint32_t size)
+{
+    uint32_t offset = 0, count = 0, length;
+    lde_insn insn;
+
+    while (offset < size - LDE_MAX_READ) {
+        length = lde_decode_insn(&code[offset], &insn);
+        if (!length)
+            length = 1;
+
+        offset += length;
+        count++;
+    }
+
+    return count;
+}
+
+/* boundaries of a speculative sweep must match lde_decode_buffer() */
+static int check_bitmap(uint8_t *bitmap, uint8_t *lengths, uint32_t count)
+{
+    uint32_t offset = 0;
+
+    for (uint32_t i = 0 ; i < count ; i++) {
+        if (!(bitmap[offset >> 3] & (1 << (offset & 7))))
+            return 0;
+        offset += lengths[i];
+    }
+
+    return 1;
+}
+
+static const char *level_names[] = {"scalar", "sse4.1", "avx2"};
+
+int main(int argc, char *argv[])
+{
+    uint32_t size_mb, size, count_switch = 0, count_table = 0, count_spec;
+    uint32_t count_insn = 0;
+    uint8_t *code, *lengths, *kinds, *bitmap;
+    double start, best_switch = 1e9, best_table = 1e9, best_insn = 1e9;
+    double best_spec;
+    int result = 0;
+
+    size_mb = argc > 1 ? (uint32_t) atoi(argv[1]) : DEFAULT_SIZE_MB;
+    size = size_mb << 20;
+
+    code = generate_code(size);
+    lengths = (uint8_t *) malloc(size);
+    kinds = (uint8_t *) malloc(size);
+    bitmap = (uint8_t *) malloc(size / 8 + 1);
+
+    for (int i = 0 ; i < BENCH_ROUNDS ; i++) {
+        start = now();
+        count_switch = sweep_switch(code, size);
+        if (now() - start < best_switch)
+            best_switch = now() - start;
+
+        start = now();
+        count_table = lde_decode_buffer(code, size - LDE_MAX_READ,
+                                        lengths, kinds, size);
+        if (now() - start < best_table)
+            best_table = now() - start;
+
+        start = now();
+        count_insn = sweep_insn(code, size);
+        if (now() - start < best_insn)
+            best_insn = now() - start;
+    }
+
+    printf("decoded %u MB, %u / %u instructions\n",
+           size_mb, count_switch, count_table);
+    printf("GetInstructionSize: %8.1f MB/s\n", size_mb / best_switch);
+    printf("lde_decode_buffer:  %8.1f MB/s\n", size_mb / best_table);
+    printf("lde_decode_insn:    %8.1f MB/s\n", size_mb / best_insn);
+
+    if (count_switch != count_table || count_insn != count_table)
+        result = 1;
+
+    for (uint32_t level = 0 ; level <= lde_simd_level() ; level++) {
+        best_spec = 1e9;
+        count_spec = 0;
+
+        for (int i = 0 ; i < BENCH_ROUNDS ; i++) {
+            start = now();
+            count_spec = lde_find_boundaries(code, size - LDE_MAX_READ, 0,
+                                             bitmap, level);
+            if (now() - start < best_spec)
+                best_spec = now() - start;
+        }
+
+        if (count_spec != count_table ||
+            !check_bitmap(bitmap, lengths, count_table))
+            result = 1;
+
+        printf("lde_find_boundaries %-6s %8.1f MB/s, %u instructions\n",
+               level_names[level], size_mb / best_spec, count_spec);
+    }
+
+    free(code);
+    free(lengths);
+    free(kinds);
+    free(bitmap);
+
+    return result;
+}
@@ -0,0 +1,543 @@
+/* Speculative length decoding at every byte offset */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "lde.h"
+#include "lde_tables.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LDE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#define S_MODRM     0x10    // modrm follows opcode
+#define S_DATA66    0x20    // immediate is 2 bytes shorter after 66-prefix
+#define S_ERROR     0x40    // invalid, decoded as one byte
+#define S_SLOW      0x80    // prefix or special, use lde_get_length
+
+#define SPEC_CHUNK  0x4000  // offsets speculated ahead of the walk
+#define WALK_LANES  4       // chains walked at once, lde_walk_chunk() has 4
+#define WALK_MIN_SPLIT 64   // smallest part of a chunk given to one lane
+
+/* low nibble is size of opcode and immediates without any prefix */
+typedef struct spec_tables {
+    uint8_t one[256];
+    uint8_t two[256];
+} SpecTables;
+
+static uint8_t lde_spec_entry(uint16_t flags, uint32_t opcode_size)
+{
+    uint32_t length = opcode_size + T_GETDATA(flags);
+
+    if (flags & T_ERROR)
+        return 1 | S_ERROR;
+
+    if (flags & (T_PREFIX | T_SPECIAL | T_OPCODE2))
+        return S_SLOW;
+
+    if (flags & T_DATA66) length += 4;
+    if (flags & T_MEM67) length += 4;
+
+    return (uint8_t) (length | (flags & T_MODRM ? S_MODRM : 0) |
+                      (flags & T_DATA66 ? S_DATA66 : 0));
+}
+
+static void lde_spec_tables(SpecTables *t)
+{
+    for (uint32_t i = 0 ; i < 256 ; i++)
+    {
+        t->one[i] = lde_spec_entry(lde_table_1[i], 1);
+        t->two[i] = lde_spec_entry(lde_table_2[i], 2);
+    }
+}
+
+/* needs 4 readable bytes, 0 if the full decoder must be used */
+static inline uint8_t lde_spec_one(const SpecTables *t, const uint8_t *p)
+{
+    uint8_t entry, modrm, sib, mod, rm, length;
+
+    if (p[0] == 0x0F)
+    {
+        entry = t->two[p[1]];
+        modrm = p[2];
+        sib = p[3];
+    }
+    else
+    {
+        entry = t->one[p[0]];
+        modrm = p[1];
+        sib = p[2];
+    }
+
+    if (entry & S_SLOW) return 0;
+
+    length = entry & 0x0F;
+
+    if (entry & S_MODRM)
+    {
+        mod = modrm >> 6;
+        rm = modrm & 0x07;
+
+        length++;
+
+        if (mod == 1) length += 1;
+        if (mod == 2) length += 4;
+        if (mod == 0 && rm == 5) length += 4;
+
+        if (mod != 3 && rm == 4)
+        {
+            length++;
+            if (mod == 0 && (sib & 0x07) == 5) length += 4;
+        }
+    }
+
+    return length;
+}
+
+/* one prefix in front of a speculated opcode, 0 if the decoder is needed */
+static inline uint8_t lde_spec_prefixed(const SpecTables *t, const uint8_t *p,
+                                        uint8_t next)
+{
+    uint8_t entry;
+
+    // 67 changes modrm, a second prefix may repeat the first one
+    if (!(lde_table_1[p[0]] & T_PREFIX) || p[0] == 0x67) return 0;
+
+    entry = p[1] == 0x0F ? t->two[p[2]] : t->one[p[1]];
+
+    if (entry & S_ERROR) return 1;
+    if (p[0] == 0x66 && (entry & S_DATA66)) return next - 1;
+
+    return next + 1;
+}
+
+#if defined(LDE_X86_SIMD)
+
+/* 256 entry byte table lookup in two levels: pshufb gives 0 for bytes with
+   bit 7 set, so rows h and h + 8 share one of 8 slots, then bits 6..4 pick
+   the slot by a tree of blends */
+__attribute__((target("avx2")))
+static inline __m256i lde_lut_avx2(const __m256i *rows, __m256i v)
+{
+    __m256i high = _mm256_xor_si256(v, _mm256_set1_epi8((char) 0x80));
+    __m256i slot[8], select;
+
+    for (int h = 0 ; h < 8 ; h++)
+    {
+        slot[h] = _mm256_or_si256(_mm256_shuffle_epi8(rows[h], v),
+                                  _mm256_shuffle_epi8(rows[h + 8], high));
+    }
+
+    // blendv tests bit 7, shifts move bits 4, 5 and 6 of a byte there
+    select = _mm256_slli_epi16(v, 3);
+    for (int h = 0 ; h < 4 ; h++)
+    {
+        slot[h] = _mm256_blendv_epi8(slot[h * 2], slot[h * 2 + 1], select);
+    }
+
+    select = _mm256_slli_epi16(v, 2);
+    for (int h = 0 ; h < 2 ; h++)
+    {
+        slot[h] = _mm256_blendv_epi8(slot[h * 2], slot[h * 2 + 1], select);
+    }
+
+    return _mm256_blendv_epi8(slot[0], slot[1], _mm256_slli_epi16(v, 1));
+}
+
+__attribute__((target("avx2")))
+static uint32_t lde_speculate_avx2(const SpecTables *t, const uint8_t *buff,
+                                   uint32_t begin, uint32_t end,
+                                   uint32_t size, uint8_t *spec)
+{
+    __m256i rows_1[16], rows_2[16];
+    __m256i v0, v1, v2, v3, e, is0f, modrm, sib, mod, rm, sibp, length;
+    const __m256i one = _mm256_set1_epi8(1), four = _mm256_set1_epi8(4);
+    const __m256i five = _mm256_set1_epi8(5), seven = _mm256_set1_epi8(7);
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t i = begin;
+
+    for (int h = 0 ; h < 16 ; h++)
+    {
+        rows_1[h] = _mm256_broadcastsi128_si256(
+                        _mm_loadu_si128((const __m128i *) &t->one[h * 16]));
+        rows_2[h] = _mm256_broadcastsi128_si256(
+                        _mm_loadu_si128((const __m128i *) &t->two[h * 16]));
+    }
+
+    // every offset looks 3 bytes ahead for modrm and sib
+    while (i + 32 <= end && i + 32 + 3 <= size)
+    {
+        v0 = _mm256_loadu_si256((const __m256i *) &buff[i]);
+        v1 = _mm256_loadu_si256((const __m256i *) &buff[i + 1]);
+        v2 = _mm256_loadu_si256((const __m256i *) &buff[i + 2]);
+        v3 = _mm256_loadu_si256((const __m256i *) &buff[i + 3]);
+
+        is0f = _mm256_cmpeq_epi8(v0, _mm256_set1_epi8(0x0F));
+        e = _mm256_blendv_epi8(lde_lut_avx2(rows_1, v0),
+                               lde_lut_avx2(rows_2, v1), is0f);
+        modrm = _mm256_blendv_epi8(v1, v2, is0f);
+        sib = _mm256_blendv_epi8(v2, v3, is0f);
+
+        mod = _mm256_and_si256(_mm256_srli_epi16(modrm, 6),
+                               _mm256_set1_epi8(3));
+        rm = _mm256_and_si256(modrm, seven);
+        sibp = _mm256_andnot_si256(
+                    _mm256_cmpeq_epi8(mod, _mm256_set1_epi8(3)),
+                    _mm256_cmpeq_epi8(rm, four));
+
+        // modrm, disp8, disp32, sib and disp32 brought by sib base
+        length = one;
+        length = _mm256_add_epi8(length,
+                    _mm256_and_si256(_mm256_cmpeq_epi8(mod, one), one));
+        length = _mm256_add_epi8(length,
+                    _mm256_and_si256(_mm256_cmpeq_epi8(mod,
+                        _mm256_set1_epi8(2)), four));
+        length = _mm256_add_epi8(length, _mm256_and_si256(sibp, one));
+        length = _mm256_add_epi8(length,
+                    _mm256_and_si256(_mm256_and_si256(
+                        _mm256_cmpeq_epi8(mod, zero),
+                        _mm256_cmpeq_epi8(rm, five)), four));
+        length = _mm256_add_epi8(length,
+                    _mm256_and_si256(_mm256_and_si256(
+                        _mm256_and_si256(sibp, _mm256_cmpeq_epi8(mod, zero)),
+                        _mm256_cmpeq_epi8(_mm256_and_si256(sib, seven),
+                                          five)), four));
+
+        length = _mm256_and_si256(length, _mm256_cmpeq_epi8(
+                    _mm256_and_si256(e, _mm256_set1_epi8(S_MODRM)),
+                    _mm256_set1_epi8(S_MODRM)));
+        length = _mm256_add_epi8(length,
+                    _mm256_and_si256(e, _mm256_set1_epi8(0x0F)));
+        length = _mm256_andnot_si256(_mm256_cmpeq_epi8(
+                    _mm256_and_si256(e, _mm256_set1_epi8((char) S_SLOW)),
+                    _mm256_set1_epi8((char) S_SLOW)), length);
+
+        _mm256_storeu_si256((__m256i *) &spec[i - begin], length);
+        i += 32;
+    }
+
+    return i;
+}
+
+/* same lookup as lde_lut_avx2(...) */
+__attribute__((target("sse4.1")))
+static inline __m128i lde_lut_sse41(const __m128i *rows, __m128i v)
+{
+    __m128i high = _mm_xor_si128(v, _mm_set1_epi8((char) 0x80));
+    __m128i slot[8], select;
+
+    for (int h = 0 ; h < 8 ; h++)
+    {
+        slot[h] = _mm_or_si128(_mm_shuffle_epi8(rows[h], v),
+                               _mm_shuffle_epi8(rows[h + 8], high));
+    }
+
+    select = _mm_slli_epi16(v, 3);
+    for (int h = 0 ; h < 4 ; h++)
+    {
+        slot[h] = _mm_blendv_epi8(slot[h * 2], slot[h * 2 + 1], select);
+    }
+
+    select = _mm_slli_epi16(v, 2);
+    for (int h = 0 ; h < 2 ; h++)
+    {
+        slot[h] = _mm_blendv_epi8(slot[h * 2], slot[h * 2 + 1], select);
+    }
+
+    return _mm_blendv_epi8(slot[0], slot[1], _mm_slli_epi16(v, 1));
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t lde_speculate_sse41(const SpecTables *t, const uint8_t *buff,
+                                    uint32_t begin, uint32_t end,
+                                    uint32_t size, uint8_t *spec)
+{
+    __m128i rows_1[16], rows_2[16];
+    __m128i v0, v1, v2, v3, e, is0f, modrm, sib, mod, rm, sibp, length;
+    const __m128i one = _mm_set1_epi8(1), four = _mm_set1_epi8(4);
+    const __m128i five = _mm_set1_epi8(5), seven = _mm_set1_epi8(7);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = begin;
+
+    for (int h = 0 ; h < 16 ; h++)
+    {
+        rows_1[h] = _mm_loadu_si128((const __m128i *) &t->one[h * 16]);
+        rows_2[h] = _mm_loadu_si128((const __m128i *) &t->two[h * 16]);
+    }
+
+    while (i + 16 <= end && i + 16 + 3 <= size)
+    {
+        v0 = _mm_loadu_si128((const __m128i *) &buff[i]);
+        v1 = _mm_loadu_si128((const __m128i *) &buff[i + 1]);
+        v2 = _mm_loadu_si128((const __m128i *) &buff[i + 2]);
+        v3 = _mm_loadu_si128((const __m128i *) &buff[i + 3]);
+
+        is0f = _mm_cmpeq_epi8(v0, _mm_set1_epi8(0x0F));
+        e = _mm_blendv_epi8(lde_lut_sse41(rows_1, v0),
+                            lde_lut_sse41(rows_2, v1), is0f);
+        modrm = _mm_blendv_epi8(v1, v2, is0f);
+        sib = _mm_blendv_epi8(v2, v3, is0f);
+
+        mod = _mm_and_si128(_mm_srli_epi16(modrm, 6), _mm_set1_epi8(3));
+        rm = _mm_and_si128(modrm, seven);
+        sibp = _mm_andnot_si128(_mm_cmpeq_epi8(mod, _mm_set1_epi8(3)),
+                                _mm_cmpeq_epi8(rm, four));
+
+        length = one;
+        length = _mm_add_epi8(length,
+                    _mm_and_si128(_mm_cmpeq_epi8(mod, one), one));
+        length = _mm_add_epi8(length,
+                    _mm_and_si128(_mm_cmpeq_epi8(mod, _mm_set1_epi8(2)),
+                                  four));
+        length = _mm_add_epi8(length, _mm_and_si128(sibp, one));
+        length = _mm_add_epi8(length,
+                    _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(mod, zero),
+                                                _mm_cmpeq_epi8(rm, five)),
+                                  four));
+        length = _mm_add_epi8(length,
+                    _mm_and_si128(_mm_and_si128(
+                        _mm_and_si128(sibp, _mm_cmpeq_epi8(mod, zero)),
+                        _mm_cmpeq_epi8(_mm_and_si128(sib, seven), five)),
+                                  four));
+
+        length = _mm_and_si128(length, _mm_cmpeq_epi8(
+                    _mm_and_si128(e, _mm_set1_epi8(S_MODRM)),
+                    _mm_set1_epi8(S_MODRM)));
+        length = _mm_add_epi8(length, _mm_and_si128(e, _mm_set1_epi8(0x0F)));
+        length = _mm_andnot_si128(_mm_cmpeq_epi8(
+                    _mm_and_si128(e, _mm_set1_epi8((char) S_SLOW)),
+                    _mm_set1_epi8((char) S_SLOW)), length);
+
+        _mm_storeu_si128((__m128i *) &spec[i - begin], length);
+        i += 16;
+    }
+
+    return i;
+}
+
+#endif
+
+uint32_t lde_simd_level(void)
+{
+#if defined(LDE_X86_SIMD)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) return LDE_SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return LDE_SIMD_SSE41;
+#endif
+
+    return LDE_SIMD_SCALAR;
+}
+
+/* speculate offsets [begin, end) to spec[0 .. end - begin) */
+static void lde_speculate_range(const SpecTables *t, const uint8_t *buff,
+                                uint32_t begin, uint32_t end, uint32_t size,
+                                uint8_t *spec, uint32_t level)
+{
+    uint32_t i = begin;
+
+#if defined(LDE_X86_SIMD)
+    if (level >= LDE_SIMD_AVX2)
+        i = lde_speculate_avx2(t, buff, begin, end, size, spec);
+    else if (level >= LDE_SIMD_SSE41)
+        i = lde_speculate_sse41(t, buff, begin, end, size, spec);
+#endif
+
+    for ( ; i < end ; i++)
+    {
+        spec[i - begin] = (i + 4 <= size) ? lde_spec_one(t, &buff[i]) : 0;
+    }
+}
+
+static uint32_t lde_clamp_level(uint32_t level)
+{
+    uint32_t supported = lde_simd_level();
+
+    return level > supported ? supported : level;
+}
+
+void lde_speculate(const uint8_t *buff, uint32_t size, uint8_t *spec,
+                   uint32_t level)
+{
+    SpecTables t;
+
+    lde_spec_tables(&t);
+    lde_speculate_range(&t, buff, 0, size, size, spec,
+                        lde_clamp_level(level));
+}
+
+/* same rules as lde_decode_buffer() for invalid and cut instructions */
+static uint32_t lde_full_length(const uint8_t *buff, uint32_t size,
+                                uint32_t offset)
+{
+    uint8_t tail[LDE_MAX_READ];
+    const uint8_t *p = &buff[offset];
+    uint32_t left = size - offset, length;
+
+    if (left < LDE_MAX_READ)
+    {
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, p, left);
+        p = tail;
+    }
+
+    length = lde_get_length(p, NULL);
+
+    if (!length) length = 1;
+    if (length > left) length = left;
+
+    return length;
+}
+
+/* chunk [base, limit) being walked */
+typedef struct spec_walk {
+    const SpecTables *t;
+    const uint8_t *buff;
+    uint32_t size;
+    const uint8_t *spec;
+    uint32_t base;
+    uint32_t limit;
+    uint8_t *bitmap;
+} SpecWalk;
+
+/* length where speculation gave up, out of line to keep the walk in
+   registers */
+static __attribute__((noinline))
+uint32_t lde_walk_slow(const SpecWalk *w, uint32_t offset)
+{
+    uint32_t length = 0, next;
+
+    next = offset + 1 < w->limit ? w->spec[offset + 1 - w->base] : 0;
+    if (next) length = lde_spec_prefixed(w->t, &w->buff[offset], next);
+
+    if (!length) length = lde_full_length(w->buff, w->size, offset);
+
+    return length;
+}
+
+static const uint8_t lde_bits[8] = {1, 2, 4, 8, 16, 32, 64, 128};
+
+/* mark offset as boundary and step over its instruction */
+static inline uint32_t lde_walk_step(const SpecWalk *w, uint32_t offset)
+{
+    uint32_t length = w->spec[offset - w->base];
+
+    if (__builtin_expect(!length, 0)) length = lde_walk_slow(w, offset);
+
+    w->bitmap[offset >> 3] |= lde_bits[offset & 7];
+
+    return offset + length;
+}
+
+/* clear boundaries [from, to) of a lane that started off the chain */
+static uint32_t lde_walk_unmark(uint8_t *bitmap, uint32_t from, uint32_t to)
+{
+    uint32_t count = 0;
+
+    for ( ; from < to ; from++)
+    {
+        if (bitmap[from >> 3] & lde_bits[from & 7])
+        {
+            bitmap[from >> 3] &= (uint8_t) ~lde_bits[from & 7];
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/* walk the chunk from its base, give offset of the chain after it */
+static uint32_t lde_walk_chunk(const SpecWalk *w, uint32_t *count)
+{
+    uint32_t lane[WALK_LANES], end[WALK_LANES], offset, next, steps = 0;
+    uint32_t part = (w->limit - w->base) / WALK_LANES;
+
+    if (part < WALK_MIN_SPLIT)
+    {
+        for (offset = w->base ; offset < w->limit ; steps++)
+        {
+            offset = lde_walk_step(w, offset);
+        }
+
+        *count += steps;
+        return offset;
+    }
+
+    // lane 0 is on the chain, others start at a guess and most of them
+    // fall into the chain within a few instructions
+    for (uint32_t k = 0 ; k < WALK_LANES ; k++)
+    {
+        lane[k] = w->base + part * k;
+        end[k] = w->base + part * (k + 1);
+    }
+    end[WALK_LANES - 1] = w->limit;
+
+    // independent chains hide the latency of the length loads
+    while ((int32_t) ((lane[0] - end[0]) & (lane[1] - end[1]) &
+                      (lane[2] - end[2]) & (lane[3] - end[3])) < 0)
+    {
+        lane[0] = lde_walk_step(w, lane[0]);
+        lane[1] = lde_walk_step(w, lane[1]);
+        lane[2] = lde_walk_step(w, lane[2]);
+        lane[3] = lde_walk_step(w, lane[3]);
+        steps += 4;
+    }
+
+    for (uint32_t k = 0 ; k < WALK_LANES ; k++)
+    {
+        for ( ; lane[k] < end[k] ; steps++)
+        {
+            lane[k] = lde_walk_step(w, lane[k]);
+        }
+    }
+
+    // follow the chain into each lane until it meets a boundary of the lane,
+    // boundaries of the lane before that point are wrong
+    for (uint32_t k = 1 ; k < WALK_LANES ; k++)
+    {
+        offset = lane[k - 1];
+        steps -= lde_walk_unmark(w->bitmap, end[k - 1], offset);
+
+        while (offset < end[k] &&
+               !(w->bitmap[offset >> 3] & lde_bits[offset & 7]))
+        {
+            next = lde_walk_step(w, offset);
+            steps++;
+
+            steps -= lde_walk_unmark(w->bitmap, offset + 1,
+                                     next < end[k] ? next : end[k]);
+            offset = next;
+        }
+
+        // lane never met the chain, its end comes from the chain
+        if (offset >= end[k]) lane[k] = offset;
+    }
+
+    *count += steps;
+    return lane[WALK_LANES - 1];
+}
+
+uint32_t lde_find_boundaries(const uint8_t *buff, uint32_t size,
+                             uint32_t start, uint8_t *bitmap, uint32_t level)
+{
+    uint8_t spec[SPEC_CHUNK];
+    SpecTables t;
+    SpecWalk w = {&t, buff, size, spec, 0, 0, bitmap};
+    uint32_t offset = start, count = 0;
+
+    memset(bitmap, 0, (size + 7) / 8);
+
+    lde_spec_tables(&t);
+    level = lde_clamp_level(level);
+
+    while (offset < size)
+    {
+        w.base = offset;
+        w.limit = size - offset > SPEC_CHUNK ? offset + SPEC_CHUNK : size;
+
+        lde_speculate_range(&t, buff, w.base, w.limit, size, spec, level);
+        offset = lde_walk_chunk(&w, &count);
+    }
+
+    return count;
+}
@@ -0,0 +1,26 @@
+#if !defined(__LDE_TABLES_H__)
+#define __LDE_TABLES_H__
+
+/* Opcode tables shared by the length decoders, not a public interface */
+
+#define T_MODRM     0x0001  // modrm present
+#define T_DATA66    0x0002  // 2 or 4 bytes of data by 66-prefix
+#define T_MEM67     0x0004  // 2 or 4 bytes of address by 67-prefix
+#define T_PREFIX    0x0008  // prefix, decode next byte
+#define T_SPECIAL   0x0010  // length depends on next byte (CD, F6, F7)
+#define T_ERROR     0x0020  // invalid opcode
+#define T_OPCODE2   0x0040  // 0F, 2nd opcode in lde_table_2
+#define T_DATA1     0x0200  // 1 byte of data
+#define T_DATA2     0x0400  // 2 bytes of data, both bits are 3 bytes
+
+#define T_KIND(k)   ((k) << 12)
+#define T_GETKIND(f) ((f) >> 12)
+#define T_GETDATA(f) (((f) >> 9) & 3)
+
+/* one-byte opcodes */
+extern const uint16_t lde_table_1[256];
+
+/* opcodes after 0F */
+extern const uint16_t lde_table_2[256];
+
+#endif
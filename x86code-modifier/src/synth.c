@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "synth.h"
+
+/* instruction kinds of generator */
+enum {
+    SYNTH_LINE,
+    SYNTH_JCC,
+    SYNTH_JMP,
+    SYNTH_CALL,
+    SYNTH_RET
+};
+
+typedef struct synth_insn {
+    uint8_t kind;
+    uint8_t size;
+    uint8_t bytes[6];
+    uint32_t target;        /* index of target instruction */
+    uint32_t offset;
+} SynthInsn;
+
+typedef struct synth_state {
+    uint32_t seed;
+} SynthState;
+
+static uint32_t synth_rand(SynthState *state, uint32_t n)
+{
+    state->seed = state->seed * 1103515245 + 12345;
+    return (uint32_t) (((uint64_t) (state->seed >> 1) * n) >> 31);
+}
+
+/* register to register and immediate arithmetic, esp is never touched */
+static void synth_line(SynthState *state, SynthInsn *insn)
+{
+    static const uint8_t alu[] = {0x01, 0x29, 0x21, 0x09, 0x31, 0x39, 0x85};
+    uint8_t dst, src;
+    uint32_t imm;
+
+    dst = synth_rand(state, 8);
+    src = synth_rand(state, 8);
+    if (dst == 4) dst = 0;
+    if (src == 4) src = 1;
+
+    imm = synth_rand(state, 0x10000) << 16 | synth_rand(state, 0x10000);
+
+    insn->kind = SYNTH_LINE;
+
+    switch (synth_rand(state, 10)) {
+        case 0:     /* mov r32, imm32 */
+            insn->bytes[0] = 0xB8 + dst;
+            memcpy(&insn->bytes[1], &imm, 4);
+            insn->size = 5;
+            break;
+
+        case 1:     /* alu r32, r32 */
+            insn->bytes[0] = alu[synth_rand(state, sizeof(alu))];
+            insn->bytes[1] = 0xC0 | src << 3 | dst;
+            insn->size = 2;
+            break;
+
+        case 2:     /* add/sub/cmp r32, imm8 */
+            insn->bytes[0] = 0x83;
+            insn->bytes[1] = 0xC0 | (uint8_t[]) {0, 5, 7}[synth_rand(state, 3)]
+                                    << 3 | dst;
+            insn->bytes[2] = (uint8_t) imm;
+            insn->size = 3;
+            break;
+
+        case 3:     /* inc/dec r32 */
+            insn->bytes[0] = (synth_rand(state, 2) ? 0x40 : 0x48) + dst;
+            insn->size = 1;
+            break;
+
+        case 4:     /* lea r32, [r32 + disp8] */
+            insn->bytes[0] = 0x8D;
+            insn->bytes[1] = 0x40 | dst << 3 | (src == 5 ? 6 : src);
+            insn->bytes[2] = (uint8_t) imm;
+            insn->size = 3;
+            break;
+
+        case 5:     /* imul r32, r32, imm32 */
+            insn->bytes[0] = 0x69;
+            insn->bytes[1] = 0xC0 | dst << 3 | src;
+            memcpy(&insn->bytes[2], &imm, 4);
+            insn->size = 6;
+            break;
+
+        case 6:     /* shl r32, imm8 */
+            insn->bytes[0] = 0xC1;
+            insn->bytes[1] = 0xE0 | dst;
+            insn->bytes[2] = (uint8_t) (imm & 0x1F);
+            insn->size = 3;
+            break;
+
+        case 7:     /* mov r16, imm16 */
+            insn->bytes[0] = 0x66;
+            insn->bytes[1] = 0xB8 + dst;
+            memcpy(&insn->bytes[2], &imm, 2);
+            insn->size = 4;
+            break;
+
+        case 8:     /* imul r32, r32 or movzx r32, r8 */
+            insn->bytes[0] = 0x0F;
+            insn->bytes[1] = synth_rand(state, 2) ? 0xAF : 0xB6;
+            insn->bytes[2] = 0xC0 | dst << 3 | (src & 3);
+            insn->size = 3;
+            break;
+
+        default:    /* nop */
+            insn->bytes[0] = 0x90;
+            insn->size = 1;
+            break;
+    }
+}
+
+static uint32_t synth_pick(SynthState *state, uint32_t low, uint32_t high)
+{
+    if (high < low) return low;
+    return low + synth_rand(state, high - low + 1);
+}
+
+uint8_t *synth_generate(const synth_params *params, uint32_t *size)
+{
+    SynthState state;
+    SynthInsn *insns, *insn;
+    uint32_t count, routine, first, next, i, k, length, offset;
+    uint8_t *buff;
+    int32_t displacement;
+
+    count = params->insns < 2 ? 2 : params->insns;
+    routine = params->routine < 4 ? 4 : params->routine;
+    state.seed = params->seed;
+
+    insns = (SynthInsn *) calloc(count, sizeof(SynthInsn));
+    if (!insns) return NULL;
+
+    /* split code to routines and fill them */
+    for (first = 0 ; first < count ; first = next) {
+        length = routine / 2 + synth_rand(&state, routine);
+        next = first + length;
+
+        if (next > count || count - next < 2) next = count;
+
+        for (i = first ; i < next - 1 ; i++) {
+            insn = &insns[i];
+
+            if (i == first && next != count) {
+                insn->kind = SYNTH_CALL;
+                insn->target = next;
+                continue;
+            }
+
+            if (i == first || synth_rand(&state, 100) >= params->branch_pct) {
+                synth_line(&state, insn);
+                continue;
+            }
+
+            k = synth_rand(&state, 100);
+
+            if (k < 70) {
+                insn->kind = SYNTH_JCC;
+                insn->bytes[0] = (uint8_t) synth_rand(&state, 16);
+
+                if (params->backward && synth_rand(&state, 3) == 0)
+                    insn->target = synth_pick(&state, first + 1, i);
+                else
+                    insn->target = synth_pick(&state, i + 1, next - 1);
+            } else if (k < 85 || next == count) {
+                insn->kind = SYNTH_JMP;
+                insn->target = synth_pick(&state, i + 1, next - 1);
+            } else {
+                insn->kind = SYNTH_CALL;
+                insn->target = next;
+            }
+        }
+
+        insns[next - 1].kind = SYNTH_RET;
+    }
+
+    /* rel32 forms only, so offsets are known at once */
+    for (i = 0, offset = 0 ; i < count ; i++) {
+        insn = &insns[i];
+
+        switch (insn->kind) {
+            case SYNTH_JCC:     insn->size = 6; break;
+            case SYNTH_JMP:     insn->size = 5; break;
+            case SYNTH_CALL:    insn->size = 5; break;
+            case SYNTH_RET:     insn->size = 1; break;
+        }
+
+        insn->offset = offset;
+        offset += insn->size;
+    }
+
+    buff = (uint8_t *) malloc(offset);
+    if (!buff) {
+        free(insns);
+        return NULL;
+    }
+
+    for (i = 0 ; i < count ; i++) {
+        insn = &insns[i];
+        displacement = (int32_t) (insns[insn->target].offset -
+                                  insn->offset - insn->size);
+
+        switch (insn->kind) {
+            case SYNTH_LINE:
+                memcpy(&buff[insn->offset], insn->bytes, insn->size);
+                break;
+
+            case SYNTH_JCC:
+                buff[insn->offset] = 0x0F;
+                buff[insn->offset + 1] = 0x80 | insn->bytes[0];
+                memcpy(&buff[insn->offset + 2], &displacement, 4);
+                break;
+
+            case SYNTH_JMP:
+            case SYNTH_CALL:
+                buff[insn->offset] = insn->kind == SYNTH_JMP ? 0xE9 : 0xE8;
+                memcpy(&buff[insn->offset + 1], &displacement, 4);
+                break;
+
+            case SYNTH_RET:
+                buff[insn->offset] = 0xC3;
+                break;
+        }
+    }
+
+    free(insns);
+
+    *size = offset;
+    return buff;
+}
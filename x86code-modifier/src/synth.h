@@ -0,0 +1,37 @@
+#if !defined(__SYNTH_H__)
+#define __SYNTH_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* shape of generated code */
+typedef struct synth_params {
+    uint32_t insns;         /* count of instructions */
+    uint32_t branch_pct;    /* percent of JCC/JMP/CALL instructions */
+    uint32_t routine;       /* average instructions per routine */
+    uint32_t backward;      /* allow JCC to go back inside of routine */
+    uint32_t seed;          /* same seed gives same code */
+} synth_params;
+
+/** Generate synthetic x86-32 code.
+ *
+ *  Code is a chain of routines, every one ends with RET and the first
+ *  instruction of every routine except the last one calls the next, so
+ *  everything is reachable from offset 0. Other CALLs go to the next
+ *  routine too, JCC and JMP stay inside of their routine and JMP only goes
+ *  forward. Branches are rel32.
+ *
+ *  @param params Shape of code
+ *  @param size Receives size of code
+ *  @return code allocated by malloc(...), NULL on failure
+ */
+uint8_t *synth_generate(const synth_params *params, uint32_t *size);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -2,7 +2,9 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <assert.h>
+#include <elf.h>
 #include "cgp.h"
+#include "elf_loader.h"
 
 void input_routine_begin();
 void input_routine_end();
@@ -21,24 +23,71 @@ void *get_code_from_s_file(uint32_t *size)
 int main(int argc, char *argv[])
 {
     FILE *fh;
+    elf_image image = {0};
+    cgp_build_info info;
     uint8_t *input_code, *output_code;
     uint32_t input_size, output_size, entry_point;
+    int result;
 
     entry_point = 0;
-    input_code = get_code_from_s_file(&input_size);
 
-    cgp_init(input_code, input_size, entry_point);
+    /* code of an executable, mapped and not copied */
+    if (argc > 1) {
+        if (elf_load(argv[1], &image)) {
+            printf("Can't load ELF '%s'\n", argv[1]);
+            return 1;
+        }
+
+        if (image.machine != EM_386) {
+            printf("'%s' isn't x86-32 code\n", argv[1]);
+            elf_unload(&image);
+            return 1;
+        }
+
+        printf("input .text = %llX, input size = %X, entries = %u\n",
+               (unsigned long long) image.text_address, image.text_size,
+               image.entries_count);
+
+        cgp_set_flags(CGP_ZERO_COPY);
+
+        if (image.entries_count) {
+            result = cgp_init_entries(image.text, image.text_size,
+                                      image.entries, image.entries_count, 0);
+        } else {
+            result = cgp_init(image.text, image.text_size, entry_point);
+        }
+    } else {
+        input_code = get_code_from_s_file(&input_size);
+        result = cgp_init(input_code, input_size, entry_point);
+    }
+
+    if (result) {
+        printf("Can't parse input code\n");
+        elf_unload(&image);
+        return 1;
+    }
+
+    /* dominators and loops annotate nodes of input graph */
+    cgp_analyze(NULL);
     export_to_gdl("graph_in.gdl");
 
     /* few variants of using */
+    // cgp_optimize(NULL);
+    // cgp_coalesce_blocks();
+    // cgp_set_alignment(16, 7, CGP_ALIGN_LOOPS | CGP_ALIGN_BRANCHES);
     // output_size = cgp_build(&output_code);
     // output_size = cgp_build_reduntant_nop(&output_code);
+    // output_size = cgp_build_layout(NULL, &output_code);
     output_size = cgp_build_spaghetti(&output_code);
+    cgp_get_build_info(&info);
 
     export_to_gdl("graph_out.gdl");
     cgp_free();
+    elf_unload(&image);
 
     printf("out code size = %d bytes\n", output_size);
+    printf("relaxed branches = %d, saved %d bytes\n",
+           info.relaxed_branches, info.relaxed_bytes);
 
     fh = fopen("out.bin", "w");
     if(!fh) {
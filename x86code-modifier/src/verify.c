@@ -0,0 +1,381 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "cgp.h"
+#include "emu.h"
+#include "lde.h"
+#include "synth.h"
+
+#define DEFAULT_VARIANTS    200
+#define DEFAULT_STATES      64
+#define DEFAULT_INSNS       300
+#define DEFAULT_STEPS       10000
+
+#define VERIFY_CODE_BASE    0x00400000
+#define VERIFY_DATA_BASE    0x10000000
+#define VERIFY_DATA_SIZE    0x1000
+#define VERIFY_STACK_BASE   0x7FFF0000
+#define VERIFY_STACK_SIZE   0x4000
+#define VERIFY_REPORTS      10
+
+#define VERIFY_FLAGS        (EMU_CF | EMU_PF | EMU_AF | EMU_ZF | EMU_SF | \
+                             EMU_OF | EMU_DF)
+
+enum verify_builders {
+    VERIFY_BUILD,
+    VERIFY_SPAGHETTI,
+    VERIFY_REDUNTANT_NOP,
+    VERIFY_LAYOUT,
+    VERIFY_OPTIMIZE,
+    VERIFY_BUILDERS
+};
+
+static const char *builder_names[] = {
+    "cgp_build", "cgp_build_spaghetti", "cgp_build_reduntant_nop",
+    "cgp_build_layout", "cgp_optimize + cgp_build"
+};
+
+static const char *status_names[] = {
+    "running", "exit", "limit", "hang", "fault", "divide", "unsupported"
+};
+
+static const char *reg_names[] = {
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"
+};
+
+/* one side of comparison */
+typedef struct verify_run {
+    emu_cpu cpu;
+    uint8_t data[VERIFY_DATA_SIZE];
+    uint8_t stack[VERIFY_STACK_SIZE];
+} VerifyRun;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t verify_rand(uint32_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [variants] [states] [insns] [steps]\n", name);
+}
+
+/* copy of code followed by zero bytes for the emulator */
+static uint8_t *verify_pad(const uint8_t *code, uint32_t size)
+{
+    uint8_t *padded = (uint8_t*) calloc(size + EMU_CODE_PADDING, 1);
+
+    if (padded)
+        memcpy(padded, code, size);
+
+    return padded;
+}
+
+/* random counts for every instruction */
+static uint32_t verify_profile(uint8_t *code, uint32_t size, uint32_t *seed,
+                               cgp_profile_node *nodes)
+{
+    uint32_t count = 0, length;
+
+    for (uint32_t offset = 0 ; offset < size ; offset += length) {
+        length = lde_get_length(&code[offset], NULL);
+        if (!length)
+            break;
+
+        nodes[count].offset = offset;
+        nodes[count].count = verify_rand(seed) % 1000;
+        count++;
+    }
+
+    return count;
+}
+
+/* rebuild code by one of builders, depends only on variant */
+static uint8_t *verify_build(uint32_t variant, uint32_t builder,
+                             uint8_t *code, uint32_t size, uint32_t *out_size)
+{
+    cgp_optimize_info optimize_info;
+    cgp_profile_node *nodes;
+    cgp_profile profile;
+    cgp_ctx *ctx;
+    uint8_t *output_code, *padded;
+    uint32_t seed = variant + 1;
+
+    ctx = cgp_ctx_create();
+    if (!ctx)
+        return NULL;
+
+    cgp_ctx_set_traversal(ctx, variant / VERIFY_BUILDERS % 3);
+    if (cgp_ctx_init(ctx, code, size, 0)) {
+        cgp_ctx_destroy(ctx);
+        return NULL;
+    }
+
+    cgp_ctx_set_seed(ctx, variant);
+
+    if (variant % 3 == 2)
+        cgp_ctx_set_alignment(ctx, 16, 7, CGP_ALIGN_LOOPS | CGP_ALIGN_BRANCHES);
+
+    switch (builder) {
+        case VERIFY_SPAGHETTI:
+            *out_size = cgp_ctx_build_spaghetti(ctx, &output_code);
+            break;
+
+        case VERIFY_REDUNTANT_NOP:
+            *out_size = cgp_ctx_build_reduntant_nop(ctx, &output_code);
+            break;
+
+        case VERIFY_LAYOUT:
+            nodes = (cgp_profile_node*) malloc(sizeof(cgp_profile_node) * size);
+            memset(&profile, 0, sizeof(profile));
+            profile.nodes_count = verify_profile(code, size, &seed, nodes);
+            profile.nodes = nodes;
+
+            *out_size = cgp_ctx_build_layout(ctx, &profile, &output_code);
+            free(nodes);
+            break;
+
+        case VERIFY_OPTIMIZE:
+            cgp_ctx_optimize(ctx, &optimize_info);
+            /* fall through */
+
+        default:
+            *out_size = cgp_ctx_build(ctx, &output_code);
+            break;
+    }
+
+    cgp_ctx_destroy(ctx);
+
+    if (!output_code)
+        return NULL;
+
+    padded = verify_pad(output_code, *out_size);
+    free(output_code);
+    return padded;
+}
+
+/* random registers, flags, data and stack, some registers point to data */
+static void verify_random_state(VerifyRun *run, uint32_t *seed)
+{
+    emu_cpu *cpu = &run->cpu;
+    uint32_t exit_address = EMU_EXIT_ADDRESS, top;
+
+    memset(cpu, 0, sizeof(emu_cpu));
+
+    for (uint32_t i = 0 ; i < VERIFY_DATA_SIZE ; i += 4) {
+        top = verify_rand(seed);
+        memcpy(&run->data[i], &top, 4);
+    }
+
+    for (uint32_t i = 0 ; i < VERIFY_STACK_SIZE ; i += 4) {
+        top = verify_rand(seed);
+        memcpy(&run->stack[i], &top, 4);
+    }
+
+    for (uint32_t i = 0 ; i < 8 ; i++) {
+        cpu->regs[i] = verify_rand(seed);
+
+        if (cpu->regs[i] & 1)
+            cpu->regs[i] = VERIFY_DATA_BASE + cpu->regs[i] % VERIFY_DATA_SIZE;
+    }
+
+    cpu->flags = verify_rand(seed) & VERIFY_FLAGS;
+
+    /* room for arguments above return address */
+    top = VERIFY_STACK_SIZE - 0x100 - verify_rand(seed) % 0x40 * 4;
+    memcpy(&run->stack[top], &exit_address, 4);
+    cpu->regs[EMU_ESP] = VERIFY_STACK_BASE + top;
+
+    cpu->code_base = VERIFY_CODE_BASE;
+    cpu->eip = VERIFY_CODE_BASE;
+
+    cpu->regions_count = 2;
+    cpu->regions[0].base = VERIFY_DATA_BASE;
+    cpu->regions[0].size = VERIFY_DATA_SIZE;
+    cpu->regions[0].writable = 1;
+    cpu->regions[1].base = VERIFY_STACK_BASE;
+    cpu->regions[1].size = VERIFY_STACK_SIZE;
+    cpu->regions[1].writable = 1;
+}
+
+static void verify_start(VerifyRun *run, const VerifyRun *state,
+                         const uint8_t *code, uint32_t size)
+{
+    memcpy(run, state, sizeof(VerifyRun));
+
+    run->cpu.code = code;
+    run->cpu.code_size = size;
+    run->cpu.regions[0].data = run->data;
+    run->cpu.regions[1].data = run->stack;
+}
+
+static int verify_is_code(emu_cpu *cpu, uint32_t address)
+{
+    return address - cpu->code_base <= cpu->code_size;
+}
+
+/* first difference of final states, NULL if they are the same */
+static const char *verify_compare(VerifyRun *a, VerifyRun *b)
+{
+    uint32_t esp = a->cpu.regs[EMU_ESP] - VERIFY_STACK_BASE;
+    uint32_t value_a, value_b;
+
+    if (a->cpu.status != b->cpu.status)
+        return "status";
+
+    if (a->cpu.steps != b->cpu.steps)
+        return "steps";
+
+    for (uint32_t i = 0 ; i < 8 ; i++) {
+        if (a->cpu.regs[i] != b->cpu.regs[i])
+            return reg_names[i];
+    }
+
+    if ((a->cpu.flags ^ b->cpu.flags) & VERIFY_FLAGS)
+        return "flags";
+
+    if (memcmp(a->data, b->data, VERIFY_DATA_SIZE))
+        return "data";
+
+    if (esp >= VERIFY_STACK_SIZE)
+        return NULL;
+
+    /* only the live part of stack, return addresses may only point to code */
+    for ( ; esp + 4 <= VERIFY_STACK_SIZE ; esp += 4) {
+        memcpy(&value_a, &a->stack[esp], 4);
+        memcpy(&value_b, &b->stack[esp], 4);
+
+        if (value_a != value_b &&
+            (!verify_is_code(&a->cpu, value_a) ||
+             !verify_is_code(&b->cpu, value_b)))
+            return "stack";
+    }
+
+    if (memcmp(&a->stack[esp], &b->stack[esp], VERIFY_STACK_SIZE - esp))
+        return "stack";
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    synth_params params;
+    VerifyRun *state, *a, *b;
+    uint8_t *code, *input, *output;
+    uint32_t variants, states, max_steps, code_size, output_size, seed;
+    uint32_t statuses[EMU_UNSUPPORTED + 1];
+    uint64_t executions = 0, failed = 0, steps = 0;
+    const char *difference;
+    double start, elapsed;
+
+    if (argc > 1 && !strcmp(argv[1], "-h")) {
+        usage(argv[0]);
+        return 0;
+    }
+
+    memset(&params, 0, sizeof(params));
+    memset(statuses, 0, sizeof(statuses));
+
+    variants = argc > 1 ? (uint32_t) atoi(argv[1]) : DEFAULT_VARIANTS;
+    states = argc > 2 ? (uint32_t) atoi(argv[2]) : DEFAULT_STATES;
+    params.insns = argc > 3 ? (uint32_t) atoi(argv[3]) : DEFAULT_INSNS;
+    max_steps = argc > 4 ? (uint32_t) atoi(argv[4]) : DEFAULT_STEPS;
+
+    state = (VerifyRun*) malloc(sizeof(VerifyRun));
+    a = (VerifyRun*) malloc(sizeof(VerifyRun));
+    b = (VerifyRun*) malloc(sizeof(VerifyRun));
+    if (!state || !a || !b) {
+        printf("can't allocate states\n");
+        return 1;
+    }
+
+    printf("verify: %u variants of %u instructions, %u states each, "
+           "%u steps\n", variants, params.insns, states, max_steps);
+
+    start = now();
+
+    for (uint32_t variant = 0 ; variant < variants ; variant++) {
+        /* a new shape of code for every round of builders */
+        params.branch_pct = 5 + variant / VERIFY_BUILDERS % 30;
+        params.routine = 16 + variant / VERIFY_BUILDERS % 100;
+        params.backward = variant / VERIFY_BUILDERS & 1;
+        params.seed = variant / VERIFY_BUILDERS + 1;
+
+        code = synth_generate(&params, &code_size);
+        if (!code) {
+            printf("can't generate code\n");
+            return 1;
+        }
+
+        input = verify_pad(code, code_size);
+        output = verify_build(variant, variant % VERIFY_BUILDERS, code,
+                              code_size, &output_size);
+        if (!input || !output) {
+            printf("can't build variant %u\n", variant);
+            return 1;
+        }
+
+        seed = variant * 0x9E3779B9 + 1;
+
+        for (uint32_t i = 0 ; i < states ; i++) {
+            verify_random_state(state, &seed);
+
+            verify_start(a, state, input, code_size);
+            verify_start(b, state, output, output_size);
+
+            emu_run(&a->cpu, max_steps);
+            emu_run(&b->cpu, max_steps);
+
+            statuses[a->cpu.status]++;
+            steps += a->cpu.steps + b->cpu.steps;
+            executions++;
+
+            difference = verify_compare(a, b);
+            if (!difference)
+                continue;
+
+            if (failed++ < VERIFY_REPORTS) {
+                printf("variant %u (%s) state %u: %s differs, "
+                       "%s/%s after %u/%u steps\n", variant,
+                       builder_names[variant % VERIFY_BUILDERS], i,
+                       difference, status_names[a->cpu.status],
+                       status_names[b->cpu.status], a->cpu.steps,
+                       b->cpu.steps);
+            }
+        }
+
+        free(code);
+        free(input);
+        free(output);
+    }
+
+    elapsed = now() - start;
+
+    printf("final states:");
+    for (uint32_t i = EMU_EXIT ; i <= EMU_UNSUPPORTED ; i++)
+        printf(" %s %u", status_names[i], statuses[i]);
+
+    printf("\n%llu executions, %llu differ, %.0f exec/s, %.0f insn/s, "
+           "%.1f M exec/hour\n", (unsigned long long) executions,
+           (unsigned long long) failed, executions / elapsed,
+           steps / elapsed, executions / elapsed * 3600 / 1e6);
+
+    free(state);
+    free(a);
+    free(b);
+
+    return failed != 0;
+}